@@ -0,0 +1,792 @@
+/////////////////////////////////////////////////////////////////
+// HC08 CPU Core
+// =============================================================
+//
+// Instruction-set simulator for the image smoke test of manage.c
+// (see hc08_cpu.h).
+//
+/////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hc08_cpu.h"
+
+// Instructions
+enum {
+  I_ILLEGAL=0,
+  // Memory/register (0xA0-0xFF, 0x9ED0-0x9EEF)
+  I_SUB, I_CMP, I_SBC, I_CPX, I_AND, I_BIT, I_LDA, I_STA,
+  I_EOR, I_ADC, I_ORA, I_ADD, I_JMP, I_JSR, I_LDX, I_STX,
+  I_AIS, I_AIX, I_BSR,
+  // Read-modify-write (0x30-0x7F, 0x9E60-0x9E6F)
+  I_NEG, I_CBEQ, I_CBEQX, I_COM, I_LSR, I_ROR, I_ASR, I_LSL,
+  I_ROL, I_DEC, I_DBNZ, I_INC, I_TST, I_CLR,
+  I_MUL, I_DIV, I_NSA, I_DAA, I_STHX, I_LDHX, I_CPHX, I_MOV,
+  // Bit manipulation and branches
+  I_BRSET, I_BRCLR, I_BSET, I_BCLR, I_BRANCH,
+  // Control
+  I_RTI, I_RTS, I_SWI, I_TAP, I_TPA, I_PULA, I_PSHA, I_PULX,
+  I_PSHX, I_PULH, I_PSHH, I_CLRH, I_STOP, I_WAIT, I_TXS, I_TSX,
+  I_TAX, I_CLC, I_SEC, I_CLI, I_SEI, I_RSP, I_NOP, I_TXA
+};
+
+// Addressing modes
+enum {
+  M_INH=0,
+  M_IMM, M_IMM16, M_DIR, M_EXT, M_IX2, M_IX1, M_IX, M_SP1, M_SP2,
+  M_REL,                             // Branch only
+  M_A, M_X,                          // Read-modify-write of a register
+  M_IX1P, M_IXP,                     // Indexed, H:X incremented afterwards (CBEQ)
+  M_DD, M_IMD, M_DIXP, M_IXPD        // MOV
+};
+
+typedef struct HC08_Op {
+  unsigned char ins,mode,len,cycles;
+  unsigned char rel;                 // Last byte is a branch offset
+} HC08_Op;
+
+// 0x000-0x0FF: opcodes, 0x100-0x1FF: 0x9E prefixed opcodes
+static HC08_Op hc08_ops[0x200];
+static int hc08_ops_ready=0;
+
+static char *hc08_stop_names[HC08_STOP_COUNT]=
+{
+  "running",
+  "cycle budget used",
+  "reached the marker",
+  "STOP/WAIT",
+  "illegal opcode",
+  "left the image",
+  "ran into erased flash",
+  "stack left RAM",
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Opcode table                                                                    //
+/////////////////////////////////////////////////////////////////////////////////////
+static void hc08_op(int code, int ins, int mode, int len, int cycles, int rel)
+{
+  hc08_ops[code].ins=ins;
+  hc08_ops[code].mode=mode;
+  hc08_ops[code].len=len;
+  hc08_ops[code].cycles=cycles;
+  hc08_ops[code].rel=rel;
+}
+
+static void hc08_build_ops(void)
+{
+  static const unsigned char alu[16]={
+    I_SUB,I_CMP,I_SBC,I_CPX,I_AND,I_BIT,I_LDA,I_STA,
+    I_EOR,I_ADC,I_ORA,I_ADD,I_JMP,I_JSR,I_LDX,I_STX };
+  static const unsigned char rmw[16]={
+    I_NEG,0,0,I_COM,I_LSR,0,I_ROR,I_ASR,
+    I_LSL,I_ROL,I_DEC,0,I_INC,I_TST,0,I_CLR };
+  // Columns: opcode base, mode, bytes, cycles
+  static const unsigned char alu_col[8][4]={
+    {0xA0,M_IMM,2,2},{0xB0,M_DIR,2,3},{0xC0,M_EXT,3,4},{0xD0,M_IX2,3,4},
+    {0xE0,M_IX1,2,3},{0xF0,M_IX,1,2},{0xD0,M_SP2,4,5},{0xE0,M_SP1,3,4} };
+  static const unsigned char rmw_col[6][4]={
+    {0x30,M_DIR,2,4},{0x40,M_A,1,1},{0x50,M_X,1,1},{0x60,M_IX1,2,4},
+    {0x70,M_IX,1,3},{0x60,M_SP1,3,5} };
+  static const unsigned char control[32]={
+    I_RTI,I_RTS,0,I_SWI,I_TAP,I_TPA,I_PULA,I_PSHA,
+    I_PULX,I_PSHX,I_PULH,I_PSHH,I_CLRH,0,I_STOP,I_WAIT,
+    I_BRANCH,I_BRANCH,I_BRANCH,I_BRANCH,I_TXS,I_TSX,0,I_TAX,
+    I_CLC,I_SEC,I_CLI,I_SEI,I_RSP,I_NOP,0,I_TXA };
+  static const unsigned char control_cycles[32]={
+    7,4,0,9,2,1,2,2, 2,2,2,2,1,0,1,1,
+    3,3,3,3,2,2,0,1, 1,1,2,2,1,1,0,1 };
+  int i,c,code,cycles;
+
+  memset(hc08_ops,0,sizeof(hc08_ops));
+
+  // Bit manipulation
+  for(i=0;i<16;i++) {
+    hc08_op(0x00+i, i&1 ? I_BRCLR : I_BRSET, M_DIR, 3, 5, 1);
+    hc08_op(0x10+i, i&1 ? I_BCLR : I_BSET, M_DIR, 2, 4, 0);
+    hc08_op(0x20+i, I_BRANCH, M_REL, 2, 3, 1);
+  }
+
+  // Read-modify-write
+  for(c=0;c<6;c++) {
+    for(i=0;i<16;i++) {
+      if(rmw[i] == 0) {
+        continue;
+      }
+      code = (c == 5 ? 0x100 : 0) + rmw_col[c][0] + i;
+      cycles=rmw_col[c][3];
+      if((rmw[i] == I_TST || rmw[i] == I_CLR) && cycles > 1) {
+        cycles--;
+      }
+      hc08_op(code, rmw[i], rmw_col[c][1], rmw_col[c][2], cycles, 0);
+    }
+  }
+  hc08_op(0x31,  I_CBEQ,  M_DIR,  3, 5, 1);
+  hc08_op(0x41,  I_CBEQ,  M_IMM,  3, 4, 1);
+  hc08_op(0x51,  I_CBEQX, M_IMM,  3, 4, 1);
+  hc08_op(0x61,  I_CBEQ,  M_IX1P, 3, 5, 1);
+  hc08_op(0x71,  I_CBEQ,  M_IXP,  2, 4, 1);
+  hc08_op(0x161, I_CBEQ,  M_SP1,  4, 6, 1);
+  hc08_op(0x3B,  I_DBNZ,  M_DIR,  3, 5, 1);
+  hc08_op(0x4B,  I_DBNZ,  M_A,    2, 3, 1);
+  hc08_op(0x5B,  I_DBNZ,  M_X,    2, 3, 1);
+  hc08_op(0x6B,  I_DBNZ,  M_IX1,  3, 5, 1);
+  hc08_op(0x7B,  I_DBNZ,  M_IX,   2, 4, 1);
+  hc08_op(0x16B, I_DBNZ,  M_SP1,  4, 6, 1);
+  hc08_op(0x42,  I_MUL,   M_INH,  1, 5, 0);
+  hc08_op(0x52,  I_DIV,   M_INH,  1, 7, 0);
+  hc08_op(0x62,  I_NSA,   M_INH,  1, 3, 0);
+  hc08_op(0x72,  I_DAA,   M_INH,  1, 2, 0);
+  hc08_op(0x35,  I_STHX,  M_DIR,  2, 4, 0);
+  hc08_op(0x45,  I_LDHX,  M_IMM16,3, 3, 0);
+  hc08_op(0x55,  I_LDHX,  M_DIR,  2, 4, 0);
+  hc08_op(0x65,  I_CPHX,  M_IMM16,3, 3, 0);
+  hc08_op(0x75,  I_CPHX,  M_DIR,  2, 4, 0);
+  hc08_op(0x4E,  I_MOV,   M_DD,   3, 5, 0);
+  hc08_op(0x5E,  I_MOV,   M_DIXP, 2, 4, 0);
+  hc08_op(0x6E,  I_MOV,   M_IMD,  3, 4, 0);
+  hc08_op(0x7E,  I_MOV,   M_IXPD, 2, 4, 0);
+
+  // Control
+  for(i=0;i<32;i++) {
+    if(control[i]) {
+      hc08_op(0x80+i, control[i], i>=0x10 && i<=0x13 ? M_REL : M_INH,
+              i>=0x10 && i<=0x13 ? 2 : 1, control_cycles[i], i>=0x10 && i<=0x13);
+    }
+  }
+
+  // Register/memory (no JMP/JSR with the stack pointer)
+  for(c=0;c<8;c++) {
+    for(i=0;i<16;i++) {
+      if(c >= 6 && (alu[i] == I_JMP || alu[i] == I_JSR)) {
+        continue;
+      }
+      code = (c >= 6 ? 0x100 : 0) + alu_col[c][0] + i;
+      cycles=alu_col[c][3];
+      if(alu[i] == I_JMP) {
+        cycles -= (alu_col[c][1] == M_DIR || alu_col[c][1] == M_EXT);
+      } else if(alu[i] == I_JSR) {
+        cycles += (alu_col[c][1] == M_DIR || alu_col[c][1] == M_EXT) ? 1 : 2;
+      }
+      hc08_op(code, alu[i], alu_col[c][1], alu_col[c][2], cycles, 0);
+    }
+  }
+  hc08_op(0xA7, I_AIS, M_IMM, 2, 2, 0);
+  hc08_op(0xAF, I_AIX, M_IMM, 2, 2, 0);
+  hc08_op(0xAC, I_ILLEGAL, M_INH, 1, 1, 0);
+  hc08_op(0xAD, I_BSR, M_REL, 2, 4, 1);
+
+  hc08_ops_ready=1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Bus                                                                             //
+/////////////////////////////////////////////////////////////////////////////////////
+static unsigned int hc08_read(HC08_Cpu *cpu, unsigned int addr)
+{
+  return cpu->mem[addr & 0xffff];
+}
+
+static unsigned int hc08_read16(HC08_Cpu *cpu, unsigned int addr)
+{
+  return (hc08_read(cpu,addr)<<8) | hc08_read(cpu,addr+1);
+}
+
+static void hc08_write(HC08_Cpu *cpu, unsigned int addr, unsigned int v)
+{
+  unsigned int i;
+
+  addr&=0xffff;
+  switch(cpu->attr[addr]) {
+  case HC08_MEM_RAM:
+    // Code in RAM: drop the decoded instructions that may cover this byte
+    for(i=0;i<4;i++) {
+      cpu->cache[(addr-i) & 0xffff].valid=0;
+    }
+    cpu->mem[addr]=v;
+    break;
+  case HC08_MEM_IO:
+    cpu->mem[addr]=v;
+    break;
+  default:
+    // Flash is programmed through the ICP firmware, not by plain writes
+    break;
+  }
+}
+
+static void hc08_push(HC08_Cpu *cpu, unsigned int v)
+{
+  if(cpu->attr[cpu->sp] != HC08_MEM_RAM) {
+    cpu->stop=HC08_STOP_STACK;
+  }
+  hc08_write(cpu,cpu->sp,v);
+  cpu->sp--;
+}
+
+static unsigned int hc08_pull(HC08_Cpu *cpu)
+{
+  cpu->sp++;
+  return hc08_read(cpu,cpu->sp);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Flags                                                                           //
+/////////////////////////////////////////////////////////////////////////////////////
+static void hc08_flag(HC08_Cpu *cpu, unsigned int flag, int on)
+{
+  if(on) {
+    cpu->ccr|=flag;
+  } else {
+    cpu->ccr&=~flag;
+  }
+}
+
+// N and Z of an 8-bit result, V cleared
+static void hc08_nz(HC08_Cpu *cpu, unsigned int r)
+{
+  hc08_flag(cpu,HC08_CCR_N,r & 0x80);
+  hc08_flag(cpu,HC08_CCR_Z,(r & 0xff) == 0);
+  cpu->ccr&=~HC08_CCR_V;
+}
+
+// N and Z of a 16-bit result, V cleared
+static void hc08_nz16(HC08_Cpu *cpu, unsigned int r)
+{
+  hc08_flag(cpu,HC08_CCR_N,r & 0x8000);
+  hc08_flag(cpu,HC08_CCR_Z,(r & 0xffff) == 0);
+  cpu->ccr&=~HC08_CCR_V;
+}
+
+static unsigned int hc08_add(HC08_Cpu *cpu, unsigned int a, unsigned int m, unsigned int c)
+{
+  unsigned int r=a+m+c;
+
+  hc08_nz(cpu,r);
+  hc08_flag(cpu,HC08_CCR_V,(a^r) & (m^r) & 0x80);
+  hc08_flag(cpu,HC08_CCR_H,(a^m^r) & 0x10);
+  hc08_flag(cpu,HC08_CCR_C,r > 0xff);
+  return r & 0xff;
+}
+
+static unsigned int hc08_sub(HC08_Cpu *cpu, unsigned int a, unsigned int m, unsigned int c)
+{
+  unsigned int r=a-m-c;
+
+  hc08_nz(cpu,r);
+  hc08_flag(cpu,HC08_CCR_V,(a^m) & (a^r) & 0x80);
+  hc08_flag(cpu,HC08_CCR_C,a < m+c);
+  return r & 0xff;
+}
+
+// Shifts and rotates: V = N ^ C
+static unsigned int hc08_shift(HC08_Cpu *cpu, unsigned int r, unsigned int c)
+{
+  hc08_nz(cpu,r);
+  hc08_flag(cpu,HC08_CCR_C,c);
+  hc08_flag(cpu,HC08_CCR_V,((r & 0x80) != 0) != (c != 0));
+  return r & 0xff;
+}
+
+static int hc08_condition(HC08_Cpu *cpu, unsigned int opcode)
+{
+  unsigned int ccr=cpu->ccr;
+  int c=ccr & HC08_CCR_C, z=(ccr & HC08_CCR_Z) != 0;
+  int nv=((ccr & HC08_CCR_N) != 0) != ((ccr & HC08_CCR_V) != 0);
+  int taken;
+
+  switch(opcode & 0xfe) {
+  case 0x20: taken=1; break;                  // BRA/BRN
+  case 0x22: taken=!(c || z); break;          // BHI/BLS
+  case 0x24: taken=!c; break;                 // BCC/BCS
+  case 0x26: taken=!z; break;                 // BNE/BEQ
+  case 0x28: taken=!(ccr & HC08_CCR_H); break; // BHCC/BHCS
+  case 0x2A: taken=!(ccr & HC08_CCR_N); break; // BPL/BMI
+  case 0x2C: taken=!(ccr & HC08_CCR_I); break; // BMC/BMS
+  case 0x2E: taken=0; break;                  // BIL/BIH: the IRQ pin is high
+  case 0x90: taken=!nv; break;                // BGE/BLT
+  case 0x92: taken=!(z || nv); break;         // BGT/BLE
+  default:   taken=0; break;
+  }
+  return (opcode & 1) ? !taken : taken;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Decode                                                                          //
+/////////////////////////////////////////////////////////////////////////////////////
+static int hc08_decode(HC08_Cpu *cpu, unsigned int pc, HC08_Decoded *d)
+{
+  const HC08_Op *op;
+  unsigned int code,p,i;
+
+  if(cpu->attr[pc] < HC08_MEM_RAM) {
+    cpu->stop=HC08_STOP_BAD_PC;
+    return(-1);
+  }
+  if(cpu->attr[pc] == HC08_MEM_ROM && cpu->mem[pc] == 0xff
+     && cpu->mem[(pc+1) & 0xffff] == 0xff) {
+    cpu->stop=HC08_STOP_ERASED;
+    return(-1);
+  }
+
+  code=cpu->mem[pc];
+  p=pc+1;
+  if(code == 0x9E) {
+    code=0x100 | hc08_read(cpu,p);
+    p++;
+  }
+  op=&hc08_ops[code];
+  if(op->ins == I_ILLEGAL) {
+    cpu->stop=HC08_STOP_ILLEGAL;
+    return(-1);
+  }
+  for(i=1;i<op->len;i++) {
+    if(cpu->attr[(pc+i) & 0xffff] < HC08_MEM_RAM) {
+      cpu->stop=HC08_STOP_BAD_PC;
+      return(-1);
+    }
+  }
+
+  d->opcode=code & 0xff;
+  d->ins=op->ins;
+  d->mode=op->mode;
+  d->len=op->len;
+  d->cycles=op->cycles;
+  d->op1=0;
+  d->op2=0;
+
+  switch(op->mode) {
+  case M_IMM: case M_DIR: case M_IX1: case M_SP1: case M_IX1P:
+  case M_DIXP: case M_IXPD:
+    d->op1=hc08_read(cpu,p);
+    break;
+  case M_IMM16: case M_EXT: case M_IX2: case M_SP2:
+    d->op1=hc08_read16(cpu,p);
+    break;
+  case M_DD: case M_IMD:
+    d->op1=hc08_read(cpu,p);
+    d->op2=hc08_read(cpu,p+1);
+    break;
+  }
+  if(op->rel) {
+    d->op2=(pc+op->len+(signed char)hc08_read(cpu,pc+op->len-1)) & 0xffff;
+  }
+
+  d->valid=1;
+  cpu->decoded++;
+  return(0);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Execute                                                                         //
+/////////////////////////////////////////////////////////////////////////////////////
+static unsigned int hc08_ea(HC08_Cpu *cpu, const HC08_Decoded *d)
+{
+  unsigned int hx=(cpu->h<<8) | cpu->x;
+
+  switch(d->mode) {
+  case M_IX2: case M_IX1: case M_IX1P:
+    return (d->op1+hx) & 0xffff;
+  case M_IX: case M_IXP:
+    return hx;
+  case M_SP1: case M_SP2:
+    return (d->op1+cpu->sp) & 0xffff;
+  default:
+    return d->op1;
+  }
+}
+
+static unsigned int hc08_operand(HC08_Cpu *cpu, const HC08_Decoded *d)
+{
+  switch(d->mode) {
+  case M_IMM:
+    return d->op1;
+  case M_A:
+    return cpu->a;
+  case M_X:
+    return cpu->x;
+  default:
+    return hc08_read(cpu,hc08_ea(cpu,d));
+  }
+}
+
+static void hc08_store(HC08_Cpu *cpu, const HC08_Decoded *d, unsigned int v)
+{
+  switch(d->mode) {
+  case M_A:
+    cpu->a=v;
+    break;
+  case M_X:
+    cpu->x=v;
+    break;
+  default:
+    hc08_write(cpu,hc08_ea(cpu,d),v);
+    break;
+  }
+}
+
+static void hc08_set_hx(HC08_Cpu *cpu, unsigned int hx)
+{
+  cpu->h=(hx>>8) & 0xff;
+  cpu->x=hx & 0xff;
+}
+
+static void hc08_call(HC08_Cpu *cpu, unsigned int target)
+{
+  hc08_push(cpu,cpu->pc & 0xff);
+  hc08_push(cpu,cpu->pc>>8);
+  cpu->pc=target;
+}
+
+static void hc08_execute(HC08_Cpu *cpu, const HC08_Decoded *d)
+{
+  unsigned int m,r,hx,c=cpu->ccr & HC08_CCR_C;
+
+  cpu->pc=(cpu->pc+d->len) & 0xffff;
+  hx=(cpu->h<<8) | cpu->x;
+
+  switch(d->ins) {
+
+  // Memory/register
+  case I_SUB: cpu->a=hc08_sub(cpu,cpu->a,hc08_operand(cpu,d),0); break;
+  case I_SBC: cpu->a=hc08_sub(cpu,cpu->a,hc08_operand(cpu,d),c); break;
+  case I_CMP: hc08_sub(cpu,cpu->a,hc08_operand(cpu,d),0); break;
+  case I_CPX: hc08_sub(cpu,cpu->x,hc08_operand(cpu,d),0); break;
+  case I_ADD: cpu->a=hc08_add(cpu,cpu->a,hc08_operand(cpu,d),0); break;
+  case I_ADC: cpu->a=hc08_add(cpu,cpu->a,hc08_operand(cpu,d),c); break;
+  case I_AND: cpu->a&=hc08_operand(cpu,d); hc08_nz(cpu,cpu->a); break;
+  case I_ORA: cpu->a|=hc08_operand(cpu,d); hc08_nz(cpu,cpu->a); break;
+  case I_EOR: cpu->a^=hc08_operand(cpu,d); hc08_nz(cpu,cpu->a); break;
+  case I_BIT: hc08_nz(cpu,cpu->a & hc08_operand(cpu,d)); break;
+  case I_LDA: cpu->a=hc08_operand(cpu,d); hc08_nz(cpu,cpu->a); break;
+  case I_LDX: cpu->x=hc08_operand(cpu,d); hc08_nz(cpu,cpu->x); break;
+  case I_STA: hc08_write(cpu,hc08_ea(cpu,d),cpu->a); hc08_nz(cpu,cpu->a); break;
+  case I_STX: hc08_write(cpu,hc08_ea(cpu,d),cpu->x); hc08_nz(cpu,cpu->x); break;
+  case I_JMP: cpu->pc=hc08_ea(cpu,d); break;
+  case I_JSR: hc08_call(cpu,hc08_ea(cpu,d)); break;
+  case I_BSR: hc08_call(cpu,d->op2); break;
+  case I_AIS: cpu->sp=(cpu->sp+(signed char)d->op1) & 0xffff; break;
+  case I_AIX: hc08_set_hx(cpu,hx+(signed char)d->op1); break;
+
+  // Read-modify-write
+  case I_NEG:
+    m=hc08_operand(cpu,d);
+    r=hc08_sub(cpu,0,m,0);
+    hc08_store(cpu,d,r);
+    break;
+  case I_COM:
+    r=~hc08_operand(cpu,d) & 0xff;
+    hc08_nz(cpu,r);
+    cpu->ccr|=HC08_CCR_C;
+    hc08_store(cpu,d,r);
+    break;
+  case I_LSR:
+    m=hc08_operand(cpu,d);
+    hc08_store(cpu,d,hc08_shift(cpu,m>>1,m & 1));
+    break;
+  case I_ROR:
+    m=hc08_operand(cpu,d);
+    hc08_store(cpu,d,hc08_shift(cpu,(m>>1) | (c<<7),m & 1));
+    break;
+  case I_ASR:
+    m=hc08_operand(cpu,d);
+    hc08_store(cpu,d,hc08_shift(cpu,(m>>1) | (m & 0x80),m & 1));
+    break;
+  case I_LSL:
+    m=hc08_operand(cpu,d);
+    hc08_store(cpu,d,hc08_shift(cpu,m<<1,m & 0x80));
+    break;
+  case I_ROL:
+    m=hc08_operand(cpu,d);
+    hc08_store(cpu,d,hc08_shift(cpu,(m<<1) | c,m & 0x80));
+    break;
+  case I_DEC:
+    m=hc08_operand(cpu,d);
+    r=(m-1) & 0xff;
+    hc08_nz(cpu,r);
+    hc08_flag(cpu,HC08_CCR_V,m == 0x80);
+    hc08_store(cpu,d,r);
+    break;
+  case I_INC:
+    m=hc08_operand(cpu,d);
+    r=(m+1) & 0xff;
+    hc08_nz(cpu,r);
+    hc08_flag(cpu,HC08_CCR_V,r == 0x80);
+    hc08_store(cpu,d,r);
+    break;
+  case I_TST:
+    hc08_nz(cpu,hc08_operand(cpu,d));
+    break;
+  case I_CLR:
+    hc08_nz(cpu,0);
+    hc08_store(cpu,d,0);
+    break;
+  case I_DBNZ:
+    r=(hc08_operand(cpu,d)-1) & 0xff;
+    hc08_store(cpu,d,r);
+    if(r) {
+      cpu->pc=d->op2;
+    }
+    break;
+  case I_CBEQ:
+  case I_CBEQX:
+    m=hc08_operand(cpu,d);
+    if(d->mode == M_IX1P || d->mode == M_IXP) {
+      hc08_set_hx(cpu,hx+1);
+    }
+    if(m == (d->ins == I_CBEQX ? cpu->x : cpu->a)) {
+      cpu->pc=d->op2;
+    }
+    break;
+  case I_MUL:
+    r=cpu->x*cpu->a;
+    cpu->x=r>>8;
+    cpu->a=r & 0xff;
+    cpu->ccr&=~(HC08_CCR_H | HC08_CCR_C);
+    break;
+  case I_DIV:
+    m=(cpu->h<<8) | cpu->a;
+    if(cpu->x == 0 || m/cpu->x > 0xff) {
+      cpu->ccr|=HC08_CCR_C;              // Quotient and remainder undefined
+    } else {
+      cpu->a=m/cpu->x;
+      cpu->h=m%cpu->x;
+      cpu->ccr&=~HC08_CCR_C;
+      hc08_flag(cpu,HC08_CCR_Z,cpu->a == 0);
+    }
+    break;
+  case I_NSA:
+    cpu->a=((cpu->a<<4) | (cpu->a>>4)) & 0xff;
+    break;
+  case I_DAA:
+    m=0;
+    if((cpu->ccr & HC08_CCR_H) || (cpu->a & 0x0f) > 9) {
+      m|=0x06;
+    }
+    if(c || cpu->a > 0x99) {
+      m|=0x60;
+      c=1;
+    }
+    cpu->a=(cpu->a+m) & 0xff;
+    r=cpu->ccr & HC08_CCR_V;             // V is undefined, keep it
+    hc08_nz(cpu,cpu->a);
+    cpu->ccr|=r;
+    hc08_flag(cpu,HC08_CCR_C,c);
+    break;
+  case I_STHX:
+    hc08_write(cpu,d->op1,cpu->h);
+    hc08_write(cpu,d->op1+1,cpu->x);
+    hc08_nz16(cpu,hx);
+    break;
+  case I_LDHX:
+    r = d->mode == M_IMM16 ? d->op1 : hc08_read16(cpu,d->op1);
+    hc08_set_hx(cpu,r);
+    hc08_nz16(cpu,r);
+    break;
+  case I_CPHX:
+    m = d->mode == M_IMM16 ? d->op1 : hc08_read16(cpu,d->op1);
+    r=(hx-m) & 0xffff;
+    hc08_nz16(cpu,r);
+    hc08_flag(cpu,HC08_CCR_V,(hx^m) & (hx^r) & 0x8000);
+    hc08_flag(cpu,HC08_CCR_C,hx < m);
+    break;
+  case I_MOV:
+    switch(d->mode) {
+    case M_DD:   r=hc08_read(cpu,d->op1); hc08_write(cpu,d->op2,r); break;
+    case M_IMD:  r=d->op1; hc08_write(cpu,d->op2,r); break;
+    case M_DIXP: r=hc08_read(cpu,d->op1); hc08_write(cpu,hx,r); hc08_set_hx(cpu,hx+1); break;
+    default:     r=hc08_read(cpu,hx); hc08_write(cpu,d->op1,r); hc08_set_hx(cpu,hx+1); break;
+    }
+    hc08_nz(cpu,r);
+    break;
+
+  // Bit manipulation and branches
+  case I_BRSET:
+  case I_BRCLR:
+    m=(hc08_read(cpu,d->op1)>>((d->opcode>>1) & 7)) & 1;
+    hc08_flag(cpu,HC08_CCR_C,m);
+    if(m == (d->ins == I_BRSET)) {
+      cpu->pc=d->op2;
+    }
+    break;
+  case I_BSET:
+    hc08_write(cpu,d->op1,hc08_read(cpu,d->op1) | (1<<((d->opcode>>1) & 7)));
+    break;
+  case I_BCLR:
+    hc08_write(cpu,d->op1,hc08_read(cpu,d->op1) & ~(1<<((d->opcode>>1) & 7)));
+    break;
+  case I_BRANCH:
+    if(hc08_condition(cpu,d->opcode)) {
+      cpu->pc=d->op2;
+    }
+    break;
+
+  // Control
+  case I_RTI:
+    cpu->ccr=hc08_pull(cpu) | 0x60;
+    cpu->a=hc08_pull(cpu);
+    cpu->x=hc08_pull(cpu);
+    r=hc08_pull(cpu)<<8;
+    cpu->pc=r | hc08_pull(cpu);
+    break;
+  case I_RTS:
+    r=hc08_pull(cpu)<<8;
+    cpu->pc=r | hc08_pull(cpu);
+    break;
+  case I_SWI:
+    hc08_push(cpu,cpu->pc & 0xff);
+    hc08_push(cpu,cpu->pc>>8);
+    hc08_push(cpu,cpu->x);
+    hc08_push(cpu,cpu->a);
+    hc08_push(cpu,cpu->ccr);
+    cpu->ccr|=HC08_CCR_I;
+    cpu->pc=hc08_read16(cpu,cpu->swi_vector);
+    break;
+  case I_TAP:  cpu->ccr=cpu->a | 0x60; break;
+  case I_TPA:  cpu->a=cpu->ccr; break;
+  case I_PULA: cpu->a=hc08_pull(cpu); break;
+  case I_PULX: cpu->x=hc08_pull(cpu); break;
+  case I_PULH: cpu->h=hc08_pull(cpu); break;
+  case I_PSHA: hc08_push(cpu,cpu->a); break;
+  case I_PSHX: hc08_push(cpu,cpu->x); break;
+  case I_PSHH: hc08_push(cpu,cpu->h); break;
+  case I_CLRH: cpu->h=0; break;
+  case I_STOP:
+  case I_WAIT:
+    cpu->ccr&=~HC08_CCR_I;
+    cpu->stop=HC08_STOP_HALT;
+    break;
+  case I_TXS:  cpu->sp=(hx-1) & 0xffff; break;
+  case I_TSX:  hc08_set_hx(cpu,cpu->sp+1); break;
+  case I_TAX:  cpu->x=cpu->a; break;
+  case I_TXA:  cpu->a=cpu->x; break;
+  case I_CLC:  cpu->ccr&=~HC08_CCR_C; break;
+  case I_SEC:  cpu->ccr|=HC08_CCR_C; break;
+  case I_CLI:  cpu->ccr&=~HC08_CCR_I; break;
+  case I_SEI:  cpu->ccr|=HC08_CCR_I; break;
+  case I_RSP:  cpu->sp=(cpu->sp & 0xff00) | 0xff; break;
+  case I_NOP:  break;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// HC08_Create                                                                     //
+// ===========                                                                     //
+// - New CPU with nothing mapped                                                   //
+/////////////////////////////////////////////////////////////////////////////////////
+HC08_Cpu *HC08_Create(void)
+{
+  HC08_Cpu *cpu;
+
+  if(!hc08_ops_ready) {
+    hc08_build_ops();
+  }
+  if((cpu=calloc(1,sizeof(HC08_Cpu))) == NULL) {
+    return(NULL);
+  }
+  memset(cpu->mem,0xff,sizeof(cpu->mem));
+  return(cpu);
+}
+
+void HC08_Free(HC08_Cpu *cpu)
+{
+  free(cpu);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// HC08_Map                                                                        //
+// ========                                                                        //
+// - Sets the type of the addresses start..end. IO and RAM start cleared.          //
+/////////////////////////////////////////////////////////////////////////////////////
+void HC08_Map(HC08_Cpu *cpu, unsigned int start, unsigned int end, int type)
+{
+  unsigned int i;
+
+  for(i=start;i<=end && i<0x10000;i++) {
+    cpu->attr[i]=type;
+    cpu->mem[i] = (type == HC08_MEM_IO || type == HC08_MEM_RAM) ? 0 : 0xff;
+    cpu->cache[i].valid=0;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// HC08_Load                                                                       //
+// =========                                                                       //
+// - Copies data (e.g. the flash image) to memory, whatever the type               //
+/////////////////////////////////////////////////////////////////////////////////////
+void HC08_Load(HC08_Cpu *cpu, unsigned int addr, const unsigned char *data, unsigned int len)
+{
+  unsigned int i;
+
+  for(i=0;i<len && addr+i<0x10000;i++) {
+    cpu->mem[addr+i]=data[i];
+  }
+  memset(cpu->cache,0,sizeof(cpu->cache));
+}
+
+unsigned int HC08_Vector(HC08_Cpu *cpu, unsigned int vector)
+{
+  return hc08_read16(cpu,vector);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// HC08_Reset                                                                      //
+// ==========                                                                      //
+// - Reset state of the CPU08: SP=0x00FF, H=0, I set, PC from the vector           //
+/////////////////////////////////////////////////////////////////////////////////////
+void HC08_Reset(HC08_Cpu *cpu, unsigned int vector)
+{
+  cpu->a=0;
+  cpu->x=0;
+  cpu->h=0;
+  cpu->ccr=0x60 | HC08_CCR_I;
+  cpu->sp=0x00ff;
+  cpu->swi_vector=(vector-2) & 0xffff;
+  cpu->pc=hc08_read16(cpu,vector);
+  cpu->stop=HC08_STOP_NONE;
+  cpu->stop_pc=cpu->pc;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// HC08_Run                                                                        //
+// ========                                                                        //
+// - Runs until the cycles are used, the PC reaches marker (-1 = none) or the      //
+//   program fails. Returns HC08_STOP_xxx.                                         //
+/////////////////////////////////////////////////////////////////////////////////////
+int HC08_Run(HC08_Cpu *cpu, unsigned long long cycles, long marker)
+{
+  HC08_Decoded *d;
+  unsigned long long end=cpu->cycles+cycles;
+
+  cpu->stop=HC08_STOP_NONE;
+  while(cpu->stop == HC08_STOP_NONE) {
+    cpu->stop_pc=cpu->pc;
+    if((long)cpu->pc == marker) {
+      cpu->stop=HC08_STOP_MARKER;
+      break;
+    }
+    if(cpu->cycles >= end) {
+      cpu->stop=HC08_STOP_BUDGET;
+      break;
+    }
+    d=&cpu->cache[cpu->pc];
+    if(!d->valid && hc08_decode(cpu,cpu->pc,d) != 0) {
+      break;
+    }
+    hc08_execute(cpu,d);
+    cpu->cycles+=d->cycles;
+    cpu->instructions++;
+  }
+  return(cpu->stop);
+}
+
+char *HC08_StopName(int stop)
+{
+  return (stop >= 0 && stop < HC08_STOP_COUNT) ? hc08_stop_names[stop] : "?";
+}
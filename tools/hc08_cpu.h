@@ -0,0 +1,88 @@
+/////////////////////////////////////////////////////////////////
+// HC08 CPU Core - instruction-set simulator for image smoke tests
+// =============================================================
+//
+// Cycle-approximate CPU08 core (68HC08 instruction set, no
+// peripherals). manage.c boots the loaded image from its reset
+// vector for a bounded number of cycles before anything is erased,
+// and rejects images that execute an illegal opcode, run off the
+// image or into erased flash, or push the stack out of RAM.
+//
+// Instructions are decoded once per address into a cache; writes
+// to RAM invalidate the entries they may overlap, so code copied
+// to RAM runs correctly too. Cycle counts are the CPU08 table
+// counts, without wait states or interrupts.
+//
+// Memory map: every address is NONE (reads 0xFF, writes are
+// ignored, no code), IO (plain read/write registers), RAM or ROM
+// (the flash image, read-only to the program).
+//
+/////////////////////////////////////////////////////////////////
+
+#ifndef HC08_CPU_H
+#define HC08_CPU_H
+
+#define HC08_MEM_NONE 0
+#define HC08_MEM_IO   1
+#define HC08_MEM_RAM  2
+#define HC08_MEM_ROM  3
+
+// Why HC08_Run returned
+#define HC08_STOP_NONE    0
+#define HC08_STOP_BUDGET  1             // Ran all the cycles
+#define HC08_STOP_MARKER  2             // Reached the marker address
+#define HC08_STOP_HALT    3             // STOP or WAIT instruction
+#define HC08_STOP_ILLEGAL 4             // Illegal opcode (an illegal opcode reset on the chip)
+#define HC08_STOP_BAD_PC  5             // Instruction fetch outside RAM and ROM
+#define HC08_STOP_ERASED  6             // Instruction fetch from erased (0xFF 0xFF) flash
+#define HC08_STOP_STACK   7             // Push outside RAM
+#define HC08_STOP_COUNT   8
+
+// CCR bits
+#define HC08_CCR_V 0x80
+#define HC08_CCR_H 0x10
+#define HC08_CCR_I 0x08
+#define HC08_CCR_N 0x04
+#define HC08_CCR_Z 0x02
+#define HC08_CCR_C 0x01
+
+// One decoded instruction
+typedef struct HC08_Decoded {
+  unsigned char valid;
+  unsigned char opcode;              // Last opcode byte (after a 0x9E prefix)
+  unsigned char ins;                 // Instruction
+  unsigned char mode;                // Addressing mode
+  unsigned char len;                 // Bytes
+  unsigned char cycles;              // Bus cycles
+  unsigned short op1;                // Address, offset or immediate
+  unsigned short op2;                // Branch target, or second address (MOV)
+} HC08_Decoded;
+
+typedef struct HC08_Cpu {
+
+  unsigned char a,x,h,ccr;           // Registers
+  unsigned short sp,pc;
+  unsigned short swi_vector;         // Just below the reset vector, as in the chip's table
+
+  unsigned long long cycles;         // Since HC08_Create
+  unsigned long long instructions;
+  unsigned long long decoded;        // Cache misses
+  int stop;                          // HC08_STOP_xxx of the last run
+  unsigned short stop_pc;            // Where it stopped
+
+  unsigned char mem[0x10000];
+  unsigned char attr[0x10000];       // HC08_MEM_xxx
+  HC08_Decoded cache[0x10000];       // Decoded instruction per address
+
+} HC08_Cpu;
+
+HC08_Cpu *HC08_Create(void);
+void HC08_Free(HC08_Cpu *cpu);
+void HC08_Map(HC08_Cpu *cpu, unsigned int start, unsigned int end, int type);
+void HC08_Load(HC08_Cpu *cpu, unsigned int addr, const unsigned char *data, unsigned int len);
+unsigned int HC08_Vector(HC08_Cpu *cpu, unsigned int vector);
+void HC08_Reset(HC08_Cpu *cpu, unsigned int vector);
+int HC08_Run(HC08_Cpu *cpu, unsigned long long cycles, long marker);
+char *HC08_StopName(int stop);
+
+#endif
@@ -0,0 +1,486 @@
+/////////////////////////////////////////////////////////////////
+// HC908JB8 USB ICP Manager - Python bindings
+// =============================================================
+//
+// CPython extension module "hrm" over the flashing functions of
+// manage.c, for test scripts that drive boards in-process instead
+// of starting manage for each of them.
+//
+//   import hrm
+//   s = hrm.Session(usb="001/002")     # usb=None: the first board
+//   image = s.load("app.s19")          # memoryview of the image, no copy
+//   s.smoke_test()
+//   s.open()
+//   s.erase()
+//   s.program(progress=lambda done, total: ...)
+//   ok = s.verify()
+//   s.close()
+//
+// The GIL is released while a call waits for the device, so boards
+// can be driven from several threads, one Session per board. The
+// progress callback runs in the calling thread; an exception in it
+// is raised when program() returns. Failures raise hrm.Error with
+// (errorcode, message).
+//
+// Compile:
+// ========
+// Linux: gcc -shared -fPIC $(python3-config --includes) hrm_python.c hc08_cpu.c
+//            -o hrm$(python3-config --extension-suffix) -lusb -lpthread -O2 -Wall
+//
+// Simulator: add -DHRM_SIM and hrm_sim.c, drop -lusb
+//
+/////////////////////////////////////////////////////////////////
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+// The flashing engine, without its main()
+#define HRM_LIBRARY
+#include "manage.c"
+
+typedef struct HRM_PySession {
+  PyObject_HEAD
+  HRM_Data *hrm;
+  PyObject *progress;                // Callable of the running program() call
+  int progress_failed;               // The callback raised
+  int busy;                          // A call runs without the GIL
+} HRM_PySession;
+
+static PyObject *hrm_py_error;
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Helpers                                                                         //
+/////////////////////////////////////////////////////////////////////////////////////
+static PyObject *hrm_py_raise(HRM_Data *hrm)
+{
+  char message[64];
+  int code=hrm->last_errorcode;
+  size_t n;
+
+  snprintf(message,sizeof(message),"%s",HRM_Errors[code]);
+  n=strlen(message);
+  if(n && message[n-1] == '\n') {
+    message[n-1]=0;
+  }
+  PyErr_SetObject(hrm_py_error,Py_BuildValue("(is)",code,message));
+  return(NULL);
+}
+
+// One call at a time per session: the engine state is not locked
+static int hrm_py_enter(HRM_PySession *s)
+{
+  if(s->busy) {
+    PyErr_SetString(PyExc_RuntimeError,"session is busy in another thread");
+    return(-1);
+  }
+  s->busy=1;
+  s->hrm->last_errorcode=0;
+  return(0);
+}
+
+static int hrm_py_need_device(HRM_PySession *s)
+{
+  if(s->hrm->usb_dev == NULL) {
+    PyErr_SetString(PyExc_RuntimeError,"device is not open");
+    return(-1);
+  }
+  return(0);
+}
+
+static void hrm_py_progress(void *ctx, unsigned int done, unsigned int total)
+{
+  HRM_PySession *s=ctx;
+  PyGILState_STATE gil;
+  PyObject *result;
+
+  if(s->progress_failed) {
+    return;
+  }
+  gil=PyGILState_Ensure();
+  result=PyObject_CallFunction(s->progress,"II",done,total);
+  if(result == NULL) {
+    s->progress_failed=1;            // The exception stays set for program()
+  }
+  Py_XDECREF(result);
+  PyGILState_Release(gil);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Session                                                                         //
+/////////////////////////////////////////////////////////////////////////////////////
+static PyObject *hrm_py_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+  HRM_PySession *s;
+
+  if((s=(HRM_PySession *)type->tp_alloc(type,0)) == NULL) {
+    return(NULL);
+  }
+  if((s->hrm=calloc(1,sizeof(HRM_Data))) == NULL) {
+    Py_DECREF(s);
+    return PyErr_NoMemory();
+  }
+  return (PyObject *)s;
+}
+
+static int hrm_py_init(HRM_PySession *s, PyObject *args, PyObject *kwargs)
+{
+  static char *keywords[]={"usb","device_id","verbose",NULL};
+  const char *usb=NULL,*device_id=NULL;
+  int verbose=0;
+
+  if(!PyArg_ParseTupleAndKeywords(args,kwargs,"|zzp",keywords,&usb,&device_id,&verbose)) {
+    return(-1);
+  }
+  if(s->hrm->usb_dev || s->busy) {
+    PyErr_SetString(PyExc_RuntimeError,"session is in use");
+    return(-1);
+  }
+  free(s->hrm->usb_path);
+  memset(s->hrm,0,sizeof(HRM_Data));
+  s->hrm->smoke_marker=-1;
+  s->hrm->load.fill=0xff;
+  s->hrm->verbose_mode=verbose;
+  s->hrm->usb_path = usb ? strdup(usb) : NULL;
+  if(device_id) {
+    strncpy(s->hrm->device_id,device_id,HRM_DEVICE_ID_SIZE-1);
+  }
+  return(0);
+}
+
+static void hrm_py_dealloc(HRM_PySession *s)
+{
+  if(s->hrm) {
+    if(s->hrm->usb_dev) {
+      HRM_ICP_CloseUSB(s->hrm);
+    }
+    free(s->hrm->usb_path);
+    free(s->hrm);
+  }
+  Py_TYPE(s)->tp_free((PyObject *)s);
+}
+
+// Buffer protocol: the image itself
+static int hrm_py_getbuffer(HRM_PySession *s, Py_buffer *view, int flags)
+{
+  return PyBuffer_FillInfo(view,(PyObject *)s,s->hrm->mem,MEM_SIZE,0,flags);
+}
+
+static PyBufferProcs hrm_py_buffer={
+  (getbufferproc)hrm_py_getbuffer,
+  NULL,
+};
+
+static PyObject *hrm_py_load(HRM_PySession *s, PyObject *args, PyObject *kwargs)
+{
+  static char *keywords[]={"path","offset","windows","fill","strict","threads",NULL};
+  HRM_Data *hrm=s->hrm;
+  PyObject *path,*windows=NULL,*w;
+  long offset=0;
+  int fill=0xff,strict=0,result;
+  unsigned int threads=0,start,end;
+  Py_ssize_t i;
+
+  if(!PyArg_ParseTupleAndKeywords(args,kwargs,"O&|lOipI",keywords,PyUnicode_FSConverter,&path,
+                                  &offset,&windows,&fill,&strict,&threads)) {
+    return(NULL);
+  }
+
+  hrm->load.offset=offset;
+  hrm->load.fill=fill;
+  hrm->load.strict=strict;
+  hrm->load.nwindows=0;
+  hrm->threads=threads;
+  if(windows && windows != Py_None) {
+    // [(start, end), ...], end inclusive
+    if(!PySequence_Check(windows) || PySequence_Size(windows) > HRM_MAX_WINDOWS) {
+      Py_DECREF(path);
+      PyErr_Format(PyExc_ValueError,"windows must be a list of up to %d (start, end) pairs",
+                   HRM_MAX_WINDOWS);
+      return(NULL);
+    }
+    for(i=0;i<PySequence_Size(windows);i++) {
+      w=PySequence_GetItem(windows,i);
+      result = w && PyArg_ParseTuple(w,"II",&start,&end) && start <= end && end <= 0xffff;
+      Py_XDECREF(w);
+      if(!result) {
+        Py_DECREF(path);
+        if(!PyErr_Occurred()) {
+          PyErr_SetString(PyExc_ValueError,"bad window");
+        }
+        return(NULL);
+      }
+      hrm->load.window[i][0]=start;
+      hrm->load.window[i][1]=end;
+      hrm->load.nwindows++;
+    }
+  }
+
+  if(hrm_py_enter(s) < 0) {
+    Py_DECREF(path);
+    return(NULL);
+  }
+  hrm->filename=PyBytes_AS_STRING(path);
+  hrm->plan_valid=0;
+  Py_BEGIN_ALLOW_THREADS
+  if((result=HRM_ICP_ReadS19(hrm)) == HRM_OK && hrm->icp_flag != hrm->icp_flag_calculated) {
+    // As programmed: with the ICP Flag fixed
+    HRM_ICP_FixFlag(hrm);
+  }
+  Py_END_ALLOW_THREADS
+  hrm->filename=NULL;
+  s->busy=0;
+  Py_DECREF(path);
+
+  if(result == HRM_ERROR) {
+    return hrm_py_raise(hrm);
+  }
+  return PyMemoryView_FromObject((PyObject *)s);
+}
+
+static PyObject *hrm_py_smoke_test(HRM_PySession *s, PyObject *args, PyObject *kwargs)
+{
+  static char *keywords[]={"cycles","marker","reset_vector",NULL};
+  unsigned long cycles=0;
+  long marker=-1;
+  unsigned int vector=0;
+  int result;
+
+  if(!PyArg_ParseTupleAndKeywords(args,kwargs,"|klI",keywords,&cycles,&marker,&vector)
+     || hrm_py_enter(s) < 0) {
+    return(NULL);
+  }
+  s->hrm->smoke_cycles=cycles;
+  s->hrm->smoke_marker=marker;
+  s->hrm->reset_vector=vector;
+  Py_BEGIN_ALLOW_THREADS
+  result=HRM_SmokeTest(s->hrm);
+  Py_END_ALLOW_THREADS
+  s->busy=0;
+
+  if(result == HRM_ERROR) {
+    return hrm_py_raise(s->hrm);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *hrm_py_open(HRM_PySession *s, PyObject *noargs)
+{
+  int result;
+
+  if(s->hrm->usb_dev) {
+    Py_RETURN_NONE;
+  }
+  if(hrm_py_enter(s) < 0) {
+    return(NULL);
+  }
+  Py_BEGIN_ALLOW_THREADS
+  result=HRM_ICP_InitUSB(s->hrm);
+  Py_END_ALLOW_THREADS
+  s->busy=0;
+
+  if(result == HRM_ERROR) {
+    s->hrm->usb_dev=NULL;
+    return hrm_py_raise(s->hrm);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *hrm_py_close(HRM_PySession *s, PyObject *noargs)
+{
+  if(s->hrm->usb_dev && hrm_py_enter(s) == 0) {
+    HRM_ICP_CloseUSB(s->hrm);
+    s->hrm->usb_dev=NULL;
+    s->busy=0;
+  }
+  if(PyErr_Occurred()) {
+    return(NULL);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *hrm_py_erase(HRM_PySession *s, PyObject *noargs)
+{
+  if(hrm_py_need_device(s) < 0 || hrm_py_enter(s) < 0) {
+    return(NULL);
+  }
+  Py_BEGIN_ALLOW_THREADS
+  HRM_ICP_Plan(s->hrm);
+  if(HRM_ICP_EraseFlash(s->hrm) == HRM_OK) {
+    HRM_WearCommit(s->hrm);
+  }
+  Py_END_ALLOW_THREADS
+  s->busy=0;
+
+  if(s->hrm->last_errorcode) {
+    return hrm_py_raise(s->hrm);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *hrm_py_program(HRM_PySession *s, PyObject *args, PyObject *kwargs)
+{
+  static char *keywords[]={"progress",NULL};
+  PyObject *progress=NULL;
+  int result;
+
+  if(!PyArg_ParseTupleAndKeywords(args,kwargs,"|O",keywords,&progress)
+     || hrm_py_need_device(s) < 0) {
+    return(NULL);
+  }
+  if(progress == Py_None) {
+    progress=NULL;
+  }
+  if(progress && !PyCallable_Check(progress)) {
+    PyErr_SetString(PyExc_TypeError,"progress must be callable");
+    return(NULL);
+  }
+  if(hrm_py_enter(s) < 0) {
+    return(NULL);
+  }
+
+  Py_XINCREF(progress);
+  s->progress=progress;
+  s->progress_failed=0;
+  s->hrm->progress = progress ? hrm_py_progress : NULL;
+  s->hrm->progress_ctx=s;
+
+  Py_BEGIN_ALLOW_THREADS
+  result=HRM_ICP_ProgramFlash(s->hrm);
+  HRM_WearCommit(s->hrm);
+  Py_END_ALLOW_THREADS
+
+  s->hrm->progress=NULL;
+  s->progress=NULL;
+  Py_XDECREF(progress);
+  s->busy=0;
+
+  if(s->progress_failed) {
+    return(NULL);
+  }
+  if(result == HRM_ERROR) {
+    return hrm_py_raise(s->hrm);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *hrm_py_verify(HRM_PySession *s, PyObject *noargs)
+{
+  int result;
+
+  if(hrm_py_need_device(s) < 0) {
+    return(NULL);
+  }
+  if(!(s->hrm->icp_caps & ICP_CAP_READ)) {
+    PyErr_SetString(PyExc_RuntimeError,"ICP firmware can't read back");
+    return(NULL);
+  }
+  if(hrm_py_enter(s) < 0) {
+    return(NULL);
+  }
+  Py_BEGIN_ALLOW_THREADS
+  result=HRM_ICP_MatchFlash(s->hrm);
+  Py_END_ALLOW_THREADS
+  s->busy=0;
+
+  return PyBool_FromLong(result == HRM_OK && !s->hrm->flag_stale);
+}
+
+static PyObject *hrm_py_get_version(HRM_PySession *s, void *closure)
+{
+  return PyUnicode_DecodeLatin1(s->hrm->version,strlen(s->hrm->version),NULL);
+}
+
+static PyObject *hrm_py_get_fingerprint(HRM_PySession *s, void *closure)
+{
+  return PyLong_FromUnsignedLongLong(HRM_Hash(s->hrm->mem,MEM_SIZE,HRM_HASH_INIT));
+}
+
+static PyObject *hrm_py_get_info(HRM_PySession *s, void *closure)
+{
+  HRM_Data *hrm=s->hrm;
+
+  switch((Py_intptr_t)closure) {
+  case 0:  return PyLong_FromUnsignedLong(hrm->conflicts);
+  case 1:  return PyLong_FromUnsignedLong(hrm->outside);
+  case 2:  return PyLong_FromUnsignedLong(hrm->icp_version);
+  case 3:  return PyLong_FromUnsignedLong(hrm->icp_caps);
+  case 4:  return PyLong_FromUnsignedLong(hrm->icp_burst_rows);
+  case 5:  return PyUnicode_FromString(HRM_FormatNames[hrm->format]);
+  default: return PyUnicode_FromString(hrm->device_id);
+  }
+}
+
+static PyMethodDef hrm_py_methods[]={
+  {"load",(PyCFunction)hrm_py_load,METH_VARARGS | METH_KEYWORDS,
+   "load(path, offset=0, windows=None, fill=0xFF, strict=False, threads=0)\n"
+   "Loads an image file and returns a memoryview of it (no copy)."},
+  {"smoke_test",(PyCFunction)hrm_py_smoke_test,METH_VARARGS | METH_KEYWORDS,
+   "smoke_test(cycles=0, marker=-1, reset_vector=0)\nRuns the image on the HC08 simulator."},
+  {"open",(PyCFunction)hrm_py_open,METH_NOARGS,"Opens the board in ICP mode."},
+  {"close",(PyCFunction)hrm_py_close,METH_NOARGS,"Closes the board."},
+  {"erase",(PyCFunction)hrm_py_erase,METH_NOARGS,"Erases the blocks the image needs."},
+  {"program",(PyCFunction)hrm_py_program,METH_VARARGS | METH_KEYWORDS,
+   "program(progress=None)\nPrograms the image, progress(done, total) is called per row."},
+  {"verify",(PyCFunction)hrm_py_verify,METH_NOARGS,"True, if the board holds the image."},
+  {NULL}
+};
+
+static PyGetSetDef hrm_py_getset[]={
+  {"version",(getter)hrm_py_get_version,NULL,"Image version (S0 header)",NULL},
+  {"fingerprint",(getter)hrm_py_get_fingerprint,NULL,"64-bit hash of the image",NULL},
+  {"conflicts",(getter)hrm_py_get_info,NULL,"Bytes set twice with different data",(void *)0},
+  {"outside",(getter)hrm_py_get_info,NULL,"Bytes outside the load windows",(void *)1},
+  {"icp_version",(getter)hrm_py_get_info,NULL,"Extended ICP protocol version",(void *)2},
+  {"icp_caps",(getter)hrm_py_get_info,NULL,"ICP firmware capabilities",(void *)3},
+  {"burst_rows",(getter)hrm_py_get_info,NULL,"Rows per program burst",(void *)4},
+  {"format",(getter)hrm_py_get_info,NULL,"Format of the loaded file (plain, gzip, ...)",(void *)5},
+  {"device_id",(getter)hrm_py_get_info,NULL,"Device identity for the wear log",(void *)6},
+  {NULL}
+};
+
+static PyTypeObject hrm_py_session_type={
+  PyVarObject_HEAD_INIT(NULL,0)
+  .tp_name="hrm.Session",
+  .tp_basicsize=sizeof(HRM_PySession),
+  .tp_dealloc=(destructor)hrm_py_dealloc,
+  .tp_as_buffer=&hrm_py_buffer,
+  .tp_flags=Py_TPFLAGS_DEFAULT,
+  .tp_doc="Session(usb=None, device_id=None, verbose=False)\nOne board and its image.",
+  .tp_methods=hrm_py_methods,
+  .tp_getset=hrm_py_getset,
+  .tp_init=(initproc)hrm_py_init,
+  .tp_new=hrm_py_new,
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Module                                                                          //
+/////////////////////////////////////////////////////////////////////////////////////
+static struct PyModuleDef hrm_py_module={
+  PyModuleDef_HEAD_INIT,
+  "hrm",
+  "HC908JB8 USB ICP flashing engine",
+  -1,
+  NULL,
+};
+
+PyMODINIT_FUNC PyInit_hrm(void)
+{
+  PyObject *m;
+
+  if(PyType_Ready(&hrm_py_session_type) < 0 || (m=PyModule_Create(&hrm_py_module)) == NULL) {
+    return(NULL);
+  }
+  hrm_py_error=PyErr_NewException("hrm.Error",NULL,NULL);
+  Py_INCREF(hrm_py_error);
+  Py_INCREF(&hrm_py_session_type);
+  PyModule_AddObject(m,"Error",hrm_py_error);
+  PyModule_AddObject(m,"Session",(PyObject *)&hrm_py_session_type);
+  PyModule_AddIntConstant(m,"MEM_OFFSET",MEM_OFFSET);
+  PyModule_AddIntConstant(m,"MEM_SIZE",MEM_SIZE);
+
+  HRM_TimerCalibrate();
+  return(m);
+}
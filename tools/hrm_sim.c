@@ -0,0 +1,1044 @@
+/////////////////////////////////////////////////////////////////
+// HC908JB8 USB ICP Simulator
+// =============================================================
+//
+// Simulated libusb-0.1 backend for manage.c (see hrm_sim.h).
+//
+// Compile:
+// ========
+// gcc -DHRM_SIM manage.c hc08_cpu.c hrm_sim.c -o manage_sim -lpthread -O2 -Wall
+//
+/////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "hrm_sim.h"
+
+// Device identities (must match manage.c)
+#define SIM_HID_VID 0x0c74
+#define SIM_HID_PID 0x4008
+#define SIM_ICP_VID 0x0425
+#define SIM_ICP_PID 0xff01
+#define SIM_VERSION_REPORT_SIZE 33   // HID Feature report 2: ID + 32 bytes
+
+// Flash layout of the JB8
+#define SIM_USER_START 0xDC00
+#define SIM_USER_END   0xF7FF
+#define SIM_BLOCK_SIZE 0x200
+#define SIM_ROW_SIZE   0x40
+
+// ICP requests and replies (AN2398 + extended)
+#define SIM_REQ_PROGRAM  0x81
+#define SIM_REQ_ERASE    0x82
+#define SIM_REQ_READ     0x83
+#define SIM_REQ_PROGRAM_BURST 0x84
+#define SIM_REQ_STATUS   0x8F
+#define SIM_REQ_GET_INFO 0x90
+
+#define SIM_STATUS_FAIL  0x00
+#define SIM_STATUS_OK    0x01
+#define SIM_STATUS_BUSY  0x80
+
+#define SIM_CAP_MASS_ERASE    0x01
+#define SIM_CAP_READ          0x02
+#define SIM_CAP_STICKY_STATUS 0x04
+#define SIM_CAP_BURST         0x08
+
+#define SIM_MODE_GONE 0
+#define SIM_MODE_HID  1
+#define SIM_MODE_ICP  2
+
+// Hubs (USB 2.0 chapter 11)
+#define SIM_CLASS_HUB          0x09
+#define SIM_HUB_GET_STATUS     0x00
+#define SIM_HUB_CLEAR_FEATURE  0x01
+#define SIM_HUB_SET_FEATURE    0x03
+#define SIM_HUB_GET_DESCRIPTOR 0x06
+#define SIM_HUB_PORT_POWER     8
+#define SIM_HUB_PORTS          8
+#define SIM_POWER_GANGED       0x00    // wHubCharacteristics, power switching
+#define SIM_POWER_PER_PORT     0x01
+#define SIM_POWER_NONE         0x02
+#define SIM_POWER_OFF          1e300   // reenumerate_at of a board without power
+
+// USB error codes as returned by libusb-0.1 on Linux
+#define SIM_EPIPE     -32
+#define SIM_ENODEV    -19
+#define SIM_ETIMEDOUT -110
+
+// Fault injection: request types and faults
+#define SIM_OP_PROGRAM 0
+#define SIM_OP_ERASE   1
+#define SIM_OP_READ    2
+#define SIM_OP_STATUS  3
+#define SIM_OP_INFO    4
+#define SIM_OP_HID     5
+#define SIM_OP_COUNT   6
+
+#define SIM_FAULT_NONE       -1
+#define SIM_FAULT_TIMEOUT    0
+#define SIM_FAULT_SHORT      1
+#define SIM_FAULT_STALL      2
+#define SIM_FAULT_BUSY       3
+#define SIM_FAULT_BITERR     4
+#define SIM_FAULT_DISCONNECT 5
+#define SIM_FAULT_COUNT      6
+
+#define SIM_SCRIPT_MAX 64
+#define SIM_MAX_BOARDS 32
+#define SIM_MAX_BUSES   8
+
+static char *sim_op_names[SIM_OP_COUNT]={"program","erase","read","status","info","hid"};
+static char *sim_fault_names[SIM_FAULT_COUNT]={"timeout","short","stall","busy","biterr","disconnect"};
+
+typedef struct HRM_SimBoard {
+
+  int mode;                          // SIM_MODE_xxx
+  int boot_mode;                     // Mode it enumerates in after a reset (ICP flag)
+  double reenumerate_at;             // When a SIM_MODE_GONE board comes back
+
+  int stock;                         // 1 = stock AN2398 firmware
+  unsigned int row_ms;               // Row program time
+  unsigned int erase_ms;             // Block erase time
+  unsigned int replug_ms;            // Re-enumeration delay
+  unsigned int flag_ms;              // Flag write time of the user code after SET_REPORT
+  double flag_done_at;               // Flag write in progress until (0 = none)
+  unsigned int burst_rows;           // Rows per program burst (0 = no bursts)
+
+  double busy_until;                 // Flash operation in progress until
+  unsigned char last_status;         // Result of the last command
+  unsigned char sticky_error;        // Extended: any failure since last status read
+
+  unsigned char flash[0x10000];      // Whole 64k address space
+
+  struct usb_device dev;             // Enumerated device
+  char port[HRM_SIM_PATH_MAX];       // Port path as in sysfs, e.g. "1-1.3"
+  int hub;                           // Index of its hub in sim_hubs (-1 = root port)
+  struct HRM_SimHub *parent;         // Hub it is plugged into (external or root)
+  unsigned int port_num;             // ...on this port
+
+} HRM_SimBoard;
+
+// Hub: external ones have one transaction translator, one transfer at a time
+typedef struct HRM_SimHub {
+  char port[HRM_SIM_PATH_MAX];       // Port path, "usb1" for a root hub
+  pthread_mutex_t tt;
+  unsigned int power_off;            // Bit per port that is switched off
+  struct usb_device dev;
+} HRM_SimHub;
+
+struct usb_dev_handle {
+  HRM_SimBoard *board;               // NULL for a hub
+  HRM_SimHub *hub;
+  struct usb_device *dev;
+  int mode;                          // Mode the board was opened in
+};
+
+static HRM_SimBoard sim_boards[SIM_MAX_BOARDS];
+static unsigned int sim_nboards=1;
+static char *sim_flash_file=NULL;
+static struct usb_bus sim_buses[SIM_MAX_BUSES];
+static HRM_SimHub sim_hubs[SIM_MAX_BOARDS];
+static unsigned int sim_nhubs=0;
+static HRM_SimHub sim_roots[SIM_MAX_BUSES];
+static unsigned int sim_xfer_us=0;
+static unsigned int sim_hub_power=SIM_POWER_PER_PORT;
+static unsigned int sim_power_on_ms=150;
+static unsigned int sim_boot_ms=200;
+static int sim_initialized=0;
+static char sim_error[64]="No error";
+
+// Fault injection
+typedef struct HRM_SimScript {
+  int op;                            // SIM_OP_xxx
+  unsigned int nth;                  // n:th request of the type (from 1)
+  int fault;                         // SIM_FAULT_xxx
+} HRM_SimScript;
+
+static double sim_fault_rate[SIM_OP_COUNT][SIM_FAULT_COUNT];
+static HRM_SimScript sim_script[SIM_SCRIPT_MAX];
+static unsigned int sim_script_len=0;
+static unsigned int sim_requests[SIM_OP_COUNT];
+static unsigned int sim_injected[SIM_OP_COUNT][SIM_FAULT_COUNT];
+static unsigned long long sim_seed=1;
+static pthread_mutex_t sim_fault_lock=PTHREAD_MUTEX_INITIALIZER;  // Boards served from several threads
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Helpers                                                                         //
+/////////////////////////////////////////////////////////////////////////////////////
+static double sim_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+static unsigned int sim_getenv(const char *name, unsigned int def)
+{
+  char *v=getenv(name);
+
+  return v ? strtoul(v,NULL,0) : def;
+}
+
+// The JB8 does not serve EP0 while flash is busy: the host sees NAKs
+static void sim_wait_ready(HRM_SimBoard *b)
+{
+  double left=b->busy_until-sim_now();
+
+  if(left > 0) {
+    usleep((unsigned int)(left*1000));
+  }
+}
+
+static void sim_result(HRM_SimBoard *b, int ok)
+{
+  b->last_status = ok ? SIM_STATUS_OK : SIM_STATUS_FAIL;
+  if(!ok) {
+    b->sticky_error=1;
+  }
+}
+
+// HRM_SIM_FLASH: the flash survives between runs like a real board.
+// Board n>1 of HRM_SIM_BOARDS keeps it in "file.n".
+static void sim_flash_path(unsigned int n, char *path, int len)
+{
+  if(n == 0) {
+    snprintf(path,len,"%s",sim_flash_file);
+  } else {
+    snprintf(path,len,"%s.%d",sim_flash_file,n+1);
+  }
+}
+
+static void sim_save_flash(void)
+{
+  char path[256];
+  unsigned int n;
+  FILE *fp;
+
+  for(n=0;n<sim_nboards;n++) {
+    sim_flash_path(n,path,sizeof(path));
+    if((fp=fopen(path,"wb"))) {
+      fwrite(sim_boards[n].flash,1,sizeof(sim_boards[n].flash),fp);
+      fclose(fp);
+    }
+  }
+}
+
+static void sim_load_flash(void)
+{
+  char path[256];
+  unsigned int n;
+  FILE *fp;
+
+  if((sim_flash_file=getenv("HRM_SIM_FLASH")) == NULL) {
+    return;
+  }
+  for(n=0;n<sim_nboards;n++) {
+    sim_flash_path(n,path,sizeof(path));
+    if((fp=fopen(path,"rb"))) {
+      if(fread(sim_boards[n].flash,1,sizeof(sim_boards[n].flash),fp) != sizeof(sim_boards[n].flash)) {
+        memset(sim_boards[n].flash,0xff,sizeof(sim_boards[n].flash));
+      }
+      fclose(fp);
+    }
+  }
+  atexit(sim_save_flash);
+}
+
+static int sim_lookup(char **names, int count, const char *name, int len)
+{
+  int i;
+
+  for(i=0;i<count;i++) {
+    if((int)strlen(names[i]) == len && strncmp(names[i],name,len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Random number in [0,1) (xorshift64*)
+static double sim_random(void)
+{
+  sim_seed ^= sim_seed >> 12;
+  sim_seed ^= sim_seed << 25;
+  sim_seed ^= sim_seed >> 27;
+  return ((sim_seed * 0x2545F4914F6CDD1DULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+static void sim_fault_report(void)
+{
+  int op,f;
+
+  fprintf(stderr,"HRM_SIM: injected faults:");
+  for(op=0;op<SIM_OP_COUNT;op++) {
+    for(f=0;f<SIM_FAULT_COUNT;f++) {
+      if(sim_injected[op][f]) {
+        fprintf(stderr," %s:%s=%d/%d",sim_op_names[op],sim_fault_names[f],
+                sim_injected[op][f],sim_requests[op]);
+      }
+    }
+  }
+  fprintf(stderr,"\n");
+}
+
+// HRM_SIM_FAULTS="op:fault=p,..." and HRM_SIM_FAULT_SCRIPT="op#n:fault,..."
+static void sim_load_faults(void)
+{
+  char *list,*p,*colon,*sep;
+  int op,f,len,any;
+  double rate;
+
+  sim_seed=sim_getenv("HRM_SIM_SEED",1) | 1;
+
+  if((list=getenv("HRM_SIM_FAULTS"))) {
+    for(p=list; *p; p = *sep ? sep+1 : sep) {
+      sep=p+strcspn(p,",");
+      colon=memchr(p,':',sep-p);
+      if(colon == NULL || (len=strcspn(colon+1,"=")) >= sep-colon-1) {
+        continue;
+      }
+      any = colon-p == 3 && strncmp(p,"any",3) == 0;
+      op=sim_lookup(sim_op_names,SIM_OP_COUNT,p,colon-p);
+      f=sim_lookup(sim_fault_names,SIM_FAULT_COUNT,colon+1,len);
+      rate=strtod(colon+1+len+1,NULL);
+      if(f < 0 || (op < 0 && !any)) {
+        fprintf(stderr,"HRM_SIM: bad fault \"%.*s\"\n",(int)(sep-p),p);
+        continue;
+      }
+      for(op = any ? 0 : op; op < SIM_OP_COUNT; op++) {
+        sim_fault_rate[op][f]=rate;
+        if(!any) {
+          break;
+        }
+      }
+    }
+  }
+
+  if((list=getenv("HRM_SIM_FAULT_SCRIPT"))) {
+    for(p=list; *p && sim_script_len < SIM_SCRIPT_MAX; p = *sep ? sep+1 : sep) {
+      sep=p+strcspn(p,",");
+      len=strcspn(p,"#");
+      colon=memchr(p,':',sep-p);
+      op=sim_lookup(sim_op_names,SIM_OP_COUNT,p,len);
+      f = colon ? sim_lookup(sim_fault_names,SIM_FAULT_COUNT,colon+1,sep-colon-1) : -1;
+      if(op < 0 || f < 0 || p[len] != '#') {
+        fprintf(stderr,"HRM_SIM: bad fault \"%.*s\"\n",(int)(sep-p),p);
+        continue;
+      }
+      sim_script[sim_script_len].op=op;
+      sim_script[sim_script_len].nth=strtoul(p+len+1,NULL,10);
+      sim_script[sim_script_len].fault=f;
+      sim_script_len++;
+    }
+  }
+
+  if(getenv("HRM_SIM_FAULTS") || getenv("HRM_SIM_FAULT_SCRIPT")) {
+    atexit(sim_fault_report);
+  }
+}
+
+// Fault to inject to this request (SIM_FAULT_NONE for none). The caller
+// holds sim_fault_lock.
+static int sim_fault(int op)
+{
+  unsigned int i;
+  int f;
+
+  sim_requests[op]++;
+  for(i=0;i<sim_script_len;i++) {
+    if(sim_script[i].op == op && sim_script[i].nth == sim_requests[op]) {
+      f=sim_script[i].fault;
+      sim_injected[op][f]++;
+      return f;
+    }
+  }
+  for(f=0;f<SIM_FAULT_COUNT;f++) {
+    if(sim_fault_rate[op][f] > 0 && sim_random() < sim_fault_rate[op][f]) {
+      sim_injected[op][f]++;
+      return f;
+    }
+  }
+  return SIM_FAULT_NONE;
+}
+
+// HRM_SIM_TOPOLOGY: port path of board n, its bus and hub
+static void sim_place(HRM_SimBoard *b, unsigned int n, const char *list)
+{
+  const char *p=list;
+  unsigned int i,bus,len;
+  char *dot;
+
+  for(i=0; p && i<n; i++) {
+    p=strchr(p,',');
+    p = p ? p+1 : NULL;
+  }
+  len = p ? strcspn(p,",") : 0;
+  if(len == 0 || len >= HRM_SIM_PATH_MAX || (bus=strtoul(p,NULL,10)) < 1 || bus > SIM_MAX_BUSES) {
+    snprintf(b->port,sizeof(b->port),"1-%d",n+1);
+  } else {
+    memcpy(b->port,p,len);
+    b->port[len]=0;
+  }
+  bus=strtoul(b->port,NULL,10);
+  b->dev.bus=&sim_buses[bus-1];
+
+  // Behind an external hub, if there is a dot: the hub is the part before the last one
+  b->hub=-1;
+  b->parent=&sim_roots[bus-1];
+  if((dot=strrchr(b->port,'.')) == NULL) {
+    b->port_num=strtoul(strchr(b->port,'-')+1,NULL,10);
+    return;
+  }
+  b->port_num=strtoul(dot+1,NULL,10);
+  for(i=0;i<sim_nhubs;i++) {
+    if((int)strlen(sim_hubs[i].port) == dot-b->port && strncmp(sim_hubs[i].port,b->port,dot-b->port) == 0) {
+      b->hub=i;
+      b->parent=&sim_hubs[i];
+      return;
+    }
+  }
+  memcpy(sim_hubs[sim_nhubs].port,b->port,dot-b->port);
+  sim_hubs[sim_nhubs].port[dot-b->port]=0;
+  pthread_mutex_init(&sim_hubs[sim_nhubs].tt,NULL);
+  sim_hubs[sim_nhubs].dev.bus=b->dev.bus;
+  b->hub=sim_nhubs++;
+  b->parent=&sim_hubs[b->hub];
+}
+
+// Hubs enumerate like the boards: root hubs as device 001, external ones from 064
+static void sim_hub_init(HRM_SimHub *h, unsigned int devnum, unsigned int vid)
+{
+  h->dev.dev=h;
+  h->dev.devnum=devnum;
+  sprintf(h->dev.filename,"%03d",devnum);
+  h->dev.descriptor.bDeviceClass=SIM_CLASS_HUB;
+  h->dev.descriptor.idVendor=vid;
+  h->dev.descriptor.idProduct=0x0002;
+}
+
+// Extension for manage.c: what it reads from sysfs on a real Linux host
+int hrm_sim_port_path(struct usb_device *dev, char *buf, int len)
+{
+  HRM_SimBoard *b=dev->dev;
+  HRM_SimHub *h=dev->dev;
+
+  snprintf(buf,len,"%s",dev->descriptor.bDeviceClass == SIM_CLASS_HUB ? h->port : b->port);
+  return 0;
+}
+
+// Extension for manage.c: what it waits for with inotify on a real Linux host.
+// Sleeps until the next board (re-)enumerates, at most ms
+int hrm_sim_wait_event(double ms)
+{
+  double next=SIM_POWER_OFF,now=sim_now();
+  unsigned int n;
+
+  for(n=0;n<sim_nboards;n++) {
+    if(sim_boards[n].mode == SIM_MODE_GONE && sim_boards[n].reenumerate_at < next) {
+      next=sim_boards[n].reenumerate_at;
+    }
+    if(sim_boards[n].flag_done_at && sim_boards[n].flag_done_at < next) {
+      next=sim_boards[n].flag_done_at;
+    }
+  }
+  if(next-now < ms) {
+    ms = next > now ? next-now : 0;
+  }
+  if(ms > 0) {
+    usleep((unsigned int)(ms*1000));
+  }
+  return next <= sim_now();
+}
+
+// The monitor starts the user code, if the ICP flag matches the checksum of
+// 0xF600-0xF7FD; else it stays in ICP mode
+static void sim_reboot(HRM_SimBoard *b)
+{
+  unsigned int i,sum=0;
+
+  for(i=0xF600;i<=0xF7FD;i++) {
+    sum+=b->flash[i];
+  }
+  if(b->boot_mode == SIM_MODE_ICP
+     && ((0x10000-(sum & 0xffff)) & 0xffff) == (unsigned int)(b->flash[0xF7FE] << 8 | b->flash[0xF7FF])) {
+    b->boot_mode=SIM_MODE_HID;
+  }
+}
+
+// The user code has written the cleared flag: it resets and is gone until the replug
+static void sim_flag_cleared(HRM_SimBoard *b)
+{
+  b->flash[0xF7FE]=0x00;
+  b->flash[0xF7FF]=0x00;
+  b->mode=SIM_MODE_GONE;
+  b->boot_mode=SIM_MODE_ICP;
+  b->reenumerate_at=(b->flag_done_at ? b->flag_done_at : sim_now())+b->replug_ms;
+  b->flag_done_at=0;
+}
+
+static void sim_update_mode(HRM_SimBoard *b)
+{
+  if(b->flag_done_at && sim_now() >= b->flag_done_at) {
+    sim_flag_cleared(b);
+  }
+  if(b->mode == SIM_MODE_GONE && sim_now() >= b->reenumerate_at) {
+    b->mode=b->boot_mode;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Enumeration                                                                     //
+/////////////////////////////////////////////////////////////////////////////////////
+void usb_init(void)
+{
+  char *mode,*power;
+  HRM_SimBoard *b;
+  unsigned int n,arrive_ms;
+
+  if(sim_initialized) {
+    return;
+  }
+  sim_initialized=1;
+
+  sim_nboards=sim_getenv("HRM_SIM_BOARDS",1);
+  if(sim_nboards < 1 || sim_nboards > SIM_MAX_BOARDS) {
+    sim_nboards=1;
+  }
+  arrive_ms=sim_getenv("HRM_SIM_ARRIVE_MS",0);
+  sim_xfer_us=sim_getenv("HRM_SIM_XFER_US",0);
+  mode=getenv("HRM_SIM_MODE");
+  sim_power_on_ms=sim_getenv("HRM_SIM_POWER_ON_MS",150);
+  sim_boot_ms=sim_getenv("HRM_SIM_BOOT_MS",200);
+  if((power=getenv("HRM_SIM_HUB_POWER"))) {
+    sim_hub_power = strcmp(power,"ganged") == 0 ? SIM_POWER_GANGED
+                  : strcmp(power,"none") == 0 ? SIM_POWER_NONE : SIM_POWER_PER_PORT;
+  }
+
+  for(n=0;n<SIM_MAX_BUSES;n++) {
+    sprintf(sim_buses[n].dirname,"%03d",n+1);
+    sim_buses[n].location=n+1;
+    sprintf(sim_roots[n].port,"usb%d",n+1);
+    sim_roots[n].dev.bus=&sim_buses[n];
+    sim_hub_init(&sim_roots[n],1,0x1d6b);
+  }
+
+  for(n=0;n<sim_nboards;n++) {
+    b=&sim_boards[n];
+    memset(b,0,sizeof(*b));
+    memset(b->flash,0xff,sizeof(b->flash));
+    b->mode = (mode && strcmp(mode,"hid")==0) ? SIM_MODE_HID : SIM_MODE_ICP;
+    b->stock=sim_getenv("HRM_SIM_STOCK",0);
+    b->row_ms=sim_getenv("HRM_SIM_ROW_MS",8);
+    b->erase_ms=sim_getenv("HRM_SIM_ERASE_MS",5);
+    b->replug_ms=sim_getenv("HRM_SIM_REPLUG_MS",500);
+    b->flag_ms=sim_getenv("HRM_SIM_FLAG_MS",0);
+    b->burst_rows=sim_getenv("HRM_SIM_BURST_ROWS",8);
+    b->last_status=SIM_STATUS_OK;
+    b->boot_mode=b->mode;
+
+    // Plugged in one after the other: absent until then, arrives in ICP mode
+    if(arrive_ms && n > 0) {
+      b->mode=SIM_MODE_GONE;
+      b->boot_mode=SIM_MODE_ICP;
+      b->reenumerate_at=sim_now()+n*arrive_ms;
+    }
+
+    sim_place(b,n,getenv("HRM_SIM_TOPOLOGY"));
+    b->dev.dev=b;
+    b->dev.devnum=2+n;
+    sprintf(b->dev.filename,"%03d",b->dev.devnum);
+    b->dev.descriptor.iSerialNumber = 3;
+  }
+  for(n=0;n<sim_nhubs;n++) {
+    sim_hub_init(&sim_hubs[n],64+n,0x05e3);
+  }
+  sim_load_flash();
+  sim_load_faults();
+}
+
+int usb_find_busses(void)
+{
+  return 1;
+}
+
+int usb_find_devices(void)
+{
+  HRM_SimBoard *b;
+  struct usb_device **link[SIM_MAX_BUSES];
+  struct usb_bus **next=NULL;
+  int n,found=0;
+
+  for(n=0;n<SIM_MAX_BUSES;n++) {
+    link[n]=&sim_buses[n].devices;
+  }
+
+  // Hubs first, as the host enumerates them before the devices behind them
+  for(n=0;n<SIM_MAX_BUSES;n++) {
+    sim_roots[n].dev.next=NULL;
+  }
+  for(n=0;n<(int)sim_nboards;n++) {
+    b=&sim_boards[n];
+    if(link[b->dev.bus-sim_buses] == &sim_buses[b->dev.bus-sim_buses].devices) {
+      *link[b->dev.bus-sim_buses]=&sim_roots[b->dev.bus-sim_buses].dev;
+      link[b->dev.bus-sim_buses]=&sim_roots[b->dev.bus-sim_buses].dev.next;
+    }
+  }
+  for(n=0;n<(int)sim_nhubs;n++) {
+    *link[sim_hubs[n].dev.bus-sim_buses]=&sim_hubs[n].dev;
+    link[sim_hubs[n].dev.bus-sim_buses]=&sim_hubs[n].dev.next;
+  }
+
+  // Boards that are on a bus, in port order
+  for(n=0;n<(int)sim_nboards;n++) {
+    b=&sim_boards[n];
+    sim_update_mode(b);
+    if(b->mode == SIM_MODE_GONE) {
+      continue;
+    }
+    b->dev.descriptor.idVendor  = b->mode==SIM_MODE_HID ? SIM_HID_VID : SIM_ICP_VID;
+    b->dev.descriptor.idProduct = b->mode==SIM_MODE_HID ? SIM_HID_PID : SIM_ICP_PID;
+    *link[b->dev.bus-sim_buses]=&b->dev;
+    link[b->dev.bus-sim_buses]=&b->dev.next;
+    found++;
+  }
+
+  // Bus 1 is always there, the others if something is plugged in
+  if(sim_buses[0].devices == NULL) {
+    *link[0]=&sim_roots[0].dev;
+    link[0]=&sim_roots[0].dev.next;
+  }
+  for(n=0;n<SIM_MAX_BUSES;n++) {
+    *link[n]=NULL;
+    if(n == 0 || sim_buses[n].devices) {
+      if(next) {
+        *next=&sim_buses[n];
+      }
+      next=&sim_buses[n].next;
+    }
+  }
+  *next=NULL;
+  return found;
+}
+
+struct usb_bus *usb_get_busses(void)
+{
+  return &sim_buses[0];
+}
+
+usb_dev_handle *usb_open(struct usb_device *dev)
+{
+  usb_dev_handle *h;
+
+  if(dev == NULL || (h=malloc(sizeof(*h))) == NULL) {
+    return NULL;
+  }
+  h->dev=dev;
+  if(dev->descriptor.bDeviceClass == SIM_CLASS_HUB) {
+    h->board=NULL;
+    h->hub=dev->dev;
+    h->mode=SIM_MODE_GONE;
+    return h;
+  }
+  h->board=dev->dev;
+  h->hub=NULL;
+  h->mode=h->board->mode;
+  return h;
+}
+
+int usb_close(usb_dev_handle *dev)
+{
+  free(dev);
+  return 0;
+}
+
+struct usb_device *usb_device(usb_dev_handle *dev)
+{
+  return dev->dev;
+}
+
+int usb_set_configuration(usb_dev_handle *dev, int configuration)
+{
+  if(dev->hub) {
+    return 0;
+  }
+  sim_update_mode(dev->board);
+  return dev->board->mode != dev->mode ? SIM_ENODEV : 0;
+}
+
+int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
+{
+  return 0;
+}
+
+int usb_resetep(usb_dev_handle *dev, unsigned int ep)
+{
+  return 0;
+}
+
+// Bus reset: the JB8 resets with it and enumerates again after HRM_SIM_BOOT_MS
+int usb_reset(usb_dev_handle *dev)
+{
+  HRM_SimBoard *b=dev->board;
+
+  if(b == NULL) {
+    return 0;
+  }
+  sim_update_mode(b);
+  if(b->mode != dev->mode) {
+    return SIM_ENODEV;
+  }
+  b->mode=SIM_MODE_GONE;
+  b->busy_until=0;
+  b->sticky_error=0;
+  b->reenumerate_at=sim_now()+sim_boot_ms;
+  sim_reboot(b);
+  return 0;
+}
+
+int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen)
+{
+  snprintf(buf,buflen,"SIM%04d",dev->dev->devnum);
+  return strlen(buf);
+}
+
+char *usb_strerror(void)
+{
+  return sim_error;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Control requests                                                                //
+/////////////////////////////////////////////////////////////////////////////////////
+static int sim_hid_request(HRM_SimBoard *b, int requesttype, int request,
+                           int value, int index, char *bytes, int size)
+{
+  char *version,report[SIM_VERSION_REPORT_SIZE];
+
+  // GET_REPORT (Feature 2): version string of the user code, as on the wire: the
+  // report ID first, then the string zero padded to the report size
+  if(requesttype == 0xA1 && request == 0x01 && value == 0x0302
+     && (version=getenv("HRM_SIM_APP_VERSION"))) {
+    memset(report,0,sizeof(report));
+    report[0]=0x02;
+    strncpy(report+1,version,sizeof(report)-2);
+    memcpy(bytes,report,size < (int)sizeof(report) ? size : (int)sizeof(report));
+    return size < (int)sizeof(report) ? size : (int)sizeof(report);
+  }
+
+  // Standard GET_STATUS: self powered, no remote wakeup
+  if(requesttype == 0x80 && request == 0x00 && size >= 2) {
+    bytes[0]=0x01;
+    bytes[1]=0x00;
+    return 2;
+  }
+
+  // SET_REPORT (Feature): the user code clears the ICP flag (programs it to 0) and resets
+  if(requesttype == 0x21 && request == 0x09) {
+    if(b->flag_ms) {
+      b->flag_done_at=sim_now()+b->flag_ms;
+    } else {
+      sim_flag_cleared(b);
+    }
+    return size;
+  }
+  strcpy(sim_error,"STALL");
+  return SIM_EPIPE;
+}
+
+static int sim_icp_request(HRM_SimBoard *b, int requesttype, int request,
+                           int value, int index, char *bytes, int size)
+{
+  unsigned int start=value & 0xffff, end=index & 0xffff, i;
+  int ok;
+
+  switch(request) {
+
+  case SIM_REQ_PROGRAM:
+    if(requesttype != 0x40 || end < start || end-start+1 != (unsigned int)size
+       || size > SIM_ROW_SIZE) {
+      break;
+    }
+    sim_wait_ready(b);
+    ok=1;
+    for(i=0;i<(unsigned int)size;i++) {
+      // Programming can only clear bits
+      b->flash[start+i] &= (unsigned char)bytes[i];
+      if(b->flash[start+i] != (unsigned char)bytes[i]) {
+        ok=0;
+      }
+    }
+    sim_result(b,ok);
+    b->busy_until=sim_now()+b->row_ms;
+    return size;
+
+  case SIM_REQ_PROGRAM_BURST:
+    // The firmware programs each row as its 64 bytes are in, NAKs the rest
+    // of the data stage meanwhile, and STALLs the status stage on failure
+    if(b->stock || b->burst_rows == 0 || requesttype != 0x40 || index < 1
+       || (unsigned int)index > b->burst_rows || size != index*SIM_ROW_SIZE
+       || (start & (SIM_ROW_SIZE-1)) || start < SIM_USER_START
+       || start+size-1 > SIM_USER_END) {
+      break;
+    }
+    sim_wait_ready(b);
+    ok=1;
+    for(i=0;i<(unsigned int)size;i++) {
+      b->flash[start+i] &= (unsigned char)bytes[i];
+      if(b->flash[start+i] != (unsigned char)bytes[i]) {
+        ok=0;
+      }
+    }
+    b->busy_until=sim_now()+index*b->row_ms;
+    sim_wait_ready(b);
+    b->last_status = ok ? SIM_STATUS_OK : SIM_STATUS_FAIL;
+    if(!ok) {
+      break;
+    }
+    return size;
+
+  case SIM_REQ_ERASE:
+    if(requesttype != 0x40 || start < SIM_USER_START || end > SIM_USER_END) {
+      break;
+    }
+    sim_wait_ready(b);
+    if(!b->stock && start == SIM_USER_START && end == SIM_USER_END) {
+      // Mass erase of the user range
+      memset(b->flash+start,0xff,end-start+1);
+      b->busy_until=sim_now()+3*b->erase_ms;
+    } else {
+      // AN2398 erases the block containing the start address
+      start &= ~(SIM_BLOCK_SIZE-1);
+      memset(b->flash+start,0xff,SIM_BLOCK_SIZE);
+      b->busy_until=sim_now()+b->erase_ms;
+    }
+    sim_result(b,1);
+    return 0;
+
+  case SIM_REQ_STATUS:
+    if(requesttype != 0xC0 || size < 1) {
+      break;
+    }
+    if(sim_now() < b->busy_until) {
+      if(b->stock) {
+        sim_wait_ready(b);
+      } else {
+        bytes[0]=SIM_STATUS_BUSY;
+        return 1;
+      }
+    }
+    if(b->stock) {
+      bytes[0]=b->last_status;
+    } else {
+      bytes[0]= b->sticky_error ? SIM_STATUS_FAIL : SIM_STATUS_OK;
+      b->sticky_error=0;
+    }
+    return 1;
+
+  case SIM_REQ_READ:
+    if(b->stock || requesttype != 0xC0 || end < start || end-start+1 != (unsigned int)size) {
+      break;
+    }
+    sim_wait_ready(b);
+    memcpy(bytes,b->flash+start,size);
+    return size;
+
+  case SIM_REQ_GET_INFO:
+    if(b->stock || requesttype != 0xC0 || size < 2) {
+      break;
+    }
+    memset(bytes,0,size);
+    bytes[0]=b->burst_rows ? 2 : 1;
+    bytes[1]=SIM_CAP_MASS_ERASE | SIM_CAP_READ | SIM_CAP_STICKY_STATUS;
+    if(b->burst_rows && size >= 3) {
+      bytes[1]|=SIM_CAP_BURST;
+      bytes[2]=b->burst_rows;
+    }
+    return size;
+  }
+
+  strcpy(sim_error,"STALL");
+  return SIM_EPIPE;
+}
+
+// Port power switching: a board without power is gone, and enumerates
+// HRM_SIM_POWER_ON_MS after it is back (in ICP mode, once its flag is cleared)
+static int sim_hub_request_locked(HRM_SimHub *h, int requesttype, int request,
+                                  int value, int index, char *bytes, int size)
+{
+  static const unsigned char desc[9]={9,0x29,SIM_HUB_PORTS,0,0,10,100,0,0xff};
+  unsigned int ports,n,on;
+  HRM_SimBoard *b;
+
+  if(requesttype == 0xA0 && request == SIM_HUB_GET_DESCRIPTOR && (value >> 8) == 0x29) {
+    n = size < (int)sizeof(desc) ? size : (int)sizeof(desc);
+    memcpy(bytes,desc,n);
+    if(n > 3) {
+      bytes[3]=sim_hub_power;
+    }
+    return n;
+  }
+  if(index < 1 || index > SIM_HUB_PORTS) {
+    strcpy(sim_error,"STALL");
+    return SIM_EPIPE;
+  }
+
+  // wPortStatus: connection, enable, power
+  if(requesttype == 0xA3 && request == SIM_HUB_GET_STATUS && size >= 4) {
+    on = sim_hub_power == SIM_POWER_NONE || !(h->power_off & (1 << index));
+    memset(bytes,0,4);
+    bytes[1] = on ? 0x01 : 0x00;
+    for(n=0;n<sim_nboards;n++) {
+      b=&sim_boards[n];
+      sim_update_mode(b);
+      if(b->parent == h && b->port_num == (unsigned int)index && b->mode != SIM_MODE_GONE) {
+        bytes[0]=0x03;
+      }
+    }
+    return 4;
+  }
+
+  if(requesttype != 0x23 || value != SIM_HUB_PORT_POWER
+     || (request != SIM_HUB_CLEAR_FEATURE && request != SIM_HUB_SET_FEATURE)) {
+    strcpy(sim_error,"STALL");
+    return SIM_EPIPE;
+  }
+  if(sim_hub_power == SIM_POWER_NONE) {
+    return 0;
+  }
+
+  // A ganged hub switches all of its ports together
+  ports = sim_hub_power == SIM_POWER_GANGED ? 0x1fe : 1u << index;
+  if(request == SIM_HUB_CLEAR_FEATURE) {
+    h->power_off|=ports;
+  } else {
+    ports&=h->power_off;
+    h->power_off&=~ports;
+  }
+  for(n=0;n<sim_nboards;n++) {
+    b=&sim_boards[n];
+    if(b->parent != h || !(ports & (1 << b->port_num))) {
+      continue;
+    }
+    if(request == SIM_HUB_CLEAR_FEATURE) {
+      // A flag write cut short leaves the flag as it was
+      b->flag_done_at=0;
+      b->mode=SIM_MODE_GONE;
+      b->reenumerate_at=SIM_POWER_OFF;
+      b->busy_until=0;
+      b->sticky_error=0;
+    } else {
+      b->reenumerate_at=sim_now()+sim_power_on_ms;
+      sim_reboot(b);
+    }
+  }
+  return 0;
+}
+
+// Hubs can be switched from several threads
+static int sim_hub_request(HRM_SimHub *h, int requesttype, int request,
+                           int value, int index, char *bytes, int size)
+{
+  static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+  int result;
+
+  pthread_mutex_lock(&lock);
+  result=sim_hub_request_locked(h,requesttype,request,value,index,bytes,size);
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
+                    int value, int index, char *bytes, int size, int timeout)
+{
+  HRM_SimBoard *b=dev->board;
+  int op,fault=SIM_FAULT_NONE,result,bit;
+
+  if(dev->hub) {
+    return sim_hub_request(dev->hub,requesttype,request,value,index,bytes,size);
+  }
+  sim_update_mode(b);
+
+  // A board that re-enumerated is a different device for old handles
+  if(b->mode != dev->mode) {
+    strcpy(sim_error,"No such device");
+    return SIM_ENODEV;
+  }
+
+  // Transfers through a hub wait for its transaction translator
+  if(sim_xfer_us && b->hub >= 0) {
+    pthread_mutex_lock(&sim_hubs[b->hub].tt);
+    usleep(sim_xfer_us);
+    pthread_mutex_unlock(&sim_hubs[b->hub].tt);
+  }
+
+  // Injected faults before the request is served
+  switch(b->mode == SIM_MODE_HID ? -1 : request) {
+  case -1:               op=SIM_OP_HID;     break;
+  case SIM_REQ_PROGRAM:
+  case SIM_REQ_PROGRAM_BURST: op=SIM_OP_PROGRAM; break;
+  case SIM_REQ_ERASE:    op=SIM_OP_ERASE;   break;
+  case SIM_REQ_READ:     op=SIM_OP_READ;    break;
+  case SIM_REQ_STATUS:   op=SIM_OP_STATUS;  break;
+  case SIM_REQ_GET_INFO: op=SIM_OP_INFO;    break;
+  default:               op=-1;             break;
+  }
+  if(op >= 0) {
+    pthread_mutex_lock(&sim_fault_lock);
+    fault=sim_fault(op);
+    pthread_mutex_unlock(&sim_fault_lock);
+  }
+
+  switch(fault) {
+  case SIM_FAULT_TIMEOUT:
+    usleep(timeout*1000);
+    strcpy(sim_error,"Connection timed out");
+    return SIM_ETIMEDOUT;
+  case SIM_FAULT_STALL:
+    strcpy(sim_error,"STALL");
+    return SIM_EPIPE;
+  case SIM_FAULT_DISCONNECT:
+    b->mode=SIM_MODE_GONE;
+    b->reenumerate_at=sim_now()+b->replug_ms;
+    b->busy_until=0;
+    b->sticky_error=0;
+    strcpy(sim_error,"No such device");
+    return SIM_ENODEV;
+  case SIM_FAULT_SHORT:
+    // The data stage of an OUT request breaks off: the request is dropped
+    if(!(requesttype & 0x80)) {
+      return size/2;
+    }
+    break;
+  case SIM_FAULT_BUSY:
+    if(op == SIM_OP_STATUS && size >= 1) {
+      bytes[0]=SIM_STATUS_BUSY;
+      return 1;
+    }
+    break;
+  }
+
+  if(b->mode == SIM_MODE_HID) {
+    result=sim_hid_request(b,requesttype,request,value,index,bytes,size);
+  } else {
+    result=sim_icp_request(b,requesttype,request,value,index,bytes,size);
+  }
+
+  // Injected faults in the result
+  if(fault == SIM_FAULT_SHORT && result > 0) {
+    result/=2;
+  } else if(fault == SIM_FAULT_BITERR && op == SIM_OP_PROGRAM && result > 0) {
+    pthread_mutex_lock(&sim_fault_lock);
+    bit=(int)(sim_random()*result*8);
+    pthread_mutex_unlock(&sim_fault_lock);
+    b->flash[(value & 0xffff)+bit/8] ^= 1<<(bit%8);
+  }
+  return result;
+}
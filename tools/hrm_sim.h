@@ -0,0 +1,132 @@
+/////////////////////////////////////////////////////////////////
+// HC908JB8 USB ICP Simulator - libusb-0.1 compatible interface
+// =============================================================
+//
+// Drop-in replacement for <usb.h> when manage.c is compiled with
+// -DHRM_SIM. Only the part of the libusb-0.1 API used by manage.c
+// is provided. The simulated board behaves like a JB8 running the
+// AN2398 ICP resident code (plus the optional extended requests)
+// and a user application that accepts the ICP flag clear keys.
+//
+// Environment:
+//   HRM_SIM_STOCK=1        Stock AN2398 firmware (no extended requests)
+//   HRM_SIM_MODE=hid|icp   Mode the board starts in (default: icp)
+//   HRM_SIM_ROW_MS=n       Row program time in ms (default: 8)
+//   HRM_SIM_ERASE_MS=n     Block erase time in ms (default: 5)
+//   HRM_SIM_REPLUG_MS=n    Re-enumeration delay after ICP flag clear (default: 500)
+//   HRM_SIM_FLAG_MS=n      Time the user code takes to write the cleared ICP flag; the
+//                          board stays in HID mode until then, and a power off before
+//                          leaves the flag as it was (default: 0)
+//   HRM_SIM_BURST_ROWS=n   Rows per program burst of the extended firmware,
+//                          0 = protocol version 1 without bursts (default: 8)
+//   HRM_SIM_FLASH=file     Keep the flash contents in a file between runs
+//   HRM_SIM_APP_VERSION=s  Version string the user code reports in HID mode
+//   HRM_SIM_BOARDS=n       Boards on the bus, devices 002, 003, ... (default: 1).
+//                          Board n>1 keeps its flash in HRM_SIM_FLASH.n
+//   HRM_SIM_ARRIVE_MS=n    Board n is plugged in (in ICP mode) (n-1)*this ms
+//                          after the start (default: 0, all there at once)
+//   HRM_SIM_TOPOLOGY=list  Port path of each board as in sysfs, "1-1.1,1-1.2,2-3,..."
+//                          The number before "-" is the bus (1-8), a dot means an
+//                          external hub (default: board n on root port 1-n)
+//   HRM_SIM_XFER_US=n      Time a control transfer holds the transaction translator
+//                          of its hub; transfers behind one hub queue (default: 0)
+//   HRM_SIM_HUB_POWER=s    Port power switching of the hubs (root hubs as device 001,
+//                          external ones from 064): per-port, ganged or none
+//                          (default: per-port)
+//   HRM_SIM_POWER_ON_MS=n  Enumeration delay after port power on (default: 150).
+//                          Set HRM_SIM_REPLUG_MS high to model a board that only
+//                          comes back in ICP mode after a power cycle
+//   HRM_SIM_BOOT_MS=n      Enumeration delay after a USB bus reset (default: 200).
+//                          After a reset or power on, a board in ICP mode starts the
+//                          user code (HID mode) if its ICP flag matches the checksum
+//
+// Fault injection:
+//   HRM_SIM_FAULTS=list    Random faults, "op:fault=probability,..."
+//                          e.g. "program:biterr=0.001,status:busy=0.05,any:stall=0.001"
+//   HRM_SIM_FAULT_SCRIPT=list  Faults at the n:th request of a type, "op#n:fault,..."
+//                          e.g. "erase#3:timeout,program#40:disconnect"
+//   HRM_SIM_SEED=n         Seed of the random faults (default: 1)
+//
+//   op:    program, erase, read, status, info, hid, any
+//   fault: timeout     No reply, the request times out
+//          short       Short transfer (nothing is done for OUT requests)
+//          stall       Request STALLs
+//          busy        Status reads busy (status requests)
+//          biterr      A bit of the row is programmed wrong, status is OK (program)
+//          disconnect  The board resets and re-enumerates in ICP mode
+//   The injected faults are counted to stderr at exit.
+//
+/////////////////////////////////////////////////////////////////
+
+#ifndef HRM_SIM_H
+#define HRM_SIM_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#define HRM_SIM_PATH_MAX 64
+
+struct usb_device_descriptor {
+  unsigned char  bLength;
+  unsigned char  bDescriptorType;
+  unsigned short bcdUSB;
+  unsigned char  bDeviceClass;
+  unsigned char  bDeviceSubClass;
+  unsigned char  bDeviceProtocol;
+  unsigned char  bMaxPacketSize0;
+  unsigned short idVendor;
+  unsigned short idProduct;
+  unsigned short bcdDevice;
+  unsigned char  iManufacturer;
+  unsigned char  iProduct;
+  unsigned char  iSerialNumber;
+  unsigned char  bNumConfigurations;
+};
+
+struct usb_bus;
+
+struct usb_device {
+  struct usb_device *next, *prev;
+  char filename[HRM_SIM_PATH_MAX];
+  struct usb_bus *bus;
+  struct usb_device_descriptor descriptor;
+  void *dev;                          // Simulated board behind this device
+  unsigned char devnum;
+};
+
+struct usb_bus {
+  struct usb_bus *next, *prev;
+  char dirname[HRM_SIM_PATH_MAX];
+  struct usb_device *devices;
+  unsigned int location;
+};
+
+typedef struct usb_dev_handle usb_dev_handle;
+
+void usb_init(void);
+int usb_find_busses(void);
+int usb_find_devices(void);
+struct usb_bus *usb_get_busses(void);
+
+usb_dev_handle *usb_open(struct usb_device *dev);
+int usb_close(usb_dev_handle *dev);
+struct usb_device *usb_device(usb_dev_handle *dev);
+
+int usb_set_configuration(usb_dev_handle *dev, int configuration);
+int usb_clear_halt(usb_dev_handle *dev, unsigned int ep);
+int usb_resetep(usb_dev_handle *dev, unsigned int ep);
+int usb_reset(usb_dev_handle *dev);
+
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
+                    int value, int index, char *bytes, int size, int timeout);
+int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen);
+
+char *usb_strerror(void);
+
+// Simulator extensions: port path of a board or hub (sysfs name on a real host),
+// and a wait for the next device to enumerate (inotify on a real host)
+int hrm_sim_port_path(struct usb_device *dev, char *buf, int len);
+int hrm_sim_wait_event(double ms);
+
+#endif
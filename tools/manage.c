@@ -14,7 +14,15 @@
 //
 // Compile:
 // ======== 
-// MinGW: gcc manage.c -o manage -lusb -O2 -Wall
+// MinGW: gcc manage.c hc08_cpu.c -o manage -lusb -O2 -Wall
+// Linux: gcc manage.c hc08_cpu.c -o manage -lusb -lpthread -O2 -Wall
+//
+// Simulator (no hardware, see hrm_sim.h):
+//        gcc -DHRM_SIM manage.c hc08_cpu.c hrm_sim.c -o manage_sim -lpthread -O2 -Wall
+//
+// Compressed images (any of): -DHRM_ZLIB -lz  (gzip)
+//                             -DHRM_LZMA -llzma (xz)
+//                             -DHRM_ZSTD -lzstd (zstd)
 //
 //
 // Version Log:  
@@ -26,9 +34,34 @@
 /////////////////////////////////////////////////////////////////
 
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE               // sched_setaffinity() for the real-time mode
+#endif
+
+#ifdef HRM_SIM
+#include "hrm_sim.h"
+#else
 #include <usb.h>
+#endif
+#include "hc08_cpu.h"
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Compressed images (optional)
+#ifdef HRM_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HRM_LZMA
+#include <lzma.h>
+#endif
+#ifdef HRM_ZSTD
+#include <zstd.h>
+#endif
 
 #ifdef __MINGW32__
 // WINDOWS
@@ -36,18 +69,259 @@
 // For Sleep()
 #include <windows.h>
 
+#include <direct.h>
+#define HRM_MkDir(path) mkdir(path)
+
+#include <io.h>
+#include <fcntl.h>
+#define HRM_OPEN_FLAGS (O_RDONLY | O_BINARY)
+#define HRM_SetBinary(fd) _setmode(fd,O_BINARY)
+
+// Library use from several threads is not supported on Windows
+#define HRM_USB_LOCK()
+#define HRM_USB_UNLOCK()
+
+// Millisecond timestamp for timing reports and deadlines
+double HRM_GetTimeMs(void)
+{
+  LARGE_INTEGER freq,now;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart*1000.0/(double)freq.QuadPart;
+}
+
+// Deadline timer: Windows Sleep() has no absolute mode, so just sleep the rest
+void HRM_WaitUntil(double deadline)
+{
+  double left=deadline-HRM_GetTimeMs();
+
+  if(left > 0) {
+    Sleep((DWORD)(left+0.999));
+  }
+}
+
+void HRM_TimerCalibrate(void)
+{
+}
+
 #else
 // UNIX
 
+#define HRM_MkDir(path) mkdir(path,0755)
+
+#include <fcntl.h>
+#define HRM_OPEN_FLAGS O_RDONLY
+#define HRM_SetBinary(fd)
+
+#include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <poll.h>
+
+// libusb-0.1 keeps one global bus list: one enumeration at a time
+static pthread_mutex_t hrm_usb_lock=PTHREAD_MUTEX_INITIALIZER;
+#define HRM_USB_LOCK()   pthread_mutex_lock(&hrm_usb_lock)
+#define HRM_USB_UNLOCK() pthread_mutex_unlock(&hrm_usb_lock)
+
+#define HRM_OVERSHOOT_BUCKETS 1000  // 10us buckets, the last one collects the rest
+#define HRM_TIMER_SPIN_MAX_US  500  // Upper limit for the learned compensation
+#define HRM_TIMER_CALIBRATE      8  // Sleeps measured at start-up
+
+// How much later than asked the deadline timer returned
+typedef struct HRM_SleepStats {
+  unsigned int count;
+  double total_us;
+  double max_us;
+  unsigned int hist[HRM_OVERSHOOT_BUCKETS];
+  double compensation_us;           // Learned systematic overshoot of this host
+} HRM_SleepStats;
+
+// Gang, flag clear and parser threads all wait: one lock for the statistics
+static HRM_SleepStats hrm_sleep_stats;
+static pthread_mutex_t hrm_sleep_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Millisecond timestamp (CLOCK_MONOTONIC) for timing reports and deadlines
+double HRM_GetTimeMs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000.0 + ts.tv_nsec/1e6;
+}
+
+static void HRM_MsToTimespec(double ms, struct timespec *ts)
+{
+  ts->tv_sec=(time_t)(ms/1000);
+  ts->tv_nsec=(long)((ms-ts->tv_sec*1000.0)*1e6);
+  if(ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec-=1000000000L;
+  }
+}
+
+// Earlier than the deadline by the learned overshoot of this host
+static double HRM_TimerTarget(double deadline)
+{
+  double target;
+
+  pthread_mutex_lock(&hrm_sleep_lock);
+  target=deadline-hrm_sleep_stats.compensation_us/1000;
+  pthread_mutex_unlock(&hrm_sleep_lock);
+  return(target);
+}
+
+// Learns the systematic overshoot from a wake-up meant for target (slowly, one
+// late wake-up is no trend)
+static void HRM_TimerLearn(double target)
+{
+  HRM_SleepStats *st=&hrm_sleep_stats;
+  double late=(HRM_GetTimeMs()-target)*1000;
+
+  pthread_mutex_lock(&hrm_sleep_lock);
+  st->compensation_us+=(late-st->compensation_us)/8;
+  if(st->compensation_us < 0) {
+    st->compensation_us=0;
+  }
+  if(st->compensation_us > HRM_TIMER_SPIN_MAX_US) {
+    st->compensation_us=HRM_TIMER_SPIN_MAX_US;
+  }
+  pthread_mutex_unlock(&hrm_sleep_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_WaitUntil                                                                  //
+// =============                                                                  //
+// - Deadline timer: waits until the absolute time (HRM_GetTimeMs() base).        //
+//   Sleeps to the deadline minus the learned overshoot of this host with         //
+//   clock_nanosleep(TIMER_ABSTIME) and spins the short rest, so consecutive      //
+//   waits don't add up their overshoot and never return early                    //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_WaitUntil(double deadline)
+{
+  HRM_SleepStats *st=&hrm_sleep_stats;
+  struct timespec ts;
+  double target,now,overshoot;
+  int bucket;
+
+  // Already passed, nothing to wait or measure
+  if(deadline <= HRM_GetTimeMs()) {
+    return;
+  }
+
+  target=HRM_TimerTarget(deadline);
+  if(target > HRM_GetTimeMs()) {
+    HRM_MsToTimespec(target,&ts);
+    // A signal does not move the deadline
+    while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL) == EINTR);
+    HRM_TimerLearn(target);
+  }
+
+  // The rest is shorter than a wake-up takes
+  while((now=HRM_GetTimeMs()) < deadline);
+
+  overshoot=(now-deadline)*1000;
+  bucket=(int)(overshoot/10);
+  pthread_mutex_lock(&hrm_sleep_lock);
+  st->hist[bucket < HRM_OVERSHOOT_BUCKETS ? bucket : HRM_OVERSHOOT_BUCKETS-1]++;
+  st->count++;
+  st->total_us+=overshoot;
+  if(overshoot > st->max_us) {
+    st->max_us=overshoot;
+  }
+  pthread_mutex_unlock(&hrm_sleep_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_TimerCalibrate                                                             //
+// ==================                                                             //
+// - Measures the overshoot of this host with a few short sleeps before the       //
+//   real waits, and forgets them from the statistics                             //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_TimerCalibrate(void)
+{
+  int i;
+  double comp;
+
+  for(i=0;i<HRM_TIMER_CALIBRATE;i++) {
+    HRM_WaitUntil(HRM_GetTimeMs()+1);
+  }
+  pthread_mutex_lock(&hrm_sleep_lock);
+  comp=hrm_sleep_stats.compensation_us;
+  memset(&hrm_sleep_stats,0,sizeof(hrm_sleep_stats));
+  hrm_sleep_stats.compensation_us=comp;
+  pthread_mutex_unlock(&hrm_sleep_lock);
+}
+
 void Sleep(unsigned int  ms )
 {
-    // 1 milliseconds = 1000 microsecond.
-    // Windows Sleep uses miliseconds
-    // linux usleep uses microsecond
-    // and since the default
-    // usage of the code was under windows 
-    // so the argument is coming in millisecond.
-    usleep( ms * 1000 );
+  // Windows Sleep uses miliseconds, and since the default
+  // usage of the code was under windows the argument is
+  // coming in millisecond.
+  HRM_WaitUntil(HRM_GetTimeMs()+ms);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_MapFile                                                                    //
+// ===========                                                                    //
+// - Maps a whole file read-only (read to memory on Windows). Returns NULL if     //
+//   the file can't be opened; an empty file gives a non-NULL pointer             //
+////////////////////////////////////////////////////////////////////////////////////
+#ifndef __MINGW32__
+void *HRM_MapFile(const char *path, size_t *len)
+{
+  struct stat st;
+  void *p;
+  int fd;
+
+  if((fd=open(path,O_RDONLY)) < 0) {
+    return(NULL);
+  }
+  if(fstat(fd,&st) < 0) {
+    close(fd);
+    return(NULL);
+  }
+  *len=st.st_size;
+  p = *len ? mmap(NULL,*len,PROT_READ,MAP_PRIVATE,fd,0) : (void *)"";
+  close(fd);
+  return(p == MAP_FAILED ? NULL : p);
+}
+
+void HRM_UnmapFile(void *p, size_t len)
+{
+  if(len) {
+    munmap(p,len);
+  }
+}
+#else
+void *HRM_MapFile(const char *path, size_t *len)
+{
+  FILE *fp;
+  char *p;
+
+  if((fp=fopen(path,"rb")) == NULL) {
+    return(NULL);
+  }
+  fseek(fp,0,SEEK_END);
+  *len=ftell(fp);
+  fseek(fp,0,SEEK_SET);
+  if((p=malloc(*len+1)) && fread(p,1,*len,fp) != *len) {
+    free(p);
+    p=NULL;
+  }
+  fclose(fp);
+  return(p);
+}
+
+void HRM_UnmapFile(void *p, size_t len)
+{
+  free(p);
 }
 #endif
 
@@ -61,16 +335,131 @@ void Sleep(unsigned int  ms )
 #define ICP_VID 0x0425
 #define ICP_PID 0xff01
 
-#define MAX_LINE_LEN 512
+// HID Feature report of the user code that holds its version string
+#define HID_VERSION_REPORT_ID 0x02
+
+#define MAX_LINE_LEN 520          // Longest S19 record (514 characters) and the line end
+#define HRM_VERSION_SIZE 64
 #define BUF_SIZE 0x40
 
 #define MEM_SIZE 0x1C00           //7168 bytes
 #define MEM_OFFSET 0xDC00
 #define MEM_BLOCK_SIZE 0x200      // 512 bytes
 #define MEM_PROG_BLOCK_SIZE 0x40  // 64 bytes
+#define MEM_BLOCKS (MEM_SIZE/MEM_BLOCK_SIZE)
+#define MEM_ROWS   (MEM_SIZE/MEM_PROG_BLOCK_SIZE)
 
 #define WAIT_PROGRAMMING 70       // Wait after sent ICP programming command to device
 #define WAIT_STATUS       5       // Wait after sent ICP satus commnd to device
+#define WAIT_ERASE        5       // Wait after sent ICP erase command to device
+#define TIMEOUT_PROGRAMMING 1000  // Give up polling a row program after this
+#define TIMEOUT_ERASE    1000     // Give up polling a block erase after this
+
+// Timing calibration
+#define HRM_CALIBRATION_FILE ".hrm_calibration"  // In $HOME
+#define HRM_CALIBRATION_ROUNDS 5      // Erase + program cycles measured by default
+#define HRM_CALIBRATION_POLL   0.5    // Status poll interval while measuring (ms)
+#define HRM_CALIBRATION_MARGIN 1.25   // First poll at learned p99 * margin ...
+#define HRM_CALIBRATION_MARGIN_MS 1.0 // ... + this (ms)
+
+// Flash wear tracking
+#define HRM_WEAR_FILE ".hrm_wear"     // In $HOME
+#define HRM_WEAR_NEAR 80              // % of the endurance, from which erases are avoided
+#define HRM_WEAR_HOTTEST 3            // Blocks listed per device in the wear report
+#define HRM_DEVICE_ID_SIZE 32
+
+// Image input
+#define HRM_INPUT_CHUNK 0x4000        // Read/decompress in chunks of this size
+#define HRM_FORMAT_PLAIN 0
+#define HRM_FORMAT_GZIP  1
+#define HRM_FORMAT_XZ    2
+#define HRM_FORMAT_ZSTD  3
+
+static char *HRM_FormatNames[]={"plain","gzip","xz","zstd"};
+
+// Parallel parsing of large plain files
+#define HRM_PARALLEL_MIN 0x100000     // Smaller files are parsed sequentially
+#define HRM_MAX_THREADS 64
+#define HRM_CHUNKS_PER_THREAD 4
+
+// Smoke test of the image on the HC08 simulator (JB8 memory map)
+#define HRM_SMOKE_CYCLES 200000       // Default budget: ~67 ms of the 3 MHz bus
+#define HRM_SMOKE_IO_END    0x003F    // I/O registers from 0x0000
+#define HRM_SMOKE_RAM_START 0x0040
+#define HRM_SMOKE_RAM_END   0x013F
+#define HRM_RESET_VECTOR    0xF7FC    // User reset vector, relocated by the ICP resident code
+
+// Load-time address windows
+#define HRM_MAX_WINDOWS 8
+
+// Live status board shared by the manage processes of a station
+#define HRM_STATUS_FILE "/dev/shm/hrm_status"
+#define HRM_STATUS_MAGIC 0x48524D53   // "HRMS"
+#define HRM_STATUS_VERSION 3
+#define HRM_STATUS_SLOTS 32
+#define HRM_STATUS_NAME_SIZE 32
+#define HRM_STATUS_REFRESH 200        // Viewer refresh interval (ms)
+#define HRM_STATUS_READ_TRIES 1000    // Reader retries of a slot being written
+
+// Gang programming: all boards of a fixture on a small worker pool
+#define HRM_GANG_MAX_BOARDS 64        // Boards known at the same time
+#define HRM_GANG_MAX_WORKERS 16
+#define HRM_GANG_WORKERS 4            // Default pool size (at most the cores)
+#define HRM_GANG_SCAN_MS 250          // Bus scan interval for arriving boards
+#define HRM_GANG_VERIFY_ROWS 8        // Rows read back by one verify task
+#define HRM_GANG_APP_POLL 20          // Look for the application in HID mode every ms
+#define HRM_GANG_PATH_SIZE 32         // "bus/device"
+#define HRM_GANG_MAX_NODES 64         // Host controllers and hubs
+#define HRM_GANG_MAX_DEPTH 8          // Controller and hubs on the way to a board
+#define HRM_GANG_PER_HUB 1            // Default in-flight transfers per hub (its transaction translator)
+#define HRM_GANG_PER_BUS 4            // ...and per host controller
+#define HRM_SYSFS_USB "/sys/bus/usb/devices"
+#define HRM_USBFS "/dev/bus/usb"       // Device nodes, watched for arriving devices
+
+// Hub class requests (USB 2.0 chapter 11) to power cycle a board's port
+#define HUB_CLASS              0x09
+#define HUB_REQ_GET_STATUS     0x00   // IN:  wIndex=port, 4 bytes port status and change
+#define HUB_REQ_CLEAR_FEATURE  0x01   // OUT: wValue=feature, wIndex=port
+#define HUB_REQ_SET_FEATURE    0x03   // OUT: wValue=feature, wIndex=port
+#define HUB_REQ_GET_DESCRIPTOR 0x06   // IN:  wValue=HUB_DESCRIPTOR<<8
+#define HUB_DESCRIPTOR         0x29
+#define HUB_DESCRIPTOR_SIZE    9
+#define HUB_PORT_POWER         8      // Port feature selector
+#define HUB_STATUS_POWER       0x0100 // wPortStatus: port is powered
+#define HUB_POWER_SWITCHING    0x03   // wHubCharacteristics: 00 ganged, 01 per port, 1x none
+#define HUB_POWER_PER_PORT     0x01
+#define HRM_POWER_OFF_MS       500    // Default off time of a power cycle
+#define HRM_POWER_SETTLE_MS    1000   // Default wait for the board to detach after the flag clear
+#define HRM_CONNECT_TIMEOUT    30     // Wait this many seconds for the device in ICP mode
+#define HRM_APP_TIMEOUT        10     // Default wait for the application after the reset (s)
+
+// Image store
+#define HRM_STORE_DIR ".hrm_store"    // In $HOME
+#define HRM_VARIANT_NAME_SIZE 64
+#define WAIT_MASS_ERASE 100       // First status poll after a whole range erase
+#define TIMEOUT_MASS_ERASE 2000   // Give up polling the whole range erase after this
+#define HRM_REPAIR_TRIES 5        // Erases of a block for one repair
+
+// ICP vendor requests (AN2398)
+#define ICP_REQ_PROGRAM   0x81    // OUT: wValue=start, wIndex=end, data=row
+#define ICP_REQ_ERASE     0x82    // OUT: wValue=start, wIndex=end
+#define ICP_REQ_STATUS    0x8F    // IN:  1 byte result of the last command
+#define ICP_REQ_READ      0x83    // IN:  wValue=start, wIndex=end (extended)
+// Optional requests of an extended ICP resident firmware.
+// The stock AN2398 firmware STALLs these, which is how they are probed.
+#define ICP_REQ_GET_INFO  0x90    // IN:  HRM_ICP_INFO_SIZE bytes (version, caps, burst rows)
+#define ICP_REQ_PROGRAM_BURST 0x84 // OUT: wValue=start, wIndex=rows, data=rows; the status
+                                   //      stage completes when all are programmed, STALLs on failure
+
+#define ICP_STATUS_OK     0x01
+#define ICP_STATUS_BUSY   0x80    // Extended firmware: command still running
+
+#define HRM_ICP_INFO_SIZE 4
+#define ICP_CAP_MASS_ERASE 0x01   // ICP_REQ_ERASE accepts the whole user range
+#define ICP_CAP_READ       0x02   // ICP_REQ_READ is supported
+#define ICP_CAP_STICKY_STATUS 0x04 // Status reports any failure since the last status read
+#define ICP_CAP_BURST      0x08   // ICP_REQ_PROGRAM_BURST is supported
+#define HRM_BURST_MAX_ROWS (MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE) // Host limit for one burst
 
 #define ICP_CHECKSUM_START 0xF600
 #define ICP_CHECKSUM_STOP  0XF7FD
@@ -85,6 +474,9 @@ void Sleep(unsigned int  ms )
 // NOTE: Uses "variadic macro"-definition. See: http://en.wikipedia.org/wiki/Variadic_macro
 #define HRM_printf(x,...) if(x) {printf(__VA_ARGS__);fflush(stdout);}
 
+#define HRM_MIN(a,b) ((a) < (b) ? (a) : (b))
+#define HRM_MAX(a,b) ((a) > (b) ? (a) : (b))
+
 // Errorcodes and errormessager /////////////////////////////////////////////////////////////
 #define HRM_NO_ERRORS           0 
 #define HRM_USB_OPEN_ERROR      1
@@ -92,6 +484,13 @@ void Sleep(unsigned int  ms )
 #define HRM_FILE_OPEN_ERROR     3
 #define HRM_FLASH_ERASE_ERROR   4
 #define HRM_FLASH_PROGRAM_ERROR 5
+#define HRM_ARGUMENT_ERROR      6
+#define HRM_FLASH_VERIFY_ERROR  7
+#define HRM_STORE_ERROR         8
+#define HRM_FILE_FORMAT_ERROR   9
+#define HRM_SMOKE_ERROR        10
+#define HRM_WINDOW_ERROR       11
+#define HRM_APP_ERROR          12
 
 static char *HRM_Errors[]=
 {
@@ -101,424 +500,5356 @@ static char *HRM_Errors[]=
   "File not found\n",                        // 3
   "Flash Erase failed!\n",                   // 4
   "Flash Program failed!\n",                 // 5
+  "Invalid argument!\n",                     // 6
+  "Flash Verify failed!\n",                  // 7
+  "Image store error!\n",                    // 8
+  "Unsupported or corrupt file!\n",          // 9
+  "Image smoke test failed!\n",              // 10
+  "Image data outside the load window!\n",   // 11
+  "Application did not start!\n",           // 12
+};
+
+// Device profiles ////////////////////////////////////////////////////////////////////////////
+typedef struct HRM_Profile {
+
+  char *name;                        // Device name
+  unsigned int icp_vid,icp_pid;      // ICP mode identity
+
+  unsigned int min_program_time;     // Minimum row program time (ms)
+  unsigned char deferred_status;     // 1 = batched status checking is safe on this device
+  unsigned int endurance;            // Erase cycles per block the flash is specified for
+
+} HRM_Profile;
+
+// Deferred status on the JB8 is checked against the simulator only (see sim_check.sh),
+// not yet on real devices: off there until it is
+#ifdef HRM_SIM
+#define HRM_JB8_DEFERRED 1
+#else
+#define HRM_JB8_DEFERRED 0
+#endif
+
+static HRM_Profile HRM_Profiles[]=
+{
+  // Deferred status needs the sticky status and readback requests of the firmware too
+  { "MC68HC908JB8", ICP_VID, ICP_PID, 10, HRM_JB8_DEFERRED, 10000 },
+  { NULL }
+};
+
+// Measured operations for the timing calibration
+#define HRM_OP_ROW        0
+#define HRM_OP_ERASE      1
+#define HRM_OP_MASS_ERASE 2
+#define HRM_OP_COUNT      3
+
+static char *HRM_OpNames[HRM_OP_COUNT]=
+{
+  "row_program",
+  "block_erase",
+  "mass_erase",
+};
+
+// Completion time percentiles of one operation (ms)
+typedef struct HRM_Timing {
+  unsigned int count;
+  double p50,p90,p99,max;
+} HRM_Timing;
+
+// Phases of a run, as shown on the status board
+#define HRM_PHASE_IDLE    0
+#define HRM_PHASE_LOAD    1
+#define HRM_PHASE_SMOKE   2
+#define HRM_PHASE_FLAG    3
+#define HRM_PHASE_CONNECT 4
+#define HRM_PHASE_MATCH   5
+#define HRM_PHASE_ERASE   6
+#define HRM_PHASE_PROGRAM 7
+#define HRM_PHASE_VERIFY  8
+#define HRM_PHASE_APP     9
+#define HRM_PHASE_DONE   10
+#define HRM_PHASE_FAILED 11
+#define HRM_PHASE_COUNT  12
+
+static char *HRM_PhaseNames[HRM_PHASE_COUNT]=
+{
+  "idle",
+  "load",
+  "smoke test",
+  "clear flag",
+  "connect",
+  "match",
+  "erase",
+  "program",
+  "verify",
+  "app check",
+  "done",
+  "FAILED",
 };
 
+// One process on the status board. Only the owner writes it, with a seqlock:
+// seq is odd while an update is in progress, readers retry until they copy
+// the slot between two equal even values. A cache line of its own per slot,
+// so the stations don't slow each other down.
+typedef struct HRM_StatusSlot {
+  volatile unsigned int seq;
+  volatile int pid;                  // Owner process (0 = never used)
+  char name[HRM_STATUS_NAME_SIZE];   // Station or fixture
+  char image[HRM_STATUS_NAME_SIZE];  // File or variant being programmed
+  unsigned char phase;               // HRM_PHASE_xxx
+  unsigned char result;              // Error code of a finished run
+  unsigned short addr;               // Flash address being erased or programmed
+  unsigned int rows_done,rows_total;
+  unsigned int retries;              // Rows repaired, erases repeated
+  double started;                    // HRM_GetTimeMs() at the start of the run,
+  double changed;                    // ...of the last phase change
+  double updated;                    // ...and of the last update
+  double phase_ms[HRM_PHASE_COUNT];  // Time spent in each phase of the run
+} __attribute__((aligned(64))) HRM_StatusSlot;
+
+typedef struct HRM_StatusBoard {
+  volatile unsigned int magic;       // Set last, when the header is valid
+  unsigned int version;
+  unsigned int slots;
+  unsigned int slot_size;
+  HRM_StatusSlot slot[HRM_STATUS_SLOTS];
+} HRM_StatusBoard;
+
+// Image file being read, decompressed on the fly. Read with plain read() calls,
+// so pipes work and parsing starts with the first bytes that arrive.
+typedef struct HRM_Input {
+  int fd;                            // -1 = not open
+  unsigned char own;                 // Opened by name (not stdin or /dev/fd/N)
+  int format;                        // HRM_FORMAT_xxx (by the magic bytes)
+  unsigned char in[HRM_INPUT_CHUNK]; // Compressed chunk
+  size_t in_len,in_pos;
+  unsigned char out[HRM_INPUT_CHUNK];// Decompressed chunk
+  size_t out_len,out_pos;
+  unsigned char in_eof;              // File read to the end
+  unsigned char end;                 // Decompressor finished
+  unsigned char error;               // Corrupt file
+#ifdef HRM_ZLIB
+  z_stream gz;
+#endif
+#ifdef HRM_LZMA
+  lzma_stream xz;
+#endif
+#ifdef HRM_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+} HRM_Input;
+
+// Parallel S19 parsing: records of one chunk of the file
+typedef struct HRM_Extent {
+  unsigned int addr,len;             // Where the record data goes
+  size_t data;                       // Offset of the data in HRM_S19Chunk.bytes
+} HRM_Extent;
+
+typedef struct HRM_S19Chunk {
+  const char *start,*end;            // Whole lines of the mapped file
+  HRM_Extent *ext;                   // S1 records in file order
+  unsigned int next,max_ext;
+  unsigned char *bytes;              // Decoded data of the records
+  size_t nbytes,max_bytes;
+  char version[HRM_VERSION_SIZE];    // Last S0 header of the chunk
+  unsigned char has_version;
+  unsigned char has_end;             // S9 record: the rest of the file is ignored
+  int error;                         // HRM_xxx_ERROR that stopped the chunk, 0 = none
+} HRM_S19Chunk;
+
+typedef struct HRM_S19Job {
+  HRM_S19Chunk *chunks;
+  unsigned int nchunks;
+  volatile unsigned int next;        // Next chunk to take
+} HRM_S19Job;
+
+// Image store: a variant is a list of block hashes (0 = empty block)
+typedef struct HRM_Manifest {
+  char name[HRM_VARIANT_NAME_SIZE];
+  char version[HRM_VERSION_SIZE];
+  unsigned long long block[MEM_BLOCKS];
+} HRM_Manifest;
+
+typedef struct HRM_StoreBlock {
+  unsigned long long hash;
+  unsigned char data[MEM_BLOCK_SIZE];
+} HRM_StoreBlock;
+
+typedef struct HRM_Store {
+  char path[MAX_FILENAME_SIZE+1];
+  HRM_Manifest *variants;            // All manifests of the store
+  unsigned int nvariants;
+  HRM_StoreBlock *blocks;            // All blocks, sorted by hash
+  unsigned int nblocks;
+} HRM_Store;
+
+// One entry of the wear log: erases of a block during one session
+typedef struct HRM_WearRecord {
+  char device[HRM_DEVICE_ID_SIZE];   // Device identity
+  unsigned int time;                 // Unix time of the session
+  unsigned short block;              // Block start address
+  unsigned short erases;             // Erases of the block in the session
+} HRM_WearRecord;
+
+// Transforms applied to each record while the image is loaded
+typedef struct HRM_LoadOptions {
+  long offset;                       // Added to every record address
+  unsigned char fill;                // Unused bytes of the image
+  unsigned int nwindows;             // 0 = the whole flash
+  unsigned short window[HRM_MAX_WINDOWS][2]; // Inclusive ranges that are loaded
+  unsigned char strict;              // Data outside the windows is an error
+} HRM_LoadOptions;
+
 // HRM Datatype ///////////////////////////////////////////////////////////////////////////////
 typedef struct HRM_Data {
 
   char *filename;                    // Filename of the S19-file
+  int format;                        // HRM_FORMAT_xxx of the file
+  unsigned int threads;              // Parser threads for large files (0 = all cores)
+  unsigned int conflicts;            // Bytes set twice with different data
+  unsigned int conflict_addr;        // ...the first of them
+  HRM_LoadOptions load;              // Relocation, windows and fill
+  unsigned char window[MEM_SIZE];    // 1 = byte is inside a load window
+  unsigned int outside;              // Bytes dropped: outside the flash or the windows
+  unsigned int outside_addr;         // ...the first of them (address in the file)
+  char version[HRM_VERSION_SIZE];    // Image version (S0 header)
 
   unsigned int icp_flag_calculated;  // ICP-Flag based on the data
   unsigned int icp_flag;             // ICP-Flag from file
+  unsigned char flag_stale;          // HRM_ICP_MatchFlash(): all but the ICP flag match
 
   usb_dev_handle *usb_dev;            // USB Handle
+  char *usb_path;                     // "bus/device" of the board to open (NULL = first)
+  unsigned char icp_version;          // Extended ICP protocol version (0 = stock AN2398)
+  unsigned char icp_caps;             // ICP_CAP_xxx flags of the resident firmware
+  unsigned char icp_burst_rows;       // Rows per ICP_REQ_PROGRAM_BURST (0 = no bursts)
+  HRM_Profile *profile;               // Profile of the connected device
+
+  unsigned int status_interval;       // >0: check status only every n rows (deferred mode)
+  unsigned int verify_distance;       // >0: verify row N-n while row N is programmed
+  unsigned char force;                // Reflash even if the device holds the image
+  unsigned char no_burst;             // Program row by row even if the firmware can do bursts
+  unsigned char rt_mode;              // Real-time station mode
+  char *rt_cpus;                      // CPUs to pin to in real-time mode (NULL = all)
+  unsigned char timer_stats;          // Print the timer overshoot at the end
+
+  unsigned char no_smoke;             // Don't run the image on the simulator first
+  unsigned long smoke_cycles;         // Cycle budget of the smoke test (0 = default)
+  long smoke_marker;                  // The smoke test must reach this address (-1 = none)
+  unsigned int reset_vector;          // Address of the user reset vector (0 = default)
+
+  double row_wait;                    // First status poll after a row program (ms)
+  double erase_wait;                  // First status poll after a block erase (ms)
+  double mass_erase_wait;             // First status poll after a mass erase (ms)
+  unsigned char calibrated;           // Bit per HRM_OP_xxx loaded from the calibration file
+  char *calibration_file;             // NULL = $HOME/HRM_CALIBRATION_FILE
+  unsigned int calibrate;             // >0: measure this many rounds and save
+
+  char device_id[HRM_DEVICE_ID_SIZE]; // Identity of the device (serial number or --device-id)
+  char *wear_db;                      // NULL = $HOME/HRM_WEAR_FILE
+  unsigned int erase_count[MEM_BLOCKS]; // Erases not yet written to the wear log
+
+  char *store_dir;                    // NULL = $HOME/HRM_STORE_DIR
+  char *variant;                      // Take the image from the store instead of a file
+  char *store_add;                    // Add the image to the store as this variant, then exit
+  unsigned char store_list;           // List the variants of the store, then exit
+  unsigned char diff;                 // Compare two images, then exit
+  HRM_Store store;                    // Preloaded image store
+
+  unsigned char delta;                // Plan every block from a readback, not just worn ones
+  char *from_variant_name;            // Device is known to hold this variant of the store
+  HRM_Manifest *from_variant;         // ...and its manifest (plan by block hashes)
+  char *wear_report;                  // Wear report for this device ("" = all), then exit
+  unsigned char plan_valid;           // erase_block[] and program_row[] are set
+  unsigned char erase_block[MEM_BLOCKS]; // Plan: erase this block
+  unsigned char program_row[MEM_ROWS];   // Plan: program this row
+  unsigned char repair_block[MEM_BLOCKS]; // Needs an erase, repaired when all rows are programmed
 
   unsigned char mem[MEM_SIZE];        // Data to program to device
 
+  char *status_file;                  // Publish on the status board in this file (NULL = don't)
+  char *status_name;                  // Name on the board (default: --usb path or pid)
+  char *status_view;                  // Show the status board of this file, then exit
+  unsigned char gang;                 // Program every board that shows up
+  unsigned int gang_limit;            // ...and stop after this many (0 = never)
+  unsigned int workers;               // Worker threads of the gang (0 = default)
+  char *slots;                        // Port paths of the fixture's slots, "1-1.1,1-1.2" (NULL = all)
+  unsigned int per_hub,per_bus;       // Tasks in flight per hub and host controller (0 = any)
+  unsigned int power_cycle;           // >0: switch the board's hub port off this many ms
+                                      //     after the ICP flag clear, instead of a replug
+  unsigned int power_settle;          // ...once the board has detached, or after this many ms
+  unsigned int app_check;             // >0: reset after flashing and wait this many s for
+                                      //     the application to answer in HID mode
+  HRM_StatusBoard *status_board;
+  HRM_StatusSlot *status;             // Own slot on the board (NULL = not publishing)
+
   unsigned char verbose_mode;      // If >0, functions prints info
+  void (*progress)(void *ctx, unsigned int done, unsigned int total); // Called per programmed row
+  void *progress_ctx;
+  unsigned int progress_done,progress_total;
   unsigned char last_errorcode;   // If error occured, errorcode is saved here
 
 } HRM_Data;
 
 
-/////////////////////////////////////////////////////////////////////////////////////
-// HRM_CheckError                                                                  //
-// ==============                                                                  //
-// - Check, if last function caused an error, prints info and exits                //
-/////////////////////////////////////////////////////////////////////////////////////
-void HRM_CheckError(HRM_Data *hrm)
+// Status board ///////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StatusMap                                                                  //
+// =============                                                                  //
+// - Maps the status board file shared, creating it if needed (NULL = default).   //
+//   Returns NULL, if it can't be mapped or was made by an incompatible version   //
+////////////////////////////////////////////////////////////////////////////////////
+#ifndef __MINGW32__
+HRM_StatusBoard *HRM_StatusMap(char *file)
 {
-  if(hrm->last_errorcode > 0) {
-    fprintf(stderr,"ERROR: %s\n",HRM_Errors[hrm->last_errorcode]);
-    exit(hrm->last_errorcode);
+  HRM_StatusBoard *b;
+  struct stat st;
+  int fd;
+
+  if((fd=open(file ? file : HRM_STATUS_FILE,O_RDWR | O_CREAT,0666)) < 0) {
+    return(NULL);
+  }
+  // Any process may be the first one, growing an empty file twice is harmless
+  if(fstat(fd,&st) < 0 || (st.st_size < (off_t)sizeof(HRM_StatusBoard)
+                           && ftruncate(fd,sizeof(HRM_StatusBoard)) < 0)) {
+    close(fd);
+    return(NULL);
+  }
+  b=mmap(NULL,sizeof(HRM_StatusBoard),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(b == MAP_FAILED) {
+    return(NULL);
+  }
+
+  // New board: every process writes the same header, the magic last
+  if(b->magic == 0) {
+    b->version=HRM_STATUS_VERSION;
+    b->slots=HRM_STATUS_SLOTS;
+    b->slot_size=sizeof(HRM_StatusSlot);
+    __sync_synchronize();
+    b->magic=HRM_STATUS_MAGIC;
+  }
+  __sync_synchronize();
+  if(b->magic != HRM_STATUS_MAGIC || b->version != HRM_STATUS_VERSION
+     || b->slots != HRM_STATUS_SLOTS || b->slot_size != sizeof(HRM_StatusSlot)) {
+    munmap(b,sizeof(HRM_StatusBoard));
+    return(NULL);
   }
+  return(b);
 }
 
-/////////////////////////////////////////////////////////////////////////////////////
-// HRM_OpenUSB                                                                     //
-// ===========                                                                     //
-// - Opens USB connection (LibUSB)                                                 //
-/////////////////////////////////////////////////////////////////////////////////////
-usb_dev_handle *HRM_OpenUSB(unsigned int vid, unsigned int pid)
+// Owner of a slot still running?
+int HRM_StatusAlive(int pid)
 {
-  struct usb_bus *bus;
-  struct usb_device *dev;
-
-  // LibUSB functions
-  usb_init(); /* initialize the library */
-  usb_find_busses(); /* find all busses */
-  usb_find_devices(); /* find all connected devices */
-
+  return(pid > 0 && (kill(pid,0) == 0 || errno == EPERM));
+}
+#else
+HRM_StatusBoard *HRM_StatusMap(char *file)
+{
+  return(NULL);
+}
 
-  //LibUSB functions
-  for(bus = usb_get_busses(); bus; bus = bus->next) 
-    {
-      for(dev = bus->devices; dev; dev = dev->next) 
-        {
-          if(dev->descriptor.idVendor == vid
-             && dev->descriptor.idProduct == pid)
-            {
-              return usb_open(dev);
-            }
-        }
-    }
-  return NULL;
+int HRM_StatusAlive(int pid)
+{
+  return(1);
 }
+#endif
 
-////////////////////////////////////////////////////////////////////////////////////
-// HRM_CloseUSB                                                                   //
-// ================                                                               //
-// - Closes the USB Connection (LibUSB) (name mapping only!)                      //
-////////////////////////////////////////////////////////////////////////////////////
-#define HRM_CloseUSB usb_close
+// Seqlock write of the own slot
+static void HRM_StatusBegin(HRM_StatusSlot *s)
+{
+  s->seq++;
+  __sync_synchronize();
+}
 
+static void HRM_StatusEnd(HRM_StatusSlot *s)
+{
+  __sync_synchronize();
+  s->seq++;
+}
 
 ////////////////////////////////////////////////////////////////////////////////////
-// HRM_ICP_InitUSB                                                                //
-// ===============                                                                //
-// - Initializes and opens the USB connection for ICP                             //
+// HRM_StatusOpen                                                                 //
+// ==============                                                                 //
+// - Takes a slot on the status board: the one of an earlier run with the same    //
+//   name, so a station keeps its line, else an unused one, else the one left     //
+//   longest ago by an exited process. A slot of this process with the same name  //
+//   (a gang board finished before) is taken over as well                         //
 ////////////////////////////////////////////////////////////////////////////////////
-int HRM_ICP_InitUSB(HRM_Data *hrm)
+int HRM_StatusOpen(HRM_Data *hrm, char *name, char *image)
 {
-  // LibUSB functions
-  usb_init(); /* initialize the library */
-  usb_find_busses(); /* find all busses */
-  usb_find_devices(); /* find all connected devices */
+  HRM_StatusBoard *b;
+  HRM_StatusSlot *s;
+  int i,pid,rank,best,best_rank,self=getpid();
+  double now;
 
-  // Reset Errors
-  hrm->last_errorcode=0;
+  if((b=HRM_StatusMap(hrm->status_file)) == NULL) {
+    return(HRM_ERROR);
+  }
 
-  if(!(hrm->usb_dev = HRM_OpenUSB(ICP_VID,ICP_PID)))
-    {
-      // Device Not Found!
-      hrm->last_errorcode=HRM_USB_OPEN_ERROR;
-      return(HRM_ERROR);
+  do {
+    best=-1;
+    best_rank=3;
+    for(i=0;i<HRM_STATUS_SLOTS;i++) {
+      s=&b->slot[i];
+      pid=s->pid;
+      rank = strncmp(s->name,name,HRM_STATUS_NAME_SIZE) == 0 ? 0 : pid == 0 ? 1 : 2;
+      if(pid && HRM_StatusAlive(pid) && !(pid == self && rank == 0)) {
+        continue;
+      }
+      if(rank < best_rank || (rank == best_rank && s->updated < b->slot[best].updated)) {
+        best=i;
+        best_rank=rank;
+      }
     }
-
-  if(usb_set_configuration(hrm->usb_dev, 1) < 0)
-    {
-      // Setting configuration failed!
-      hrm->last_errorcode=HRM_USB_CONFIG_ERROR;
-      usb_close(hrm->usb_dev);
+    if(best < 0) {
+      munmap(b,sizeof(HRM_StatusBoard));
       return(HRM_ERROR);
     }
+    s=&b->slot[best];
+    pid=s->pid;
+    // Another process may have taken it meanwhile
+  } while((HRM_StatusAlive(pid) && !(pid == self && best_rank == 0))
+          || !__sync_bool_compare_and_swap(&s->pid,pid,self));
+
+  // The last owner may have died in the middle of an update
+  if(s->seq & 1) {
+    s->seq++;
+  }
+
+  now=HRM_GetTimeMs();
+  HRM_StatusBegin(s);
+  memset(s->name,0,sizeof(s->name));
+  memset(s->image,0,sizeof(s->image));
+  strncpy(s->name,name,HRM_STATUS_NAME_SIZE-1);
+  strncpy(s->image,image,HRM_STATUS_NAME_SIZE-1);
+  s->phase=HRM_PHASE_IDLE;
+  s->result=0;
+  s->addr=0;
+  s->rows_done=s->rows_total=0;
+  s->retries=0;
+  s->started=s->changed=s->updated=now;
+  memset(s->phase_ms,0,sizeof(s->phase_ms));
+  HRM_StatusEnd(s);
+
+  hrm->status_board=b;
+  hrm->status=s;
   return(HRM_OK);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
-// HRM_ICP_CloseUSB                                                               //
-// ================                                                               //
-// - Closes the USB connection for ICP                                            //
+// HRM_StatusPhase                                                                //
+// ===============                                                                //
+// - Publishes the next phase of the run (and the error code of a finished one)   //
 ////////////////////////////////////////////////////////////////////////////////////
-void HRM_ICP_CloseUSB(HRM_Data *hrm)
+void HRM_StatusPhase(HRM_Data *hrm, int phase)
 {
-  //LibUSB function
-  usb_close(hrm->usb_dev);
+  HRM_StatusSlot *s=hrm->status;
+  double now;
+
+  if(s == NULL) {
+    return;
+  }
+  now=HRM_GetTimeMs();
+  HRM_StatusBegin(s);
+  s->phase_ms[s->phase]+=now-s->changed;
+  s->phase=phase;
+  s->result=hrm->last_errorcode;
+  s->changed=s->updated=now;
+  HRM_StatusEnd(s);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
-// HRM_ICP_ReadS19                                                                //
-// ===============                                                                //
-// - Read and Parse S19-file to HRM_Data struct                                   //
+// HRM_StatusUpdate                                                               //
+// ================                                                               //
+// - Publishes the address being worked on (0 = unchanged), adds retries and      //
+//   copies the row progress                                                      //
 ////////////////////////////////////////////////////////////////////////////////////
-int HRM_ICP_ReadS19(HRM_Data *hrm)
+void HRM_StatusUpdate(HRM_Data *hrm, unsigned int addr, unsigned int retries)
 {
-  unsigned char crc,calc_crc,calc_datalen,sdata;
-  int i,readlen,address,datalen;
-  char line[MAX_LINE_LEN],address_str[5],datalen_str[3],sdata_str[3];
-  FILE *fp;
+  HRM_StatusSlot *s=hrm->status;
 
-  // Reset Errors
-  hrm->last_errorcode=0;
+  if(s == NULL) {
+    return;
+  }
+  HRM_StatusBegin(s);
+  if(addr) {
+    s->addr=addr;
+  }
+  s->retries+=retries;
+  s->rows_done=hrm->progress_done;
+  s->rows_total=hrm->progress_total;
+  s->updated=HRM_GetTimeMs();
+  HRM_StatusEnd(s);
+}
 
-  // Init strings
-  address_str[4]=0;
-  sdata_str[2]=0;
-  datalen_str[2]=0;
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StatusRead                                                                 //
+// ==============                                                                 //
+// - Consistent copy of a slot of another process, without locking it. Returns    //
+//   HRM_ERROR, if the copy may be torn (its owner died during an update)         //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StatusRead(HRM_StatusSlot *s, HRM_StatusSlot *copy)
+{
+  unsigned int seq,i;
 
-  // Init memory to 0xFF (=default empty flash)
-  for(i=0;i<MEM_SIZE;i++)
-    hrm->mem[i]=0xff;
+  for(i=0;i<HRM_STATUS_READ_TRIES;i++) {
+    seq=s->seq;
+    __sync_synchronize();
+    memcpy(copy,(void *)s,sizeof(HRM_StatusSlot));
+    __sync_synchronize();
+    if(!(seq & 1) && s->seq == seq) {
+      return(HRM_OK);
+    }
+  }
+  return(HRM_ERROR);
+}
 
-  // Open file
-  if( (fp = fopen(hrm->filename,"r")) == NULL) {
-    //File not found!");
-    hrm->last_errorcode=HRM_FILE_OPEN_ERROR;
-    return(HRM_ERROR);
+/////////////////////////////////////////////////////////////////////////////////////
+// HRM_CheckError                                                                  //
+// ==============                                                                  //
+// - Check, if last function caused an error, prints info and exits                //
+/////////////////////////////////////////////////////////////////////////////////////
+void HRM_CheckError(HRM_Data *hrm)
+{
+  if(hrm->last_errorcode > 0) {
+    fprintf(stderr,"ERROR: %s\n",HRM_Errors[hrm->last_errorcode]);
+    HRM_StatusPhase(hrm,HRM_PHASE_FAILED);
+    exit(hrm->last_errorcode);
   }
+}
 
-  // Read line by line and do the parsing...
-  while(!feof(fp)) {
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_USBEach                                                                    //
+// ===========                                                                    //
+// - Enumerates the USB devices (LibUSB) and calls match for each of them, with   //
+//   the bus list locked, until it returns nonzero. Returns that value, 0 if no   //
+//   device matched                                                               //
+////////////////////////////////////////////////////////////////////////////////////
+typedef int (*HRM_USBMatch)(struct usb_bus *bus, struct usb_device *dev, void *arg);
 
-    if(fgets(line,MAX_LINE_LEN,fp) == NULL) {
-      //printf("Nothing to read!");
-      break;
+int HRM_USBEach(HRM_USBMatch match, void *arg)
+{
+  struct usb_bus *bus;
+  struct usb_device *dev;
+  int result=0;
+
+  HRM_USB_LOCK();
+
+  // LibUSB functions
+  usb_init(); /* initialize the library */
+  usb_find_busses(); /* find all busses */
+  usb_find_devices(); /* find all connected devices */
+
+  for(bus = usb_get_busses(); bus && !result; bus = bus->next) {
+    for(dev = bus->devices; dev && !result; dev = dev->next) {
+      result=match(bus,dev,arg);
     }
+  }
+
+  HRM_USB_UNLOCK();
+  return(result);
+}
 
-    //Search S1-entry.. and parse when found.
-    if(line[0]=='S' && line[1]=='1') {
+// Device vid:pid, as "bus/device" path (NULL = any)
+typedef struct HRM_USBId {
+  unsigned int vid,pid;
+  char *path;
+  usb_dev_handle *handle;            // HRM_OpenUSB(): the device opened
+  char *port;                        // HRM_USBPort(): its port path
+  int len;
+} HRM_USBId;
 
-      calc_crc=0;
+static int HRM_USBIsId(struct usb_bus *bus, struct usb_device *dev, HRM_USBId *id)
+{
+  size_t n=strlen(bus->dirname);
 
-      // Datalen
-      readlen=strlen(line);
-      calc_datalen=(readlen-5)/2;
-      strncpy(datalen_str,line+2,2);
-      datalen= strtoul(datalen_str,NULL,16);
+  return(dev->descriptor.idVendor == id->vid && dev->descriptor.idProduct == id->pid
+         && (id->path == NULL || (strncmp(id->path,bus->dirname,n) == 0 && id->path[n] == '/'
+                                  && strcmp(id->path+n+1,dev->filename) == 0)));
+}
 
-      // Address
-      strncpy(address_str,line+4,4);
-      address= strtoul(address_str,NULL,16);
+static int HRM_OpenMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_USBId *id=arg;
 
-      // Check address range
-      if((address < MEM_OFFSET) || (address >= MEM_OFFSET+MEM_SIZE )) {
-	continue;
-      }
+  if(HRM_USBIsId(bus,dev,id)) {
+    id->handle=usb_open(dev);
+  }
+  return(id->handle != NULL);
+}
 
-      // Data
-      for(i=0;i<datalen-3;i++) {
-	// Get data byte
-	strncpy(sdata_str,line+8+2*i,2);
-	sdata=strtoul(sdata_str,NULL,16);
-	// Put to memmap
-	hrm->mem[address-MEM_OFFSET+i]=sdata;
-	// incr crc
-	calc_crc+=sdata;
-      }
+/////////////////////////////////////////////////////////////////////////////////////
+// HRM_OpenUSB                                                                     //
+// ===========                                                                     //
+// - Opens USB connection (LibUSB)                                                 //
+// - path "bus/device" (as in lsusb) picks one of several boards, NULL = first     //
+/////////////////////////////////////////////////////////////////////////////////////
+usb_dev_handle *HRM_OpenUSB(unsigned int vid, unsigned int pid, char *path)
+{
+  HRM_USBId id;
 
-      // CRC
-      strncpy(sdata_str,line+8+2*i,2);
-      crc=strtoul(sdata_str,NULL,16);
-      calc_crc=0xff-(calc_crc + datalen + (address>>8) + (address & 0xff));
+  memset(&id,0,sizeof(id));
+  id.vid=vid;
+  id.pid=pid;
+  id.path=path;
+  HRM_USBEach(HRM_OpenMatch,&id);
+  return id.handle;
+}
 
-    } else if(line[0]=='S' && line[1]=='9') {
-      // EndOfRecord
-      readlen=strlen(line);
-      break;
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_PortPath                                                                   //
+// ============                                                                   //
+// - Port path of a device as in sysfs: "1-1.3.2" is port 2 of the hub on port 3  //
+//   of the hub on root port 1 of bus 1. libusb-0.1 doesn't know it, so it is     //
+//   looked up by bus and device number (Linux only)                              //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_PortPath(struct usb_bus *bus, struct usb_device *dev, char *path, int len)
+{
+#if defined(HRM_SIM)
+  return(hrm_sim_port_path(dev,path,len) == 0 ? HRM_OK : HRM_ERROR);
+#elif !defined(__MINGW32__)
+  char file[MAX_FILENAME_SIZE+1];
+  struct dirent *e;
+  unsigned int busnum,devnum;
+  int found=0;
+  FILE *fp;
+  DIR *d;
 
+  if((d=opendir(HRM_SYSFS_USB)) == NULL) {
+    return(HRM_ERROR);
+  }
+  while(!found && (e=readdir(d))) {
+    // Devices only, no interfaces ("1-1:1.0"). Root hubs are "usb1"
+    if(e->d_name[0] == '.' || strchr(e->d_name,':')) {
+      continue;
+    }
+    snprintf(file,sizeof(file),"%s/%s/busnum",HRM_SYSFS_USB,e->d_name);
+    if((fp=fopen(file,"r")) == NULL) {
+      continue;
+    }
+    found = fscanf(fp,"%u",&busnum) == 1 && busnum == strtoul(bus->dirname,NULL,10);
+    fclose(fp);
+    snprintf(file,sizeof(file),"%s/%s/devnum",HRM_SYSFS_USB,e->d_name);
+    if(found && (fp=fopen(file,"r"))) {
+      found = fscanf(fp,"%u",&devnum) == 1 && devnum == strtoul(dev->filename,NULL,10);
+      fclose(fp);
     } else {
-      // Not Supported
+      found=0;
+    }
+    if(found) {
+      snprintf(path,len,"%s",e->d_name);
     }
   }
+  closedir(d);
+  return(found ? HRM_OK : HRM_ERROR);
+#else
+  return(HRM_ERROR);
+#endif
+}
 
-  //ICP Flag (Checksum)
-  hrm->icp_flag_calculated=0;
-  for(i=ICP_CHECKSUM_START;i<=ICP_CHECKSUM_STOP;i++) {
-    hrm->icp_flag_calculated+=hrm->mem[i-MEM_OFFSET];
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_CloseUSB                                                                   //
+// ================                                                               //
+// - Closes the USB Connection (LibUSB) (name mapping only!)                      //
+////////////////////////////////////////////////////////////////////////////////////
+#define HRM_CloseUSB usb_close
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_USBPort                                                                    //
+// ===========                                                                    //
+// - Port path of the device that HRM_OpenUSB() would open                        //
+////////////////////////////////////////////////////////////////////////////////////
+static int HRM_PortMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_USBId *id=arg;
+
+  return(HRM_USBIsId(bus,dev,id) && HRM_PortPath(bus,dev,id->port,id->len) == HRM_OK);
+}
+
+int HRM_USBPort(unsigned int vid, unsigned int pid, char *path, char *port, int len)
+{
+  HRM_USBId id;
+
+  memset(&id,0,sizeof(id));
+  id.vid=vid;
+  id.pid=pid;
+  id.path=path;
+  id.port=port;
+  id.len=len;
+  return(HRM_USBEach(HRM_PortMatch,&id) ? HRM_OK : HRM_ERROR);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_USBDetach                                                                  //
+// =============                                                                  //
+// - Waits until no device vid:pid is on the port any more, at most ms. After     //
+//   the flag clear, the user code writes the flag and resets: switching the      //
+//   port off before that would cut the flash write short                        //
+////////////////////////////////////////////////////////////////////////////////////
+static int HRM_OnPortMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_USBId *id=arg;
+  char path[HRM_GANG_PATH_SIZE];
+
+  return(HRM_USBIsId(bus,dev,id)
+         && HRM_PortPath(bus,dev,path,sizeof(path)) == HRM_OK && strcmp(path,id->port) == 0);
+}
+
+int HRM_USBDetach(unsigned int vid, unsigned int pid, char *port, unsigned int ms)
+{
+  HRM_USBId id;
+  double deadline=HRM_GetTimeMs()+ms;
+
+  memset(&id,0,sizeof(id));
+  id.vid=vid;
+  id.pid=pid;
+  id.port=port;
+  for(;;) {
+    if(!HRM_USBEach(HRM_OnPortMatch,&id)) {
+      return(HRM_OK);
+    }
+    if(HRM_GetTimeMs() >= deadline) {
+      return(HRM_ERROR);
+    }
+    HRM_WaitUntil(HRM_MIN(HRM_GetTimeMs()+10,deadline));
   }
+}
 
-  hrm->icp_flag_calculated=0xffff-(0xffff & hrm->icp_flag_calculated)+1;
-  hrm->icp_flag=(hrm->mem[ICP_FLAG_ADDRESS-MEM_OFFSET]<<8) + hrm->mem[ICP_FLAG_ADDRESS-MEM_OFFSET+1];
-  
-  return(HRM_OK);
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_OpenUSBPort                                                                //
+// ===============                                                                //
+// - Opens the device vid:pid on a port path (a board that changed its identity   //
+//   keeps its port)                                                              //
+////////////////////////////////////////////////////////////////////////////////////
+static int HRM_OpenPortMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_USBId *id=arg;
+
+  if(HRM_OnPortMatch(bus,dev,arg)) {
+    id->handle=usb_open(dev);
+  }
+  return(id->handle != NULL);
+}
+
+usb_dev_handle *HRM_OpenUSBPort(unsigned int vid, unsigned int pid, char *port)
+{
+  HRM_USBId id;
+
+  memset(&id,0,sizeof(id));
+  id.vid=vid;
+  id.pid=pid;
+  id.port=port;
+  HRM_USBEach(HRM_OpenPortMatch,&id);
+  return(id.handle);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
-// HRM_ICP_EraseFlashBlock                                                        //
-// =======================                                                        //
-// - Erase one block of Flash memory (size of 512)                                //
+// HRM_SlotMatch                                                                  //
+// =============                                                                  //
+// - 1, if the port path is one of the slots "1-1.1,1-1.2" (or there are none)    //
 ////////////////////////////////////////////////////////////////////////////////////
-int HRM_ICP_EraseFlashBlock(HRM_Data *hrm, unsigned int block_start_addr)
+int HRM_SlotMatch(char *slots, char *port)
 {
-  unsigned char status,result;
+  size_t n=strlen(port);
+  char *p;
 
-  // Reset Errors
-  hrm->last_errorcode=0;
+  if(slots == NULL) {
+    return(1);
+  }
+  for(p=slots; p; p = (p=strchr(p,',')) ? p+1 : NULL) {
+    if(n && strncmp(p,port,n) == 0 && (p[n] == ',' || p[n] == 0)) {
+      return(1);
+    }
+  }
+  return(0);
+}
 
-  // Validity check
-  if(hrm->usb_dev == NULL) {
-    hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_OpenHub                                                                    //
+// ===========                                                                    //
+// - Opens the hub a port path is plugged into: "1-1.3" is port 3 of hub "1-1",   //
+//   "1-2" is port 2 of the root hub "usb1". Its name goes to hub               //
+////////////////////////////////////////////////////////////////////////////////////
+static int HRM_HubMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_USBId *id=arg;
+  char path[HRM_GANG_PATH_SIZE];
+
+  if(dev->descriptor.bDeviceClass == HUB_CLASS
+     && HRM_PortPath(bus,dev,path,sizeof(path)) == HRM_OK && strcmp(path,id->port) == 0) {
+    id->handle=usb_open(dev);
+  }
+  return(id->handle != NULL);
+}
+
+usb_dev_handle *HRM_OpenHub(char *port, char *hub, int len, unsigned int *hub_port)
+{
+  HRM_USBId id;
+  char *dot;
+
+  if((dot=strrchr(port,'.'))) {
+    snprintf(hub,len,"%.*s",(int)(dot-port),port);
+  } else if((dot=strchr(port,'-'))) {
+    snprintf(hub,len,"usb%.*s",(int)(dot-port),port);
+  } else {
+    return(NULL);
+  }
+  *hub_port=strtoul(dot+1,NULL,10);
+
+  memset(&id,0,sizeof(id));
+  id.port=hub;
+  HRM_USBEach(HRM_HubMatch,&id);
+  return(id.handle);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_PowerCycle                                                                 //
+// ==============                                                                 //
+// - Switches the power of a board's hub port off and on again, so it restarts   //
+//   in ICP mode after the flag clear. Needs a hub with per-port power switching  //
+//   (ganged hubs would reset every board on them). The hub must be writable      //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_PowerCycle(HRM_Data *hrm, char *port)
+{
+  usb_dev_handle *dev;
+  unsigned char desc[HUB_DESCRIPTOR_SIZE],status[4];
+  char hub[HRM_GANG_PATH_SIZE];
+  unsigned int hub_port;
+  double t;
+
+  if((dev=HRM_OpenHub(port,hub,sizeof(hub),&hub_port)) == NULL) {
+    HRM_printf(hrm->verbose_mode,"Power cycle: can't open the hub of port %s\n",port);
     return(HRM_ERROR);
   }
 
-  // ERASE BLOCK
+  if(usb_control_msg(dev,0xA0,HUB_REQ_GET_DESCRIPTOR,HUB_DESCRIPTOR << 8,0,
+                     (char *)desc,sizeof(desc),1000) < 7
+     || (desc[3] & HUB_POWER_SWITCHING) != HUB_POWER_PER_PORT) {
+    HRM_printf(hrm->verbose_mode,"Power cycle: hub %s can't switch the power of single ports\n",hub);
+    HRM_CloseUSB(dev);
+    return(HRM_ERROR);
+  }
+
+  // Off, and check that it really is: some hubs claim switching they don't do
+  t=HRM_GetTimeMs();
+  if(usb_control_msg(dev,0x23,HUB_REQ_CLEAR_FEATURE,HUB_PORT_POWER,hub_port,NULL,0,1000) < 0
+     || usb_control_msg(dev,0xA3,HUB_REQ_GET_STATUS,0,hub_port,(char *)status,4,1000) != 4
+     || ((status[0] | status[1] << 8) & HUB_STATUS_POWER)) {
+    HRM_printf(hrm->verbose_mode,"Power cycle: port %d of hub %s didn't switch off\n",hub_port,hub);
+    usb_control_msg(dev,0x23,HUB_REQ_SET_FEATURE,HUB_PORT_POWER,hub_port,NULL,0,1000);
+    HRM_CloseUSB(dev);
+    return(HRM_ERROR);
+  }
+  HRM_WaitUntil(t+hrm->power_cycle);
+
+  // On, and wait until the power is good (bPwrOn2PwrGood, in 2 ms)
+  if(usb_control_msg(dev,0x23,HUB_REQ_SET_FEATURE,HUB_PORT_POWER,hub_port,NULL,0,1000) < 0) {
+    HRM_printf(hrm->verbose_mode,"Power cycle: port %d of hub %s didn't switch on\n",hub_port,hub);
+    HRM_CloseUSB(dev);
+    return(HRM_ERROR);
+  }
+  HRM_WaitUntil(HRM_GetTimeMs()+2*desc[5]);
+  HRM_CloseUSB(dev);
+
+  HRM_printf(hrm->verbose_mode,"Power cycled port %d of hub %s (off %.0f ms)\n",
+             hub_port,hub,HRM_GetTimeMs()-t-2*desc[5]);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_USBWatch                                                                   //
+// ============                                                                   //
+// - Watches the device nodes for arriving devices (Linux: inotify on usbfs).     //
+//   Returns the descriptor for HRM_USBWait(), -1 if there is nothing to watch    //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_USBWatch(void)
+{
+#if defined(HRM_SIM) || defined(__MINGW32__)
+  return(-1);
+#else
+  char dir[MAX_FILENAME_SIZE+1];
+  struct dirent *e;
+  DIR *d;
+  int fd;
+
+  if((fd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    return(-1);
+  }
+  if(inotify_add_watch(fd,HRM_USBFS,IN_CREATE) < 0 || (d=opendir(HRM_USBFS)) == NULL) {
+    close(fd);
+    return(-1);
+  }
+
+  // One directory per bus; udev sets the permissions after the node is created
+  while((e=readdir(d))) {
+    if(e->d_name[0] != '.') {
+      snprintf(dir,sizeof(dir),"%s/%s",HRM_USBFS,e->d_name);
+      inotify_add_watch(fd,dir,IN_CREATE | IN_ATTRIB);
+    }
+  }
+  closedir(d);
+  return(fd);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_USBWait                                                                    //
+// ===========                                                                    //
+// - Waits until a device node appears or changes, at most ms. Without a watch    //
+//   it just sleeps                                                               //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_USBWait(int fd, double ms)
+{
+  if(ms <= 0) {
+    return;
+  }
+#if defined(HRM_SIM)
+  hrm_sim_wait_event(ms);
+#elif defined(__MINGW32__)
+  Sleep((DWORD)ms);
+#else
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char dir[MAX_FILENAME_SIZE+1];
+  struct inotify_event *ev;
+  struct pollfd p;
+  ssize_t n,i;
+
+  if(fd < 0) {
+    usleep((useconds_t)(ms*1000));
+    return;
+  }
+  p.fd=fd;
+  p.events=POLLIN;
+  if(poll(&p,1,(int)(ms+0.999)) <= 0) {
+    return;
+  }
+
+  // Drop the events, a new bus directory gets its own watch
+  while((n=read(fd,buf,sizeof(buf))) > 0) {
+    for(i=0; i<n; i+=sizeof(struct inotify_event)+ev->len) {
+      ev=(struct inotify_event *)(buf+i);
+      if((ev->mask & IN_ISDIR) && ev->len) {
+        snprintf(dir,sizeof(dir),"%s/%s",HRM_USBFS,ev->name);
+        inotify_add_watch(fd,dir,IN_CREATE | IN_ATTRIB);
+      }
+    }
+  }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_GetStatus                                                              //
+// =================                                                              //
+// - Reads the result of the last ICP command (0x8F). Returns the status byte,    //
+//   or HRM_ERROR if the transfer itself failed                                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_GetStatus(HRM_Data *hrm)
+{
+  unsigned char status=0;
+  int result;
+
   result = usb_control_msg(
 			   hrm->usb_dev,       // USB-Device
-			   0x40,
-			   0x82,
-			   block_start_addr,
-			   block_start_addr+MEM_BLOCK_SIZE-1,
-			   NULL,
-			   0x00,
+			   0xC0,
+			   ICP_REQ_STATUS,
+			   0x0000,
+			   0x0000,
+			   (char *)&status,
+			   0x01,
 			   10000);
-  
-  // GET RESULT
 
-  Sleep(5);
+  if(result != 1) {
+    return(HRM_ERROR);
+  }
+  return(status);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_PollStatus                                                             //
+// ==================                                                             //
+// - Waits first_wait ms, then polls the status every WAIT_STATUS ms as long as   //
+//   the firmware reports ICP_STATUS_BUSY, up to timeout ms in total              //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_PollStatus(HRM_Data *hrm, double first_wait, unsigned int timeout)
+{
+  double start,poll;
+  int status;
+
+  start=HRM_GetTimeMs();
+  HRM_WaitUntil(start+first_wait);
+
+  for(;;) {
+    poll=HRM_GetTimeMs();
+    status=HRM_ICP_GetStatus(hrm);
+    if(status != ICP_STATUS_BUSY || poll-start > timeout) {
+      return(status);
+    }
+    HRM_WaitUntil(poll+WAIT_STATUS);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ProbeCaps                                                              //
+// =================                                                              //
+// - Asks the resident firmware for its extended protocol version and             //
+//   capabilities. The stock AN2398 firmware does not know the request,           //
+//   so a failed transfer simply means "no extensions"                            //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_ICP_ProbeCaps(HRM_Data *hrm)
+{
+  unsigned char info[HRM_ICP_INFO_SIZE];
+  int result;
+
+  hrm->icp_version=0;
+  hrm->icp_caps=0;
+  hrm->icp_burst_rows=0;
+
   result = usb_control_msg(
 			   hrm->usb_dev,       // USB-Device
 			   0xC0,
-			   0x8F,
+			   ICP_REQ_GET_INFO,
 			   0x0000,
 			   0x0000,
-			   &status,
-			   0x01,
-			   10000);
-  Sleep(5);    
+			   (char *)info,
+			   HRM_ICP_INFO_SIZE,
+			   1000);
+
+  if(result >= 2) {
+    hrm->icp_version=info[0];
+    hrm->icp_caps=info[1];
+  }
+  if(result >= 3 && (hrm->icp_caps & ICP_CAP_BURST)) {
+    hrm->icp_burst_rows=HRM_MIN(info[2],HRM_BURST_MAX_ROWS);
+  }
+
+  // Clear a possible STALL left by the unknown request
+  usb_clear_halt(hrm->usb_dev,0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GetHostName                                                                //
+// ===============                                                                //
+// - Name of this host, the calibration is kept per host                          //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_GetHostName(char *name, int len)
+{
+#ifdef __MINGW32__
+  char *env=getenv("COMPUTERNAME");
+
+  strncpy(name, env ? env : "localhost", len-1);
+  name[len-1]=0;
+#else
+  if(gethostname(name,len-1) < 0) {
+    strcpy(name,"localhost");
+  }
+  name[len-1]=0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_UserFile                                                                   //
+// ============                                                                   //
+// - Path of a per-user file: the given one, or 'name' in the home directory      //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_UserFile(char *file, char *name, char *path, int len)
+{
+  char *home=getenv("HOME");
+
+  if(file) {
+    snprintf(path,len,"%s",file);
+    return;
+  }
+  if(home == NULL) {
+    home=getenv("USERPROFILE");
+  }
+  snprintf(path,len,"%s/%s",home ? home : ".",name);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_LoadCalibration                                                            //
+// ===================                                                            //
+// - Sets the default waits and replaces them with the learned timings of this    //
+//   device profile and host, if the calibration file has them.                   //
+//   File lines: <profile> <host> <operation> <count> <p50> <p90> <p99> <max>     //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_LoadCalibration(HRM_Data *hrm)
+{
+  char path[MAX_FILENAME_SIZE+1],line[MAX_LINE_LEN],host[64];
+  char l_profile[64],l_host[64],l_op[32];
+  HRM_Timing t;
+  double wait;
+  FILE *fp;
+  int op;
+
+  hrm->row_wait=WAIT_PROGRAMMING;
+  hrm->erase_wait=WAIT_ERASE;
+  hrm->mass_erase_wait=WAIT_MASS_ERASE;
+  hrm->calibrated=0;
+
+  HRM_UserFile(hrm->calibration_file,HRM_CALIBRATION_FILE,path,sizeof(path));
+  if(hrm->profile == NULL || (fp=fopen(path,"r")) == NULL) {
+    return;
+  }
+  HRM_GetHostName(host,sizeof(host));
+
+  while(fgets(line,sizeof(line),fp)) {
+    if(sscanf(line,"%63s %63s %31s %u %lf %lf %lf %lf",l_profile,l_host,l_op,
+              &t.count,&t.p50,&t.p90,&t.p99,&t.max) != 8
+       || strcmp(l_profile,hrm->profile->name) != 0 || strcmp(l_host,host) != 0) {
+      continue;
+    }
+    wait=t.p99*HRM_CALIBRATION_MARGIN+HRM_CALIBRATION_MARGIN_MS;
+    for(op=0;op<HRM_OP_COUNT;op++) {
+      if(strcmp(l_op,HRM_OpNames[op]) == 0) {
+        hrm->calibrated |= 1<<op;
+        if(op == HRM_OP_ROW) {
+          hrm->row_wait=wait;
+        } else if(op == HRM_OP_ERASE) {
+          hrm->erase_wait=wait;
+        } else {
+          hrm->mass_erase_wait=wait;
+        }
+      }
+    }
+  }
+  fclose(fp);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_FindProfile                                                                //
+// ===============                                                                //
+// - Returns the device profile for the ICP mode vid/pid (NULL if unknown)        //
+////////////////////////////////////////////////////////////////////////////////////
+HRM_Profile *HRM_FindProfile(unsigned int vid, unsigned int pid)
+{
+  HRM_Profile *p;
+
+  for(p=HRM_Profiles; p->name; p++) {
+    if(p->icp_vid == vid && p->icp_pid == pid) {
+      return(p);
+    }
+  }
+  return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_InitUSB                                                                //
+// ===============                                                                //
+// - Initializes and opens the USB connection for ICP                             //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_InitUSB(HRM_Data *hrm)
+{
+  struct usb_device *dev;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  if(!(hrm->usb_dev = HRM_OpenUSB(ICP_VID,ICP_PID,hrm->usb_path)))
+    {
+      // Device Not Found!
+      hrm->last_errorcode=HRM_USB_OPEN_ERROR;
+      return(HRM_ERROR);
+    }
+
+  if(usb_set_configuration(hrm->usb_dev, 1) < 0)
+    {
+      // Setting configuration failed!
+      hrm->last_errorcode=HRM_USB_CONFIG_ERROR;
+      usb_close(hrm->usb_dev);
+      return(HRM_ERROR);
+    }
+
+  HRM_ICP_ProbeCaps(hrm);
+  hrm->profile=HRM_FindProfile(ICP_VID,ICP_PID);
+
+  // Identity for the wear log: --device-id, else the USB serial number
+  if(hrm->device_id[0] == 0) {
+    dev=usb_device(hrm->usb_dev);
+    if(dev->descriptor.iSerialNumber == 0
+       || usb_get_string_simple(hrm->usb_dev,dev->descriptor.iSerialNumber,
+                                hrm->device_id,HRM_DEVICE_ID_SIZE) <= 0) {
+      strcpy(hrm->device_id,"unknown");
+    }
+  }
+  HRM_LoadCalibration(hrm);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_CloseUSB                                                               //
+// ================                                                               //
+// - Closes the USB connection for ICP                                            //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_ICP_CloseUSB(HRM_Data *hrm)
+{
+  //LibUSB function
+  usb_close(hrm->usb_dev);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_Hash                                                                       //
+// ========                                                                       //
+// - 64-bit FNV-1a hash, used as an image fingerprint                             //
+////////////////////////////////////////////////////////////////////////////////////
+unsigned long long HRM_Hash(const unsigned char *data, unsigned int len, unsigned long long hash)
+{
+  unsigned int i;
+
+  for(i=0;i<len;i++) {
+    hash^=data[i];
+    hash*=0x100000001B3ULL;
+  }
+  return(hash);
+}
+
+#define HRM_HASH_INIT 0xCBF29CE484222325ULL
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_CalcFlag                                                               //
+// ================                                                               //
+// - ICP Flag (checksum) of the image, and the one the image has                  //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_ICP_CalcFlag(HRM_Data *hrm)
+{
+  int i;
+
+  //ICP Flag (Checksum)
+  hrm->icp_flag_calculated=0;
+  for(i=ICP_CHECKSUM_START;i<=ICP_CHECKSUM_STOP;i++) {
+    hrm->icp_flag_calculated+=hrm->mem[i-MEM_OFFSET];
+  }
+
+  hrm->icp_flag_calculated=0xffff-(0xffff & hrm->icp_flag_calculated)+1;
+  hrm->icp_flag=(hrm->mem[ICP_FLAG_ADDRESS-MEM_OFFSET]<<8) + hrm->mem[ICP_FLAG_ADDRESS-MEM_OFFSET+1];
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_InputRead                                                                  //
+// =============                                                                  //
+// - Whatever the file has for us now, up to len bytes: a pipe returns as soon    //
+//   as some data is there. Returns the length, 0 at the end and -1 on error.     //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_InputRead(HRM_Input *in, unsigned char *buf, unsigned int len)
+{
+  int n;
+
+  do {
+    n=read(in->fd,buf,len);
+  } while(n < 0 && errno == EINTR);
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_InputClose                                                                 //
+// ==============                                                                 //
+// - Closes the file and frees the decompressor                                   //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_InputClose(HRM_Input *in)
+{
+#ifdef HRM_ZLIB
+  if(in->format == HRM_FORMAT_GZIP) {
+    inflateEnd(&in->gz);
+  }
+#endif
+#ifdef HRM_LZMA
+  if(in->format == HRM_FORMAT_XZ) {
+    lzma_end(&in->xz);
+  }
+#endif
+#ifdef HRM_ZSTD
+  if(in->format == HRM_FORMAT_ZSTD) {
+    ZSTD_freeDStream(in->zstd);
+  }
+#endif
+  if(in->own && in->fd >= 0) {
+    close(in->fd);
+  }
+  in->fd=-1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_InputOpen                                                                  //
+// =============                                                                  //
+// - Opens an image file for line reading. The format is detected by the magic   //
+//   bytes: compressed files are decompressed in chunks while they are read.     //
+// - "-" is stdin and "/dev/fd/N" is the open descriptor N. Nothing is seeked,   //
+//   so pipes and sockets work.                                                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_InputOpen(HRM_Input *in, char *filename)
+{
+  unsigned char magic[6];
+  char *end;
+  size_t n;
+  int r;
+
+  memset(in,0,sizeof(*in));
+  if(strcmp(filename,"-") == 0) {
+    in->fd=0;
+  } else if(strncmp(filename,"/dev/fd/",8) == 0 && filename[8]) {
+    in->fd=strtol(filename+8,&end,10);
+    if(*end) {
+      in->fd=-1;
+    }
+  } else {
+    in->fd=open(filename,HRM_OPEN_FLAGS);
+    in->own=1;
+  }
+  if(in->fd < 0) {
+    return(HRM_ERROR);
+  }
+  if(!in->own) {
+    HRM_SetBinary(in->fd);
+  }
+
+  // A pipe may deliver the magic bytes in pieces
+  for(n=0; n<sizeof(magic) && (r=HRM_InputRead(in,magic+n,sizeof(magic)-n)) > 0; n+=r) {
+  }
+  if(r < 0) {
+    HRM_InputClose(in);
+    return(HRM_ERROR);
+  }
+  if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    in->format=HRM_FORMAT_GZIP;
+  } else if(n >= 6 && memcmp(magic,"\xfd" "7zXZ\0",6) == 0) {
+    in->format=HRM_FORMAT_XZ;
+  } else if(n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+    in->format=HRM_FORMAT_ZSTD;
+  } else {
+    in->format=HRM_FORMAT_PLAIN;
+  }
+
+  // The magic bytes are the first input chunk
+  memcpy(in->in,magic,n);
+  in->in_len=n;
+
+  switch(in->format) {
+  case HRM_FORMAT_PLAIN:
+    // Read as it is: the magic bytes are the first output
+    memcpy(in->out,magic,n);
+    in->out_len=n;
+    in->in_len=0;
+    return(HRM_OK);
+#ifdef HRM_ZLIB
+  case HRM_FORMAT_GZIP:
+    if(inflateInit2(&in->gz,15+16) == Z_OK) {     // 15+16: gzip header
+      return(HRM_OK);
+    }
+    break;
+#endif
+#ifdef HRM_LZMA
+  case HRM_FORMAT_XZ:
+    if(lzma_stream_decoder(&in->xz,UINT64_MAX,LZMA_CONCATENATED) == LZMA_OK) {
+      return(HRM_OK);
+    }
+    break;
+#endif
+#ifdef HRM_ZSTD
+  case HRM_FORMAT_ZSTD:
+    if((in->zstd=ZSTD_createDStream()) && !ZSTD_isError(ZSTD_initDStream(in->zstd))) {
+      return(HRM_OK);
+    }
+    break;
+#endif
+  }
+
+  // Not supported by this build
+  HRM_InputClose(in);
+  return(HRM_ERROR);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_InputFill                                                                  //
+// =============                                                                  //
+// - Next chunk of the (decompressed) file to in->out. Returns its length, 0 at   //
+//   the end and -1 on a corrupt file.                                            //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_InputFill(HRM_Input *in)
+{
+  int result;
+
+  in->out_pos=0;
+  in->out_len=0;
+
+  if(in->format == HRM_FORMAT_PLAIN) {
+    result=HRM_InputRead(in,in->out,HRM_INPUT_CHUNK);
+    in->out_len = result > 0 ? result : 0;
+    return result;
+  }
+
+  while(in->out_len == 0 && !in->end) {
+    // More compressed input
+    if(in->in_pos == in->in_len && !in->in_eof) {
+      if((result=HRM_InputRead(in,in->in,HRM_INPUT_CHUNK)) < 0) {
+        return -1;
+      }
+      in->in_len=result;
+      in->in_pos=0;
+      in->in_eof = in->in_len == 0;
+    }
+
+    switch(in->format) {
+#ifdef HRM_ZLIB
+    case HRM_FORMAT_GZIP: {
+      in->gz.next_in=in->in+in->in_pos;
+      in->gz.avail_in=in->in_len-in->in_pos;
+      in->gz.next_out=in->out;
+      in->gz.avail_out=HRM_INPUT_CHUNK;
+      result=inflate(&in->gz,Z_NO_FLUSH);
+      in->in_pos=in->in_len-in->gz.avail_in;
+      in->out_len=HRM_INPUT_CHUNK-in->gz.avail_out;
+      if(result == Z_STREAM_END) {
+        // Another gzip member may follow
+        inflateReset(&in->gz);
+      } else if(result == Z_BUF_ERROR && in->in_eof) {
+        // Input ended: fine between members, truncated within one
+        if(in->gz.total_in != 0) {
+          return -1;
+        }
+        in->end=1;
+      } else if(result != Z_OK && result != Z_BUF_ERROR) {
+        return -1;
+      }
+      break;
+    }
+#endif
+#ifdef HRM_LZMA
+    case HRM_FORMAT_XZ: {
+      lzma_ret ret;
+
+      in->xz.next_in=in->in+in->in_pos;
+      in->xz.avail_in=in->in_len-in->in_pos;
+      in->xz.next_out=in->out;
+      in->xz.avail_out=HRM_INPUT_CHUNK;
+      ret=lzma_code(&in->xz,in->in_eof ? LZMA_FINISH : LZMA_RUN);
+      in->in_pos=in->in_len-in->xz.avail_in;
+      in->out_len=HRM_INPUT_CHUNK-in->xz.avail_out;
+      if(ret == LZMA_STREAM_END) {
+        in->end=1;
+      } else if(ret != LZMA_OK) {
+        return -1;
+      }
+      break;
+    }
+#endif
+#ifdef HRM_ZSTD
+    case HRM_FORMAT_ZSTD: {
+      ZSTD_inBuffer src={in->in,in->in_len,in->in_pos};
+      ZSTD_outBuffer dst={in->out,HRM_INPUT_CHUNK,0};
+      size_t left;
+
+      left=ZSTD_decompressStream(in->zstd,&dst,&src);
+      if(ZSTD_isError(left)) {
+        return -1;
+      }
+      in->in_pos=src.pos;
+      in->out_len=dst.pos;
+      if(in->in_eof && in->out_len == 0) {
+        // 0: the last frame is complete, otherwise the file is truncated
+        if(left != 0) {
+          return -1;
+        }
+        in->end=1;
+      }
+      break;
+    }
+#endif
+    default:
+      return -1;
+    }
+  }
+  return in->out_len;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_InputGets                                                                  //
+// =============                                                                  //
+// - fgets() for HRM_Input                                                        //
+////////////////////////////////////////////////////////////////////////////////////
+char *HRM_InputGets(char *line, int len, HRM_Input *in)
+{
+  unsigned char *nl=NULL;
+  int n=0,chunk,result;
+
+  while(n < len-1 && nl == NULL) {
+    if(in->out_pos == in->out_len && (result=HRM_InputFill(in)) <= 0) {
+      in->error = result < 0;
+      break;
+    }
+    // Up to the end of the line, the line buffer or the chunk
+    chunk=HRM_MIN(len-1-n,(int)(in->out_len-in->out_pos));
+    if((nl=memchr(in->out+in->out_pos,'\n',chunk))) {
+      chunk=nl-(in->out+in->out_pos)+1;
+    }
+    memcpy(line+n,in->out+in->out_pos,chunk);
+    in->out_pos+=chunk;
+    n+=chunk;
+  }
+  line[n]=0;
+  return n ? line : NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_FixFlag                                                                //
+// ===============                                                                //
+// - Puts the calculated ICP Flag to the image                                    //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_ICP_FixFlag(HRM_Data *hrm)
+{
+  hrm->mem[ICP_FLAG_ADDRESS-MEM_OFFSET]= hrm->icp_flag_calculated >> 8;
+  hrm->mem[ICP_FLAG_ADDRESS-MEM_OFFSET+1]= hrm->icp_flag_calculated & 0xff;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_SetWindows                                                                 //
+// ==============                                                                 //
+// - Byte map of the load windows (the whole flash, if none are given)            //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_SetWindows(HRM_Data *hrm)
+{
+  unsigned int i,a;
+
+  memset(hrm->window,hrm->load.nwindows == 0,MEM_SIZE);
+  for(i=0;i<hrm->load.nwindows;i++) {
+    for(a=HRM_MAX(hrm->load.window[i][0],MEM_OFFSET);
+        a<=hrm->load.window[i][1] && a<MEM_OFFSET+MEM_SIZE; a++) {
+      hrm->window[a-MEM_OFFSET]=1;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_PutImage                                                                   //
+// ============                                                                   //
+// - Puts the data of one record to the image, relocated by the load offset.     //
+//   Bytes outside the flash or the load windows are counted and dropped.        //
+// - A byte that an earlier record set to another value is counted as a          //
+//   conflict; the later record wins, as in the file order.                       //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_PutImage(HRM_Data *hrm, unsigned char *written, unsigned int addr,
+                  const unsigned char *data, unsigned int len)
+{
+  unsigned int i,k;
+  long a;
+
+  for(i=0; i<len; i++) {
+    a=(long)addr+i+hrm->load.offset;
+    if(a < MEM_OFFSET || a >= MEM_OFFSET+MEM_SIZE || !hrm->window[a-MEM_OFFSET]) {
+      if(hrm->outside++ == 0) {
+        hrm->outside_addr=addr+i;
+      }
+      continue;
+    }
+    k=a-MEM_OFFSET;
+    if(written[k] && hrm->mem[k] != data[i] && hrm->conflicts++ == 0) {
+      hrm->conflict_addr=addr+i;
+    }
+    hrm->mem[k]=data[i];
+    written[k]=1;
+  }
+}
+
+// Two hex digits, -1 if one of them isn't
+static int HRM_Hex2(const char *p)
+{
+  int v=0,i;
+  char c;
+
+  for(i=0;i<2;i++) {
+    c=p[i];
+    if(c >= '0' && c <= '9') {
+      v=(v<<4) | (c-'0');
+    } else if((c|0x20) >= 'a' && (c|0x20) <= 'f') {
+      v=(v<<4) | ((c|0x20)-'a'+10);
+    } else {
+      return(-1);
+    }
+  }
+  return(v);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_S19Record                                                                  //
+// =============                                                                  //
+// - Decodes one line for both S19 parsers. Returns the record type ('0', '1' or  //
+//   '9') with its address and data, 0 for a line that is skipped (no S0/S1/S9)   //
+//   and -1 for a bad hex digit, a line shorter than its byte count or a wrong    //
+//   checksum (one's complement of the sum of count, address and data bytes)      //
+////////////////////////////////////////////////////////////////////////////////////
+static int HRM_S19Record(const char *p, size_t len, unsigned int *addr, unsigned char *data,
+                         unsigned int *count)
+{
+  unsigned char rec[256];
+  unsigned int sum;
+  int n,v,i;
+
+  while(len > 0 && (p[len-1] == '\n' || p[len-1] == '\r')) {
+    len--;
+  }
+  if(len < 2 || p[0] != 'S' || (p[1] != '0' && p[1] != '1' && p[1] != '9')) {
+    return(0);
+  }
+
+  // Byte count, then address (2), data and checksum (1)
+  if(len < 4 || (n=HRM_Hex2(p+2)) < 3 || len < 4+2*(size_t)n) {
+    return(-1);
+  }
+  sum=n;
+  for(i=0;i<n;i++) {
+    if((v=HRM_Hex2(p+4+2*i)) < 0) {
+      return(-1);
+    }
+    rec[i]=v;
+  }
+  for(i=0;i<n-1;i++) {
+    sum+=rec[i];
+  }
+  if(0xff-(sum & 0xff) != rec[n-1]) {
+    return(-1);
+  }
+  *addr=(rec[0]<<8) | rec[1];
+  *count=n-3;
+  memcpy(data,rec+2,n-3);
+  return(p[1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_S19DecodeChunk                                                             //
+// ==================                                                             //
+// - Decodes the records of one chunk of the file to its extent list. Stops at    //
+//   an S9 record or a malformed one, like the sequential parser.                 //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_S19DecodeChunk(HRM_S19Chunk *c)
+{
+  const char *p,*nl;
+  unsigned char data[256];
+  unsigned int addr,count,i;
+  HRM_Extent *ext;
+  unsigned char *bytes;
+  int type;
+
+  for(p=c->start; p<c->end; p=nl+1) {
+    if((nl=memchr(p,'\n',c->end-p)) == NULL) {
+      nl=c->end;
+    }
+    type=HRM_S19Record(p,nl-p,&addr,data,&count);
+    if(type < 0) {
+      c->error=HRM_FILE_FORMAT_ERROR;
+      break;
+    }
+
+    if(type == '1') {
+      if(count == 0) {
+        continue;
+      }
+      if(c->next == c->max_ext) {
+        if((ext=realloc(c->ext,(c->max_ext ? 2*c->max_ext : 256)*sizeof(HRM_Extent))) == NULL) {
+          c->error=HRM_FILE_OPEN_ERROR;
+          break;
+        }
+        c->ext=ext;
+        c->max_ext = c->max_ext ? 2*c->max_ext : 256;
+      }
+      if(c->nbytes+count > c->max_bytes) {
+        if((bytes=realloc(c->bytes,2*(c->nbytes+count) + 4096)) == NULL) {
+          c->error=HRM_FILE_OPEN_ERROR;
+          break;
+        }
+        c->bytes=bytes;
+        c->max_bytes = 2*(c->nbytes+count) + 4096;
+      }
+      c->ext[c->next].addr=addr;
+      c->ext[c->next].len=count;
+      c->ext[c->next].data=c->nbytes;
+      c->next++;
+      memcpy(c->bytes+c->nbytes,data,count);
+      c->nbytes+=count;
+
+    } else if(type == '0') {
+      count=HRM_MIN(count,HRM_VERSION_SIZE-1);
+      for(i=0;i<count;i++) {
+        c->version[i]=data[i];
+      }
+      c->version[i]=0;
+      c->has_version=1;
+
+    } else if(type == '9') {
+      c->has_end=1;
+      break;
+    }
+  }
+}
+
+#ifndef __MINGW32__
+static void *HRM_S19Worker(void *arg)
+{
+  HRM_S19Job *job=arg;
+  unsigned int i;
+
+  while((i=__sync_fetch_and_add(&job->next,1)) < job->nchunks) {
+    HRM_S19DecodeChunk(&job->chunks[i]);
+  }
+  return NULL;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ReadS19Parallel                                                        //
+// =======================                                                        //
+// - HRM_ICP_ReadS19 for large files: the mapped file is split at record          //
+//   boundaries, the chunks are decoded by a pool of threads and the extent lists //
+//   are merged in file order. Both decode lines with HRM_S19Record(), so the     //
+//   result (or the error) is the same as sequential parsing.                     //
+//   (Windows: the chunks are decoded by the calling thread)                      //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ReadS19Parallel(HRM_Data *hrm, unsigned int threads)
+{
+  unsigned char written[MEM_SIZE];
+  HRM_S19Chunk *c;
+  HRM_S19Job job;
+  const char *data,*p,*q;
+  size_t len;
+  unsigned int i,k,end;
+#ifndef __MINGW32__
+  pthread_t tid[HRM_MAX_THREADS];
+#endif
+
+  if((data=HRM_MapFile(hrm->filename,&len)) == NULL) {
+    hrm->last_errorcode=HRM_FILE_OPEN_ERROR;
+    return(HRM_ERROR);
+  }
+
+  // More chunks than threads, so a slow thread doesn't hold up the rest
+  threads=HRM_MIN(threads,HRM_MAX_THREADS);
+  job.nchunks=threads*HRM_CHUNKS_PER_THREAD;
+  job.next=0;
+  if((job.chunks=calloc(job.nchunks,sizeof(HRM_S19Chunk))) == NULL) {
+    HRM_UnmapFile((void *)data,len);
+    hrm->last_errorcode=HRM_FILE_OPEN_ERROR;
+    return(HRM_ERROR);
+  }
+  for(i=0,p=data; i<job.nchunks; i++) {
+    c=&job.chunks[i];
+    c->start=p;
+    // Ends with the line that crosses the even split point
+    q=HRM_MAX(p,data+len*(i+1)/job.nchunks);
+    if(i == job.nchunks-1 || (p=memchr(q,'\n',data+len-q)) == NULL) {
+      p=data+len;
+    } else {
+      p++;
+    }
+    c->end=p;
+  }
+
+#ifndef __MINGW32__
+  for(i=1;i<threads;i++) {
+    if(pthread_create(&tid[i],NULL,HRM_S19Worker,&job) != 0) {
+      break;
+    }
+  }
+  HRM_S19Worker(&job);
+  while(--i > 0) {
+    pthread_join(tid[i],NULL);
+  }
+#else
+  for(i=0;i<job.nchunks;i++) {
+    HRM_S19DecodeChunk(&job.chunks[i]);
+  }
+#endif
+
+  // Merge in file order, up to the first S9 (or malformed record)
+  memset(written,0,sizeof(written));
+  for(i=0,end=0; i<job.nchunks; i++) {
+    c=&job.chunks[i];
+    if(!end) {
+      if(c->has_version) {
+        strcpy(hrm->version,c->version);
+      }
+      for(k=0;k<c->next;k++) {
+        HRM_PutImage(hrm,written,c->ext[k].addr,c->bytes+c->ext[k].data,c->ext[k].len);
+      }
+      end=c->has_end || c->error;
+      if(c->error) {
+        hrm->last_errorcode=c->error;
+      }
+    }
+    free(c->ext);
+    free(c->bytes);
+  }
+  free(job.chunks);
+  HRM_UnmapFile((void *)data,len);
+
+  if(hrm->last_errorcode) {
+    return(HRM_ERROR);
+  }
+  if(hrm->outside && hrm->load.strict) {
+    hrm->last_errorcode=HRM_WINDOW_ERROR;
+    return(HRM_ERROR);
+  }
+
+  HRM_ICP_CalcFlag(hrm);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ReadS19                                                                //
+// ===============                                                                //
+// - Read and Parse S19-file to HRM_Data struct                                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ReadS19(HRM_Data *hrm)
+{
+  unsigned char data[256],written[MEM_SIZE];
+  unsigned int i,address,datalen;
+  char line[MAX_LINE_LEN];
+  HRM_Input input,*in=&input;
+  unsigned int threads;
+  struct stat st;
+  int type;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  hrm->version[0]=0;
+  hrm->conflicts=0;
+  hrm->outside=0;
+  memset(written,0,sizeof(written));
+  HRM_SetWindows(hrm);
+
+  // Init memory to the fill byte (default 0xFF = empty flash)
+  for(i=0;i<MEM_SIZE;i++)
+    hrm->mem[i]=hrm->load.fill;
+
+  // Open file (plain or compressed)
+  if(HRM_InputOpen(in,hrm->filename) == HRM_ERROR) {
+    hrm->last_errorcode = in->format == HRM_FORMAT_PLAIN ? HRM_FILE_OPEN_ERROR : HRM_FILE_FORMAT_ERROR;
+    return(HRM_ERROR);
+  }
+  hrm->format=in->format;
+
+  // Large plain files are decoded on all cores
+#ifndef __MINGW32__
+  threads = hrm->threads ? hrm->threads : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+  threads = hrm->threads ? hrm->threads : 1;
+#endif
+  if(in->format == HRM_FORMAT_PLAIN && threads > 1 && in->own
+     && fstat(in->fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size >= HRM_PARALLEL_MIN) {
+    HRM_InputClose(in);
+    return(HRM_ICP_ReadS19Parallel(hrm,threads));
+  }
+
+  // Read line by line and do the parsing...
+  while(1) {
+
+    if(HRM_InputGets(line,MAX_LINE_LEN,in) == NULL) {
+      //printf("Nothing to read!");
+      break;
+    }
+
+    // Malformed records end the parsing
+    type=HRM_S19Record(line,strlen(line),&address,data,&datalen);
+    if(type < 0) {
+      hrm->last_errorcode=HRM_FILE_FORMAT_ERROR;
+      break;
+    }
+
+    if(type == '1') {
+      // Put to memmap
+      HRM_PutImage(hrm,written,address,data,datalen);
+
+    } else if(type == '0') {
+      // Header: kept as the version string of the image
+      for(i=0;i<datalen && i<HRM_VERSION_SIZE-1;i++) {
+	hrm->version[i]=data[i];
+      }
+      hrm->version[i]=0;
+
+    } else if(type == '9') {
+      // EndOfRecord
+      break;
+    }
+  }
+
+  if(in->error) {
+    hrm->last_errorcode=HRM_FILE_FORMAT_ERROR;
+  } else if(!hrm->last_errorcode && hrm->outside && hrm->load.strict) {
+    hrm->last_errorcode=HRM_WINDOW_ERROR;
+  }
+  HRM_InputClose(in);
+  if(hrm->last_errorcode) {
+    return(HRM_ERROR);
+  }
+
+  HRM_ICP_CalcFlag(hrm);
+  
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_EraseRequest                                                           //
+// ====================                                                           //
+// - Sends the erase command for start..end. Does not wait for the result         //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_EraseRequest(HRM_Data *hrm, unsigned int start, unsigned int end)
+{
+  return usb_control_msg(
+			 hrm->usb_dev,       // USB-Device
+			 0x40,
+			 ICP_REQ_ERASE,
+			 start,
+			 end,
+			 NULL,
+			 0x00,
+			 10000);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_EraseFlashBlock                                                        //
+// =======================                                                        //
+// - Erase one block of Flash memory (size of 512)                                //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_EraseFlashBlock(HRM_Data *hrm, unsigned int block_start_addr)
+{
+  int status,result;
+  double sent;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  // Validity check
+  if(hrm->usb_dev == NULL) {
+    hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+    return(HRM_ERROR);
+  }
+
+  // ERASE BLOCK
+  HRM_StatusUpdate(hrm,block_start_addr,0);
+  result = HRM_ICP_EraseRequest(hrm,block_start_addr,block_start_addr+MEM_BLOCK_SIZE-1);
+  
+  // GET RESULT (first poll after the calibrated erase time)
+  status = HRM_ICP_PollStatus(hrm, hrm->erase_wait, TIMEOUT_ERASE);
+  sent=HRM_GetTimeMs();
+  HRM_WaitUntil(sent+WAIT_ERASE);
+
+  // An erase was attempted, it counts as wear even if it failed
+  if(result >= 0) {
+    hrm->erase_count[(block_start_addr-MEM_OFFSET)/MEM_BLOCK_SIZE]++;
+  }
+
+  // Check error
+  if( (status != ICP_STATUS_OK) || (result < 0)) {
+    hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_MassEraseFlash                                                         //
+// ======================                                                         //
+// - Erase the whole user area with one request (needs ICP_CAP_MASS_ERASE)        //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_MassEraseFlash(HRM_Data *hrm)
+{
+  int result,status,i;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  if(hrm->usb_dev == NULL || !(hrm->icp_caps & ICP_CAP_MASS_ERASE)) {
+    hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+    return(HRM_ERROR);
+  }
+
+  HRM_StatusUpdate(hrm,MEM_OFFSET,0);
+  result = HRM_ICP_EraseRequest(hrm,MEM_OFFSET,MEM_OFFSET+MEM_SIZE-1);
+
+  // One completion poll for the whole range
+  status = HRM_ICP_PollStatus(hrm, hrm->mass_erase_wait, TIMEOUT_MASS_ERASE);
+
+  for(i=0; result >= 0 && i<MEM_BLOCKS; i++) {
+    hrm->erase_count[i]++;
+  }
+
+  if( (status != ICP_STATUS_OK) || (result < 0)) {
+    hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_EraseFlash                                                             //
+// ==================                                                             //
+// - Erase whole user area of the Flash memory (0xDC00-0xF7FF)                    //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_EraseFlash(HRM_Data *hrm)
+{
+  int i,erased=0,all=1;
+  double start;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  // ERASE ALL BLOCKS
+  HRM_printf(hrm->verbose_mode,"\nERASING FLASH:\n======================\n");
+
+  start=HRM_GetTimeMs();
+
+  // The plan may leave blocks alone
+  for(i=0; hrm->plan_valid && i<MEM_BLOCKS; i++) {
+    if(!hrm->erase_block[i]) {
+      all=0;
+    }
+  }
+
+  // Fast path: the firmware erases the whole user range with one request
+  if(all && (hrm->icp_caps & ICP_CAP_MASS_ERASE)) {
+    HRM_printf(hrm->verbose_mode,"\n0x%04X-0x%04X: ",MEM_OFFSET,MEM_OFFSET+MEM_SIZE-1);
+    if(HRM_ICP_MassEraseFlash(hrm) == HRM_OK) {
+      HRM_printf(hrm->verbose_mode,"EEEEEEEE\n");
+      HRM_printf(hrm->verbose_mode,"Mass erase: %.0f ms\n",HRM_GetTimeMs()-start);
+      return(HRM_OK);
+    }
+    // Fall back to the block loop, it erases the same range again anyway
+    HRM_printf(hrm->verbose_mode,"failed, erasing block by block");
+    HRM_StatusUpdate(hrm,0,1);
+    start=HRM_GetTimeMs();
+  }
+
+  for(i=MEM_OFFSET; i<MEM_OFFSET+MEM_SIZE; i=i+MEM_BLOCK_SIZE) {
+
+    HRM_printf(hrm->verbose_mode,"\n0x%04X: ",i);
+
+    if(hrm->plan_valid && !hrm->erase_block[(i-MEM_OFFSET)/MEM_BLOCK_SIZE]) {
+      HRM_printf(hrm->verbose_mode,"--------");
+      continue;
+    }
+
+    if (HRM_ICP_EraseFlashBlock(hrm, i) == HRM_ERROR) {
+      hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+      return(HRM_ERROR);
+    }
+    erased++;
+
+    HRM_printf(hrm->verbose_mode,"EEEEEEEE");
+  }
+
+  HRM_printf(hrm->verbose_mode,"\n");
+  HRM_printf(hrm->verbose_mode,"Block erase (%d blocks): %.0f ms\n",
+	     erased,HRM_GetTimeMs()-start);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ReadFlash                                                              //
+// =================                                                              //
+// - Reads back up to one row of Flash memory (needs ICP_CAP_READ)                //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ReadFlash(HRM_Data *hrm, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+  int result;
+
+  if(!(hrm->icp_caps & ICP_CAP_READ) || len == 0 || len > MEM_PROG_BLOCK_SIZE) {
+    return(HRM_ERROR);
+  }
+
+  result = usb_control_msg(
+			   hrm->usb_dev,       // USB-Device
+			   0xC0,
+			   ICP_REQ_READ,
+			   addr,
+			   addr+len-1,
+			   (char *)buf,
+			   len,
+			   10000);
+
+  if(result != (int)len) {
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_RowIsEmpty                                                             //
+// ==================                                                             //
+// - Returns 1, if the row in the image has nothing else than "0xff"              //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_RowIsEmpty(HRM_Data *hrm, unsigned int addr)
+{
+  int j;
+
+  for(j=0;j<MEM_PROG_BLOCK_SIZE;j++) {
+    if(hrm->mem[addr-MEM_OFFSET+j] != 0xff) {
+      return(0);
+    }
+  }
+  return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_PlanRow                                                                //
+// ===============                                                                //
+// - Returns 1, if the row has to be programmed: as planned, or without a plan    //
+//   every row that is not empty                                                  //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_PlanRow(HRM_Data *hrm, unsigned int addr)
+{
+  if(hrm->plan_valid) {
+    return(hrm->program_row[(addr-MEM_OFFSET)/MEM_PROG_BLOCK_SIZE]);
+  }
+  return(!HRM_ICP_RowIsEmpty(hrm,addr));
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ProgramRow                                                             //
+// ==================                                                             //
+// - Sends one row (64 bytes) of the image to the device. Does not wait for       //
+//   the result                                                                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ProgramRow(HRM_Data *hrm, unsigned int addr)
+{
+  int result;
+
+  HRM_StatusUpdate(hrm,addr,0);
+  result = usb_control_msg(
+			   hrm->usb_dev,       // USB-Device
+			   0x40,
+			   ICP_REQ_PROGRAM,
+			   addr,
+			   addr+MEM_PROG_BLOCK_SIZE-1,
+			   (char *)hrm->mem + addr-MEM_OFFSET,
+			   MEM_PROG_BLOCK_SIZE,
+			   10000);
+
+  if(result != MEM_PROG_BLOCK_SIZE) {
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ProgramBurst                                                           //
+// ====================                                                           //
+// - Sends consecutive rows in one request of the extended protocol. Returns      //
+//   when all of them are programmed: HRM_OK, if the firmware reported success    //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ProgramBurst(HRM_Data *hrm, unsigned int addr, unsigned int rows)
+{
+  int result;
+
+  HRM_StatusUpdate(hrm,addr,0);
+  result = usb_control_msg(
+			   hrm->usb_dev,       // USB-Device
+			   0x40,
+			   ICP_REQ_PROGRAM_BURST,
+			   addr,
+			   rows,
+			   (char *)hrm->mem + addr-MEM_OFFSET,
+			   rows*MEM_PROG_BLOCK_SIZE,
+			   rows*TIMEOUT_PROGRAMMING);
+
+  if(result != (int)(rows*MEM_PROG_BLOCK_SIZE)) {
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_VerifyRow                                                              //
+// =================                                                              //
+// - Reads the row back and compares it to the image. A failed read counts as     //
+//   a mismatch                                                                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_VerifyRow(HRM_Data *hrm, unsigned int addr)
+{
+  unsigned char row[MEM_PROG_BLOCK_SIZE];
+
+  if(HRM_ICP_ReadFlash(hrm,addr,row,MEM_PROG_BLOCK_SIZE) == HRM_ERROR
+     || memcmp(row,hrm->mem+addr-MEM_OFFSET,MEM_PROG_BLOCK_SIZE) != 0) {
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+// 1, if the row read back is all 0xFF
+static int HRM_ICP_RowErased(const unsigned char *row)
+{
+  int j;
+
+  for(j=0;j<MEM_PROG_BLOCK_SIZE;j++) {
+    if(row[j] != 0xff) {
+      return(0);
+    }
+  }
+  return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_RepairRow                                                              //
+// =================                                                              //
+// - Reads the row back and fixes it, if it differs from the image. A row that is //
+//   still erased (the program didn't reach the flash) is programmed again, any   //
+//   other row is never programmed twice without an erase (cumulative high        //
+//   voltage time of the JB8 flash): its block is queued for                      //
+//   HRM_ICP_RepairBlocks() at the end of the pass                                //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_RepairRow(HRM_Data *hrm, unsigned int addr)
+{
+  unsigned char row[MEM_PROG_BLOCK_SIZE];
+  unsigned char *want=hrm->mem+addr-MEM_OFFSET;
+
+  if(HRM_ICP_ReadFlash(hrm,addr,row,MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+    return(HRM_ERROR);
+  }
+  if(memcmp(row,want,MEM_PROG_BLOCK_SIZE) == 0) {
+    return(HRM_OK);
+  }
+
+  HRM_printf(hrm->verbose_mode,"R");
+  HRM_StatusUpdate(hrm,addr,1);
+
+  if(HRM_ICP_RowErased(row)) {
+    if(HRM_ICP_ProgramRow(hrm,addr) == HRM_OK
+       && HRM_ICP_PollStatus(hrm,hrm->row_wait,TIMEOUT_PROGRAMMING) == ICP_STATUS_OK
+       && HRM_ICP_ReadFlash(hrm,addr,row,MEM_PROG_BLOCK_SIZE) == HRM_OK
+       && memcmp(row,want,MEM_PROG_BLOCK_SIZE) == 0) {
+      return(HRM_OK);
+    }
+  }
+
+  hrm->repair_block[(addr-MEM_OFFSET)/MEM_BLOCK_SIZE]=1;
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_RepairBlocks                                                           //
+// ====================                                                           //
+// - End of a programming pass: erases the blocks queued by HRM_ICP_RepairRow()   //
+//   and programs all of their rows again. If a row still fails, the block starts  //
+//   over (up to HRM_REPAIR_TRIES erases)                                         //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_RepairBlocks(HRM_Data *hrm)
+{
+  unsigned char row[MEM_PROG_BLOCK_SIZE];
+  unsigned int b,i,block,tries;
+
+  for(b=0;b<MEM_BLOCKS;b++) {
+    for(tries=0; hrm->repair_block[b]; tries++) {
+      if(tries == HRM_REPAIR_TRIES) {
+        return(HRM_ERROR);
+      }
+      hrm->repair_block[b]=0;
+      block=MEM_OFFSET+b*MEM_BLOCK_SIZE;
+      HRM_printf(hrm->verbose_mode,"Repair: erasing and programming 0x%04X again\n",block);
+      if(HRM_ICP_EraseFlashBlock(hrm,block) == HRM_ERROR) {
+        return(HRM_ERROR);
+      }
+      for(i=block; i<block+MEM_BLOCK_SIZE && !hrm->repair_block[b]; i+=MEM_PROG_BLOCK_SIZE) {
+        if(HRM_ICP_RowIsEmpty(hrm,i)) {
+          continue;
+        }
+        if(HRM_ICP_ProgramRow(hrm,i) == HRM_ERROR) {
+          return(HRM_ERROR);
+        }
+        // A failed status or a wrong row: the block needs another erase
+        if(HRM_ICP_PollStatus(hrm,hrm->row_wait,TIMEOUT_PROGRAMMING) != ICP_STATUS_OK) {
+          hrm->repair_block[b]=1;
+        } else if(HRM_ICP_ReadFlash(hrm,i,row,MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+          return(HRM_ERROR);
+        } else if(memcmp(row,hrm->mem+i-MEM_OFFSET,MEM_PROG_BLOCK_SIZE) != 0) {
+          hrm->repair_block[b]=1;
+        }
+      }
+    }
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_MatchFlash                                                             //
+// ==================                                                             //
+// - Quick readback of the whole user area. Returns HRM_OK, if the device         //
+//   already holds the image (stops at the first differing row). The ICP flag is  //
+//   left out, the flag clear has zeroed it: flag_stale tells if it differs       //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_MatchFlash(HRM_Data *hrm)
+{
+  unsigned char row[MEM_PROG_BLOCK_SIZE];
+  unsigned int i,flag_row=ICP_FLAG_ADDRESS & ~(MEM_PROG_BLOCK_SIZE-1);
+
+  hrm->flag_stale=0;
+  if(!(hrm->icp_caps & ICP_CAP_READ)) {
+    return(HRM_ERROR);
+  }
+
+  for(i=MEM_OFFSET;i<MEM_OFFSET+MEM_SIZE;i+=MEM_PROG_BLOCK_SIZE) {
+    if(i != flag_row) {
+      if(HRM_ICP_VerifyRow(hrm,i) == HRM_ERROR) {
+        return(HRM_ERROR);
+      }
+      continue;
+    }
+    if(HRM_ICP_ReadFlash(hrm,i,row,MEM_PROG_BLOCK_SIZE) == HRM_ERROR
+       || memcmp(row,hrm->mem+i-MEM_OFFSET,ICP_FLAG_ADDRESS-i) != 0) {
+      return(HRM_ERROR);
+    }
+    hrm->flag_stale = memcmp(row+ICP_FLAG_ADDRESS-i,hrm->mem+ICP_FLAG_ADDRESS-MEM_OFFSET,2) != 0;
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_StatusInterval                                                         //
+// ======================                                                         //
+// - Returns the row count between status checks for deferred status mode, or     //
+//   0 if every row has to be checked (not requested, or not safe on the device)  //
+////////////////////////////////////////////////////////////////////////////////////
+unsigned int HRM_ICP_StatusInterval(HRM_Data *hrm)
+{
+  unsigned char needed=ICP_CAP_READ | ICP_CAP_STICKY_STATUS;
+
+  if(hrm->status_interval == 0) {
+    return(0);
+  }
+  if(hrm->profile == NULL || !hrm->profile->deferred_status) {
+    HRM_printf(hrm->verbose_mode,"NOTE: Deferred status not validated for this device\n");
+    return(0);
+  }
+  if((hrm->icp_caps & needed) != needed) {
+    HRM_printf(hrm->verbose_mode,"NOTE: ICP firmware can't do deferred status\n");
+    return(0);
+  }
+  return(hrm->status_interval);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_CheckRows                                                              //
+// =================                                                              //
+// - Deferred status mode: one status check for a batch of rows. On error, the    //
+//   rows are read back one by one and the failed ones are programmed again       //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_CheckRows(HRM_Data *hrm, unsigned int *rows, unsigned int count)
+{
+  unsigned int i;
+
+  if(HRM_ICP_PollStatus(hrm,HRM_MIN(hrm->row_wait,hrm->profile->min_program_time),
+                        TIMEOUT_PROGRAMMING) == ICP_STATUS_OK) {
+    return(HRM_OK);
+  }
+
+  HRM_printf(hrm->verbose_mode,"!");
+
+  for(i=0;i<count;i++) {
+    if(HRM_ICP_RepairRow(hrm,rows[i]) == HRM_ERROR) {
+      return(HRM_ERROR);
+    }
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_Progress                                                               //
+// ================                                                               //
+// - Counts programmed rows, tells the progress callback (library use) and the    //
+//   status board                                                                 //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_ICP_Progress(HRM_Data *hrm, unsigned int rows)
+{
+  hrm->progress_done+=rows;
+  HRM_StatusUpdate(hrm,0,0);
+  if(hrm->progress) {
+    hrm->progress(hrm->progress_ctx,hrm->progress_done,hrm->progress_total);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ProgramBursts                                                          //
+// =====================                                                          //
+// - Extended protocol: each run of consecutive planned rows (up to the burst     //
+//   size of the firmware) is one request with its status inline. The rows of a  //
+//   failed burst are read back and fixed with the plain AN2398 requests          //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ProgramBursts(HRM_Data *hrm)
+{
+  unsigned int i,k,rows,bursts=0,failed=0,programmed=0,verified=0,repaired=0;
+  int l=0;
+  double start=HRM_GetTimeMs();
+
+  HRM_printf(hrm->verbose_mode,"Burst mode: up to %d rows per request\n",hrm->icp_burst_rows);
+
+  for(i=MEM_OFFSET;i<MEM_OFFSET+MEM_SIZE;i+=rows*MEM_PROG_BLOCK_SIZE) {
+
+    // Consecutive rows of the plan
+    for(rows=0; rows<hrm->icp_burst_rows && i+rows*MEM_PROG_BLOCK_SIZE<MEM_OFFSET+MEM_SIZE
+          && HRM_ICP_PlanRow(hrm,i+rows*MEM_PROG_BLOCK_SIZE); rows++) {
+    }
+
+    if(rows == 0) {
+      if((l++%8) == 0) {
+        HRM_printf(hrm->verbose_mode,"\n0x%04X: ",i);
+      }
+      HRM_printf(hrm->verbose_mode,".");
+      rows=1;
+      continue;
+    }
+
+    bursts++;
+    programmed+=rows;
+    if(HRM_ICP_ProgramBurst(hrm,i,rows) == HRM_ERROR) {
+      failed++;
+      HRM_printf(hrm->verbose_mode,"!");
+      for(k=0;k<rows;k++) {
+        if(HRM_ICP_RepairRow(hrm,i+k*MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+          hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+          return(HRM_ERROR);
+        }
+      }
+    } else if(hrm->verify_distance && (hrm->icp_caps & ICP_CAP_READ)) {
+      // The burst is done when the request returns, nothing to overlap with
+      for(k=0;k<rows;k++) {
+        verified++;
+        if(HRM_ICP_VerifyRow(hrm,i+k*MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+          repaired++;
+          if(HRM_ICP_RepairRow(hrm,i+k*MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+            hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+            return(HRM_ERROR);
+          }
+        }
+      }
+    }
+
+    for(k=0;k<rows;k++) {
+      if((l++%8) == 0) {
+        HRM_printf(hrm->verbose_mode,"\n0x%04X: ",i+k*MEM_PROG_BLOCK_SIZE);
+      }
+      HRM_printf(hrm->verbose_mode,"P");
+    }
+    HRM_ICP_Progress(hrm,rows);
+  }
+
+  HRM_printf(hrm->verbose_mode,"\n%d rows in %d requests (%d failed), %.0f ms\n",
+             programmed,bursts,failed,HRM_GetTimeMs()-start);
+  if(hrm->verify_distance) {
+    HRM_printf(hrm->verbose_mode,"Verify: %d rows, %d repaired\n",verified,repaired);
+  }
+  if(HRM_ICP_RepairBlocks(hrm) == HRM_ERROR) {
+    hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_ProgramFlash                                                           //
+// =====================                                                          //
+// - Program whole user area of the Flash memory (0xDC00-0xF7FF)                  //
+// - With verify_distance k, row N-k is read back and compared while the device   //
+//   is busy programming row N, and a mismatch is repaired right away             //
+// - Firmware with the extended protocol gets the rows in bursts instead          //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_ProgramFlash(HRM_Data *hrm)
+{
+  unsigned int pending[MEM_SIZE/MEM_PROG_BLOCK_SIZE];
+  unsigned int programmed[MEM_SIZE/MEM_PROG_BLOCK_SIZE];
+  unsigned int interval,distance,npending=0,nprogrammed=0,vaddr=0;
+  unsigned int verified=0,repaired=0;
+  int i,l=0,status,mismatch;
+  double sent=0,ready=0,verify_time=0,t;
+  
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  HRM_printf(hrm->verbose_mode,"\nPROGRAMMING FLASH:\n======================\n");
+
+  memset(hrm->repair_block,0,sizeof(hrm->repair_block));
+  hrm->progress_done=0;
+  hrm->progress_total=0;
+  for(i=MEM_OFFSET;i<MEM_OFFSET+MEM_SIZE;i+=MEM_PROG_BLOCK_SIZE) {
+    hrm->progress_total+=HRM_ICP_PlanRow(hrm,i);
+  }
+
+  if(hrm->icp_burst_rows && !hrm->no_burst) {
+    return(HRM_ICP_ProgramBursts(hrm));
+  }
+
+  interval=HRM_ICP_StatusInterval(hrm);
+  if(interval) {
+    HRM_printf(hrm->verbose_mode,"Deferred status: check every %d rows\n",interval);
+  }
+
+  distance=hrm->verify_distance;
+  if(distance && !(hrm->icp_caps & ICP_CAP_READ)) {
+    HRM_printf(hrm->verbose_mode,"NOTE: ICP firmware can't read back, not verifying\n");
+    distance=0;
+  }
+
+  // PROGRAM ALL BLOCKS
+  for(i=MEM_OFFSET;i<MEM_OFFSET+MEM_SIZE;i=i+MEM_PROG_BLOCK_SIZE) {
+
+    // Print some progress info
+    if((l%8) == 0) {
+      HRM_printf(hrm->verbose_mode,"\n0x%04X: ",i);
+    }
+
+    // Check, if block has something else than "0xff" (or is not in the plan)..
+    if(HRM_ICP_PlanRow(hrm,i)) {
+
+      // Each request has its own deadline after the previous one
+      HRM_WaitUntil(ready);
+
+      // PROGRAM BLOCK
+      if(HRM_ICP_ProgramRow(hrm,i) == HRM_ERROR) {
+	hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+	return(HRM_ERROR);
+      }      
+      sent=HRM_GetTimeMs();
+      programmed[nprogrammed++]=i;
+
+      // Verify an older row while this one is being programmed
+      mismatch=0;
+      if(distance && nprogrammed > distance) {
+        vaddr=programmed[nprogrammed-1-distance];
+        mismatch=(HRM_ICP_VerifyRow(hrm,vaddr) == HRM_ERROR);
+        verified++;
+        verify_time+=HRM_GetTimeMs()-sent;
+      }
+
+      if(interval) {
+        // Next row as soon as this one had its minimum program time
+        ready=sent+hrm->profile->min_program_time;
+        pending[npending++]=i;
+
+        // A mismatch is repaired only after the batch status is known
+        if(npending >= interval || mismatch) {
+          if(HRM_ICP_CheckRows(hrm,pending,npending) == HRM_ERROR) {
+            hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+            return(HRM_ERROR);
+          }
+          npending=0;
+        }
+
+      } else {
+
+        // Whatever the verify did not use of the programming time
+        HRM_WaitUntil(sent+hrm->row_wait);
+      
+        // GET RESULT
+        status=HRM_ICP_PollStatus(hrm,0,TIMEOUT_PROGRAMMING);
+        ready=HRM_GetTimeMs()+WAIT_STATUS;
+
+        // Check error..
+        if(status != ICP_STATUS_OK) {
+          hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+          return(HRM_ERROR);
+        }      
+      }
+
+      if(mismatch) {
+        repaired++;
+        if(HRM_ICP_RepairRow(hrm,vaddr) == HRM_ERROR) {
+          hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+          return(HRM_ERROR);
+        }
+      }
+
+      HRM_printf(hrm->verbose_mode,"P");
+      HRM_ICP_Progress(hrm,1);
+
+    } else {
+      
+      HRM_printf(hrm->verbose_mode,".");
+
+    }
+    l++;
+  }
+
+  // Rows left in the last batch
+  if(npending && HRM_ICP_CheckRows(hrm,pending,npending) == HRM_ERROR) {
+    hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+    return(HRM_ERROR);
+  }
+
+  // The last rows had no later row to hide their verify behind
+  for(i=(nprogrammed > distance ? nprogrammed-distance : 0); distance && i<(int)nprogrammed; i++) {
+    t=HRM_GetTimeMs();
+    verified++;
+    if(HRM_ICP_VerifyRow(hrm,programmed[i]) == HRM_ERROR) {
+      repaired++;
+      if(HRM_ICP_RepairRow(hrm,programmed[i]) == HRM_ERROR) {
+        hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+        return(HRM_ERROR);
+      }
+    }
+    verify_time+=HRM_GetTimeMs()-t;
+  }
+  
+  HRM_printf(hrm->verbose_mode,"\n");
+
+  if(distance) {
+    HRM_printf(hrm->verbose_mode,"Verify: %d rows, %d repaired, %.0f ms in reads\n",
+               verified,repaired,verify_time);
+  }
+
+  if(HRM_ICP_RepairBlocks(hrm) == HRM_ERROR) {
+    hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_HID_ReadVersion                                                            //
+// ===================                                                            //
+// - GET_REPORT of the version Feature report on an open HID device. A numbered   //
+//   report comes with its report ID first, and padded to the report size: both   //
+//   are stripped. Returns the length of the version string, -1 on error          //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_HID_ReadVersion(usb_dev_handle *dev, char *version, int len)
+{
+  char report[HRM_VERSION_SIZE+1];
+  int result;
+
+  result = usb_control_msg(
+			   dev,       // USB-Device
+			   0xA1,
+			   0x01,
+			   0x0300 | HID_VERSION_REPORT_ID,
+			   0x0000,
+			   report,
+			   sizeof(report),
+			   1000);
+  if(result <= 0 || report[0] != HID_VERSION_REPORT_ID) {
+    return(-1);
+  }
+  while(result > 1 && (report[result-1] == 0 || report[result-1] == ' ')) {
+    result--;
+  }
+  result=HRM_MIN(result-1,len-1);
+  memcpy(version,report+1,result);
+  version[result]=0;
+  return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_HID_GetVersion                                                             //
+// ==================                                                             //
+// - Asks the running user code for its version string (HID GetReport, Feature    //
+//   report HID_VERSION_REPORT_ID) without leaving HID mode                       //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_HID_GetVersion(unsigned int vid, unsigned int pid, char *version, int len)
+{
+  usb_dev_handle *dev = NULL; /* the device handle */
+  int result;
+
+  // Open USB
+  if( (dev=HRM_OpenUSB(vid,pid,NULL)) == NULL) {
+    return(HRM_ERROR);
+  }
+
+  // Set configuration
+  if(usb_set_configuration(dev, 1) < 0)
+    {
+      usb_close(dev);
+      return(HRM_ERROR);
+    }
+
+  // GET_REPORT (Feature)
+  result=HRM_HID_ReadVersion(dev,version,len);
+  HRM_CloseUSB(dev);
+
+  if(result <= 0) {
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ClearICPFlag                                                               //
+// =====================                                                          //
+// - Clear ICP Flag when in HID mode.                                             //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ClearICPFlag(unsigned int vid, unsigned int pid,unsigned int key1, unsigned int key2) 
+{
+  usb_dev_handle *dev = NULL; /* the device handle */
+  unsigned char result;
+  unsigned char tmp[8];
+
+  // Open USB
+  if( (dev=HRM_OpenUSB(vid,pid,NULL)) == NULL) {
+    return(HRM_ERROR);
+  }
+
+  // Set configuration
+  if(usb_set_configuration(dev, 1) < 0)
+    {
+      usb_close(dev);
+      return(HRM_ERROR);
+    }
+
+  usb_clear_halt(dev,0);
+  usb_resetep(dev,0);
+
+  // Send Set Feature command with keys
+  result = usb_control_msg(
+			   dev,       // USB-Device
+			   0x21,
+			   0x09,
+			   key1,
+			   key2,
+			   tmp,
+			   8,
+			   10000);
+  HRM_CloseUSB(dev);
+  return 0;  
+}
+
+
+
+// Asks the application for its version: the length of the answer, 0 if it has no
+// version report but answers a GET_STATUS, -1 if it doesn't answer
+static int HRM_AppAsk(usb_dev_handle *dev, char *version, int len)
+{
+  int result=-1;
+
+  if(usb_set_configuration(dev,1) >= 0) {
+    result=HRM_HID_ReadVersion(dev,version,len);
+    // No version report is an answer too
+    if(result < 0 && usb_control_msg(dev,0x80,0x00,0x0000,0x0000,version,2,1000) == 2) {
+      result=0;
+    }
+  }
+  return(result);
+}
+
+// Checks the answer of HRM_AppAsk() against the image version
+static int HRM_AppVersion(HRM_Data *hrm, int result, char *version)
+{
+  if(result == 0) {
+    HRM_printf(hrm->verbose_mode,"Application answers (no version report)\n");
+  } else {
+    HRM_printf(hrm->verbose_mode,"Application version: \"%s\"\n",version);
+    if(hrm->version[0] && strcmp(version,hrm->version) != 0) {
+      HRM_printf(hrm->verbose_mode,"...but the image is \"%s\"\n",hrm->version);
+      hrm->last_errorcode=HRM_APP_ERROR;
+      return(HRM_ERROR);
+    }
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_AppCheck                                                                   //
+// ============                                                                   //
+// - Resets the flashed device out of ICP mode (USB bus reset, or a power cycle   //
+//   of its hub port with --power-cycle) and waits until the application answers //
+//   a version query in HID mode. Reports the time from the end of flashing to   //
+//   the answer. Closes the ICP connection                                        //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_AppCheck(HRM_Data *hrm)
+{
+  usb_dev_handle *dev;
+  char port[HRM_GANG_PATH_SIZE],version[HRM_VERSION_SIZE];
+  double start,deadline,enumerated=0;
+  int watch,result=-1;
+
+  // Port of the device, before it leaves ICP mode
+  port[0]=0;
+  if(hrm->power_cycle && HRM_USBPort(ICP_VID,ICP_PID,hrm->usb_path,port,sizeof(port)) == HRM_ERROR) {
+    port[0]=0;
+  }
+
+  watch=HRM_USBWatch();
+  start=HRM_GetTimeMs();
+  if(port[0]) {
+    HRM_ICP_CloseUSB(hrm);
+    if(HRM_PowerCycle(hrm,port) == HRM_ERROR) {
+      port[0]=0;
+      if((hrm->usb_dev=HRM_OpenUSB(ICP_VID,ICP_PID,hrm->usb_path)) == NULL) {
+        hrm->last_errorcode=HRM_USB_OPEN_ERROR;
+        return(HRM_ERROR);
+      }
+    }
+  }
+  if(port[0] == 0) {
+    HRM_printf(hrm->verbose_mode,"USB bus reset\n");
+    usb_reset(hrm->usb_dev);
+    HRM_ICP_CloseUSB(hrm);
+  }
+
+  // The user code enumerates in HID mode; it is ready, when it answers
+  deadline=start+hrm->app_check*1000.0;
+  while(result < 0 && HRM_GetTimeMs() < deadline) {
+    if((dev=HRM_OpenUSB(HID_VID,HID_PID,NULL)) == NULL) {
+      HRM_USBWait(watch,deadline-HRM_GetTimeMs());
+      continue;
+    }
+    if(enumerated == 0) {
+      enumerated=HRM_GetTimeMs();
+    }
+    result=HRM_AppAsk(dev,version,sizeof(version));
+    HRM_CloseUSB(dev);
+    if(result < 0) {
+      HRM_USBWait(watch,HRM_MIN(10,deadline-HRM_GetTimeMs()));
+    }
+  }
+  if(watch >= 0) {
+    close(watch);
+  }
+
+  if(result < 0) {
+    if(enumerated) {
+      HRM_printf(hrm->verbose_mode,"HID device after %.0f ms, but the application doesn't answer\n",
+                 enumerated-start);
+    } else if((dev=HRM_OpenUSB(ICP_VID,ICP_PID,hrm->usb_path))) {
+      HRM_CloseUSB(dev);
+      HRM_printf(hrm->verbose_mode,"Device is back in ICP mode: the ICP flag doesn't match the image\n");
+    } else {
+      HRM_printf(hrm->verbose_mode,"No HID device in %d s\n",hrm->app_check);
+    }
+    hrm->last_errorcode=HRM_APP_ERROR;
+    return(HRM_ERROR);
+  }
+
+  HRM_printf(hrm->verbose_mode,"HID device after %.0f ms\n",enumerated-start);
+  if(HRM_AppVersion(hrm,result,version) == HRM_ERROR) {
+    return(HRM_ERROR);
+  }
+  HRM_printf(hrm->verbose_mode,"Flash to application ready: %.0f ms\n",HRM_GetTimeMs()-start);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_SaveCalibration                                                            //
+// ===================                                                            //
+// - Replaces the lines of this profile and host in the calibration file          //
+//   (written to a temporary file and renamed over the old one)                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_SaveCalibration(HRM_Data *hrm, HRM_Timing *timing)
+{
+  char path[MAX_FILENAME_SIZE+1],tmp[MAX_FILENAME_SIZE+5],line[MAX_LINE_LEN],host[64];
+  char l_profile[64],l_host[64],l_op[32];
+  FILE *in,*out;
+  int op,replaced;
+
+  HRM_UserFile(hrm->calibration_file,HRM_CALIBRATION_FILE,path,sizeof(path));
+  snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+  HRM_GetHostName(host,sizeof(host));
+
+  if((out=fopen(tmp,"w")) == NULL) {
+    return(HRM_ERROR);
+  }
+
+  // Keep the other profiles, hosts and operations
+  if((in=fopen(path,"r"))) {
+    while(fgets(line,sizeof(line),in)) {
+      replaced=0;
+      if(sscanf(line,"%63s %63s %31s",l_profile,l_host,l_op) == 3
+         && strcmp(l_profile,hrm->profile->name) == 0 && strcmp(l_host,host) == 0) {
+        for(op=0;op<HRM_OP_COUNT;op++) {
+          if(timing[op].count && strcmp(l_op,HRM_OpNames[op]) == 0) {
+            replaced=1;
+          }
+        }
+      }
+      if(!replaced) {
+        fputs(line,out);
+      }
+    }
+    fclose(in);
+  }
+
+  for(op=0;op<HRM_OP_COUNT;op++) {
+    if(timing[op].count) {
+      fprintf(out,"%s %s %s %u %.3f %.3f %.3f %.3f\n",hrm->profile->name,host,
+              HRM_OpNames[op],timing[op].count,
+              timing[op].p50,timing[op].p90,timing[op].p99,timing[op].max);
+    }
+  }
+
+  if(fclose(out) != 0) {
+    remove(tmp);
+    return(HRM_ERROR);
+  }
+#ifdef __MINGW32__
+  remove(path);                      // No atomic replace with rename() on Windows
+#endif
+  if(rename(tmp,path) != 0) {
+    remove(tmp);
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+static int HRM_CompareDouble(const void *a, const void *b)
+{
+  double x=*(const double *)a, y=*(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_Percentiles                                                                //
+// ===============                                                                //
+// - Sorts the samples and fills the percentiles                                  //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_Percentiles(double *samples, unsigned int count, HRM_Timing *t)
+{
+  memset(t,0,sizeof(*t));
+  if(count == 0) {
+    return;
+  }
+  qsort(samples,count,sizeof(double),HRM_CompareDouble);
+  t->count=count;
+  t->p50=samples[(count-1)*50/100];
+  t->p90=samples[(count-1)*90/100];
+  t->p99=samples[(count-1)*99/100];
+  t->max=samples[count-1];
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_TimeCompletion                                                         //
+// ======================                                                         //
+// - Polls the status densely until the command sent at 'sent' has completed.     //
+//   Returns the completion time in ms, or -1 on failure                          //
+////////////////////////////////////////////////////////////////////////////////////
+double HRM_ICP_TimeCompletion(HRM_Data *hrm, double sent, unsigned int timeout)
+{
+  double now;
+  int status;
+
+  for(;;) {
+    status=HRM_ICP_GetStatus(hrm);
+    now=HRM_GetTimeMs();
+    if(status != ICP_STATUS_BUSY) {
+      return(status == ICP_STATUS_OK ? now-sent : -1);
+    }
+    if(now-sent > timeout) {
+      return(-1);
+    }
+    HRM_WaitUntil(now+HRM_CALIBRATION_POLL);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_Calibrate                                                              //
+// =================                                                              //
+// - Erases and programs the image 'rounds' times, measuring every block erase    //
+//   and row program (and mass erase, if supported) by status polling. Saves the  //
+//   percentiles to the calibration file. The device holds the image afterwards.  //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_Calibrate(HRM_Data *hrm, unsigned int rounds)
+{
+  double *samples[HRM_OP_COUNT],sent,t;
+  unsigned int count[HRM_OP_COUNT],r,i;
+  HRM_Timing timing[HRM_OP_COUNT];
+  char path[MAX_FILENAME_SIZE+1];
+  int op,result=HRM_OK;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  if(hrm->profile == NULL) {
+    hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+    return(HRM_ERROR);
+  }
+
+  HRM_printf(hrm->verbose_mode,"\nCALIBRATING TIMINGS:\n======================\n");
+
+  samples[HRM_OP_ROW]=malloc(rounds*(MEM_SIZE/MEM_PROG_BLOCK_SIZE)*sizeof(double));
+  samples[HRM_OP_ERASE]=malloc(rounds*(MEM_SIZE/MEM_BLOCK_SIZE)*sizeof(double));
+  samples[HRM_OP_MASS_ERASE]=malloc(rounds*sizeof(double));
+  memset(count,0,sizeof(count));
+
+  for(r=0; r<rounds && result == HRM_OK; r++) {
+
+    HRM_printf(hrm->verbose_mode,"Round %d/%d: ",r+1,rounds);
+
+    // Mass erase first, the block erases then have something to erase too
+    if(hrm->icp_caps & ICP_CAP_MASS_ERASE) {
+      sent=HRM_GetTimeMs();
+      if(HRM_ICP_EraseRequest(hrm,MEM_OFFSET,MEM_OFFSET+MEM_SIZE-1) < 0
+         || (t=HRM_ICP_TimeCompletion(hrm,sent,TIMEOUT_MASS_ERASE)) < 0) {
+        result=HRM_FLASH_ERASE_ERROR;
+        break;
+      }
+      samples[HRM_OP_MASS_ERASE][count[HRM_OP_MASS_ERASE]++]=t;
+      for(i=0;i<MEM_BLOCKS;i++) {
+        hrm->erase_count[i]++;
+      }
+      HRM_printf(hrm->verbose_mode,"M");
+    }
+
+    for(i=MEM_OFFSET; i<MEM_OFFSET+MEM_SIZE; i+=MEM_BLOCK_SIZE) {
+      sent=HRM_GetTimeMs();
+      if(HRM_ICP_EraseRequest(hrm,i,i+MEM_BLOCK_SIZE-1) < 0
+         || (t=HRM_ICP_TimeCompletion(hrm,sent,TIMEOUT_ERASE)) < 0) {
+        result=HRM_FLASH_ERASE_ERROR;
+        break;
+      }
+      samples[HRM_OP_ERASE][count[HRM_OP_ERASE]++]=t;
+      hrm->erase_count[(i-MEM_OFFSET)/MEM_BLOCK_SIZE]++;
+      HRM_printf(hrm->verbose_mode,"E");
+    }
+
+    for(i=MEM_OFFSET; i<MEM_OFFSET+MEM_SIZE && result == HRM_OK; i+=MEM_PROG_BLOCK_SIZE) {
+      if(HRM_ICP_RowIsEmpty(hrm,i)) {
+        continue;
+      }
+      sent=HRM_GetTimeMs();
+      if(HRM_ICP_ProgramRow(hrm,i) == HRM_ERROR
+         || (t=HRM_ICP_TimeCompletion(hrm,sent,TIMEOUT_PROGRAMMING)) < 0) {
+        result=HRM_FLASH_PROGRAM_ERROR;
+        break;
+      }
+      samples[HRM_OP_ROW][count[HRM_OP_ROW]++]=t;
+      if(count[HRM_OP_ROW]%8 == 0) {
+        HRM_printf(hrm->verbose_mode,"P");
+      }
+    }
+    HRM_printf(hrm->verbose_mode,"\n");
+  }
+
+  if(result == HRM_OK) {
+    HRM_printf(hrm->verbose_mode,"\n%-12s %6s %8s %8s %8s %8s\n","operation","count","p50","p90","p99","max");
+    for(op=0;op<HRM_OP_COUNT;op++) {
+      HRM_Percentiles(samples[op],count[op],&timing[op]);
+      if(timing[op].count) {
+        HRM_printf(hrm->verbose_mode,"%-12s %6d %6.2fms %6.2fms %6.2fms %6.2fms\n",HRM_OpNames[op],
+                   timing[op].count,timing[op].p50,timing[op].p90,timing[op].p99,timing[op].max);
+      }
+    }
+    HRM_UserFile(hrm->calibration_file,HRM_CALIBRATION_FILE,path,sizeof(path));
+    if(HRM_SaveCalibration(hrm,timing) == HRM_ERROR) {
+      HRM_printf(hrm->verbose_mode,"WARNING: Can't write \"%s\"\n",path);
+    } else {
+      HRM_printf(hrm->verbose_mode,"Saved to \"%s\"\n",path);
+    }
+  }
+
+  for(op=0;op<HRM_OP_COUNT;op++) {
+    free(samples[op]);
+  }
+
+  if(result != HRM_OK) {
+    hrm->last_errorcode=result;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+// Image store ////////////////////////////////////////////////////////////////////////////////
+//
+// Images are kept as 512-byte blocks named by their hash, shared by all variants:
+//   <store>/blocks/<hash>.bin          Raw block data
+//   <store>/variants/<name>.manifest   "version <S0 header>" and "0x<addr> <hash>" lines
+// Empty (all 0xFF) blocks are not stored, their hash is 0.
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_BlockHash                                                                  //
+// =============                                                                  //
+// - Hash of one flash block of the image, 0 for an empty block                   //
+////////////////////////////////////////////////////////////////////////////////////
+unsigned long long HRM_BlockHash(const unsigned char *block)
+{
+  int i;
+
+  for(i=0;i<MEM_BLOCK_SIZE;i++) {
+    if(block[i] != 0xff) {
+      return HRM_Hash(block,MEM_BLOCK_SIZE,HRM_HASH_INIT);
+    }
+  }
+  return 0;
+}
+
+static int HRM_CompareBlock(const void *a, const void *b)
+{
+  unsigned long long x=((const HRM_StoreBlock *)a)->hash, y=((const HRM_StoreBlock *)b)->hash;
+
+  return (x > y) - (x < y);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreReadManifest                                                          //
+// =====================                                                          //
+// - Reads one variant manifest                                                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StoreReadManifest(char *path, HRM_Manifest *m)
+{
+  char line[MAX_LINE_LEN];
+  unsigned long long hash;
+  unsigned int addr;
+  FILE *fp;
+
+  memset(m->block,0,sizeof(m->block));
+  m->version[0]=0;
+
+  if((fp=fopen(path,"r")) == NULL) {
+    return(HRM_ERROR);
+  }
+  while(fgets(line,sizeof(line),fp)) {
+    line[strcspn(line,"\r\n")]=0;
+    if(strncmp(line,"version ",8) == 0) {
+      strncpy(m->version,line+8,HRM_VERSION_SIZE-1);
+      m->version[HRM_VERSION_SIZE-1]=0;
+    } else if(sscanf(line,"%x %llx",&addr,&hash) == 2
+              && addr >= MEM_OFFSET && addr < MEM_OFFSET+MEM_SIZE
+              && (addr-MEM_OFFSET) % MEM_BLOCK_SIZE == 0) {
+      m->block[(addr-MEM_OFFSET)/MEM_BLOCK_SIZE]=hash;
+    }
+  }
+  fclose(fp);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreLoad                                                                  //
+// =============                                                                  //
+// - Preloads all blocks and variant manifests of the store into memory. A block  //
+//   file whose data doesn't match its name is left out.                          //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StoreLoad(HRM_Data *hrm)
+{
+  HRM_Store *s=&hrm->store;
+  char dir_path[MAX_FILENAME_SIZE+16],path[2*MAX_FILENAME_SIZE+32];
+  unsigned long long hash;
+  HRM_StoreBlock *blk;
+  HRM_Manifest *m;
+  void *grown;
+  struct dirent *e;
+  DIR *dir;
+  FILE *fp;
+  int len,ok;
+
+  HRM_UserFile(hrm->store_dir,HRM_STORE_DIR,s->path,sizeof(s->path));
+
+  // Blocks
+  snprintf(dir_path,sizeof(dir_path),"%s/blocks",s->path);
+  if((dir=opendir(dir_path))) {
+    while((e=readdir(dir))) {
+      if(strlen(e->d_name) != 20 || strcmp(e->d_name+16,".bin") != 0
+         || sscanf(e->d_name,"%16llx",&hash) != 1) {
+        continue;
+      }
+      if((s->nblocks%64) == 0) {
+        if((grown=realloc(s->blocks,(s->nblocks+64)*sizeof(HRM_StoreBlock))) == NULL) {
+          closedir(dir);
+          hrm->last_errorcode=HRM_STORE_ERROR;
+          return(HRM_ERROR);
+        }
+        s->blocks=grown;
+      }
+      blk=&s->blocks[s->nblocks];
+      snprintf(path,sizeof(path),"%s/%s",dir_path,e->d_name);
+      if((fp=fopen(path,"rb")) == NULL) {
+        continue;
+      }
+      ok = fread(blk->data,1,MEM_BLOCK_SIZE,fp) == MEM_BLOCK_SIZE;
+      fclose(fp);
+      if(ok && HRM_Hash(blk->data,MEM_BLOCK_SIZE,HRM_HASH_INIT) == hash) {
+        blk->hash=hash;
+        s->nblocks++;
+      }
+    }
+    closedir(dir);
+    qsort(s->blocks,s->nblocks,sizeof(HRM_StoreBlock),HRM_CompareBlock);
+  }
+
+  // Variants
+  snprintf(dir_path,sizeof(dir_path),"%s/variants",s->path);
+  if((dir=opendir(dir_path))) {
+    while((e=readdir(dir))) {
+      len=strlen(e->d_name)-strlen(".manifest");
+      if(len <= 0 || len >= HRM_VARIANT_NAME_SIZE || strcmp(e->d_name+len,".manifest") != 0) {
+        continue;
+      }
+      if((s->nvariants%16) == 0) {
+        if((grown=realloc(s->variants,(s->nvariants+16)*sizeof(HRM_Manifest))) == NULL) {
+          closedir(dir);
+          hrm->last_errorcode=HRM_STORE_ERROR;
+          return(HRM_ERROR);
+        }
+        s->variants=grown;
+      }
+      m=&s->variants[s->nvariants];
+      memcpy(m->name,e->d_name,len);
+      m->name[len]=0;
+      snprintf(path,sizeof(path),"%s/%s",dir_path,e->d_name);
+      if(HRM_StoreReadManifest(path,m) == HRM_OK) {
+        s->nvariants++;
+      }
+    }
+    closedir(dir);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreFind                                                                  //
+// =============                                                                  //
+// - Returns the manifest of a preloaded variant (NULL if not in the store)       //
+////////////////////////////////////////////////////////////////////////////////////
+HRM_Manifest *HRM_StoreFind(HRM_Data *hrm, char *name)
+{
+  unsigned int i;
+
+  for(i=0;i<hrm->store.nvariants;i++) {
+    if(strcmp(hrm->store.variants[i].name,name) == 0) {
+      return &hrm->store.variants[i];
+    }
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreSelect                                                                //
+// ===============                                                                //
+// - Makes a preloaded variant the image to program (no file is read)             //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StoreSelect(HRM_Data *hrm, char *name)
+{
+  HRM_StoreBlock key,*blk;
+  HRM_Manifest *m;
+  int b;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  if((m=HRM_StoreFind(hrm,name)) == NULL) {
+    hrm->last_errorcode=HRM_STORE_ERROR;
+    return(HRM_ERROR);
+  }
+
+  for(b=0;b<MEM_BLOCKS;b++) {
+    if(m->block[b] == 0) {
+      memset(hrm->mem+b*MEM_BLOCK_SIZE,0xff,MEM_BLOCK_SIZE);
+      continue;
+    }
+    key.hash=m->block[b];
+    blk=bsearch(&key,hrm->store.blocks,hrm->store.nblocks,sizeof(HRM_StoreBlock),HRM_CompareBlock);
+    if(blk == NULL) {
+      hrm->last_errorcode=HRM_STORE_ERROR;
+      return(HRM_ERROR);
+    }
+    memcpy(hrm->mem+b*MEM_BLOCK_SIZE,blk->data,MEM_BLOCK_SIZE);
+  }
+
+  strcpy(hrm->version,m->version);
+  hrm->filename=m->name;
+  HRM_ICP_CalcFlag(hrm);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreName                                                                  //
+// =============                                                                  //
+// - Checks a variant name: it becomes a file name in <store>/variants, so no     //
+//   path separators, no leading dot (".", "..", hidden files), no control chars  //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StoreName(const char *name)
+{
+  const char *p;
+
+  if(*name == 0 || *name == '.' || strlen(name) >= HRM_VARIANT_NAME_SIZE) {
+    return(0);
+  }
+  for(p=name;*p;p++) {
+    if(*p == '/' || *p == '\\' || *p == ':' || (unsigned char)*p < ' ') {
+      return(0);
+    }
+  }
+  return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreAdd                                                                   //
+// ============                                                                   //
+// - Adds the image as a variant: new blocks are written, blocks already in the   //
+//   store are shared. Files are written to a temporary name and renamed, so a    //
+//   station reading the store never sees a partial one. A stored block with the  //
+//   same hash but other data (a hash collision) fails the add, a damaged one is  //
+//   written again.                                                               //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StoreAdd(HRM_Data *hrm, char *name)
+{
+  char root[MAX_FILENAME_SIZE+1],path[2*MAX_FILENAME_SIZE+2],tmp[2*MAX_FILENAME_SIZE+8];
+  unsigned char data[MEM_BLOCK_SIZE],*block;
+  unsigned long long hash[MEM_BLOCKS];
+  int b,used=0,added=0,ok;
+  FILE *fp;
+
+  // Reset Errors
+  hrm->last_errorcode=0;
+
+  HRM_UserFile(hrm->store_dir,HRM_STORE_DIR,root,sizeof(root));
+  HRM_MkDir(root);
+  snprintf(path,sizeof(path),"%s/blocks",root);
+  HRM_MkDir(path);
+  snprintf(path,sizeof(path),"%s/variants",root);
+  HRM_MkDir(path);
+
+  for(b=0;b<MEM_BLOCKS;b++) {
+    block=hrm->mem+b*MEM_BLOCK_SIZE;
+    if((hash[b]=HRM_BlockHash(block)) == 0) {
+      continue;
+    }
+    used++;
+    snprintf(path,sizeof(path),"%s/blocks/%016llx.bin",root,hash[b]);
+
+    // Already stored: must really be the same data
+    if((fp=fopen(path,"rb"))) {
+      ok = fread(data,1,MEM_BLOCK_SIZE,fp) == MEM_BLOCK_SIZE;
+      fclose(fp);
+      if(ok && memcmp(data,block,MEM_BLOCK_SIZE) == 0) {
+        continue;
+      }
+      if(ok && HRM_Hash(data,MEM_BLOCK_SIZE,HRM_HASH_INIT) == hash[b]) {
+        HRM_printf(hrm->verbose_mode,"Block 0x%04X: other data with the same hash in \"%s\"\n",
+                   MEM_OFFSET+b*MEM_BLOCK_SIZE,path);
+        hrm->last_errorcode=HRM_STORE_ERROR;
+        return(HRM_ERROR);
+      }
+    }
+
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    if((fp=fopen(tmp,"wb")) == NULL) {
+      hrm->last_errorcode=HRM_STORE_ERROR;
+      return(HRM_ERROR);
+    }
+    ok = fwrite(block,1,MEM_BLOCK_SIZE,fp) == MEM_BLOCK_SIZE;
+    ok = fclose(fp) == 0 && ok;
+#ifdef __MINGW32__
+    remove(path);                    // No atomic replace with rename() on Windows
+#endif
+    if(!ok || rename(tmp,path) != 0) {
+      remove(tmp);
+      hrm->last_errorcode=HRM_STORE_ERROR;
+      return(HRM_ERROR);
+    }
+    added++;
+  }
+
+  snprintf(path,sizeof(path),"%s/variants/%s.manifest",root,name);
+  snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+  if((fp=fopen(tmp,"w")) == NULL) {
+    hrm->last_errorcode=HRM_STORE_ERROR;
+    return(HRM_ERROR);
+  }
+  fprintf(fp,"version %s\n",hrm->version);
+  for(b=0;b<MEM_BLOCKS;b++) {
+    if(hash[b]) {
+      fprintf(fp,"0x%04X %016llx\n",MEM_OFFSET+b*MEM_BLOCK_SIZE,hash[b]);
+    }
+  }
+  ok = fclose(fp) == 0;
+#ifdef __MINGW32__
+  remove(path);                      // No atomic replace with rename() on Windows
+#endif
+  if(!ok || rename(tmp,path) != 0) {
+    remove(tmp);
+    hrm->last_errorcode=HRM_STORE_ERROR;
+    return(HRM_ERROR);
+  }
+
+  HRM_printf(hrm->verbose_mode,"Variant \"%s\": %d blocks, %d new, %d shared (%s)\n",
+             name,used,added,used-added,root);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StoreList                                                                  //
+// =============                                                                  //
+// - Prints the variants of the preloaded store and how many blocks they share    //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_StoreList(HRM_Data *hrm)
+{
+  HRM_Store *s=&hrm->store;
+  unsigned int v,k,b,c,used,unique,refs=0;
+
+  printf("\nIMAGE STORE (%s):\n======================\n",s->path);
+  for(v=0;v<s->nvariants;v++) {
+    for(b=0,used=0,unique=0;b<MEM_BLOCKS;b++) {
+      if(s->variants[v].block[b] == 0) {
+        continue;
+      }
+      used++;
+      // Used by no other variant, at any address
+      for(k=0;k<s->nvariants;k++) {
+        for(c=0; k != v && c<MEM_BLOCKS; c++) {
+          if(s->variants[k].block[c] == s->variants[v].block[b]) {
+            break;
+          }
+        }
+        if(k != v && c < MEM_BLOCKS) {
+          break;
+        }
+      }
+      unique += k == s->nvariants;
+    }
+    refs+=used;
+    printf("%-20s %2d blocks, %2d unique  \"%s\"\n",s->variants[v].name,used,unique,
+           s->variants[v].version);
+  }
+  printf("\n%d variants, %d blocks stored (%d bytes, %d without sharing)\n",s->nvariants,
+         s->nblocks,s->nblocks*MEM_BLOCK_SIZE,refs*MEM_BLOCK_SIZE);
+}
+
+// Smoke test ////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_SmokeTest                                                                  //
+// =============                                                                  //
+// - Boots the image on the HC08 simulator from its reset vector for a bounded    //
+//   number of cycles. Fails, if the reset vector is outside the image, or the    //
+//   program hits an illegal opcode, leaves the image, runs into erased flash,    //
+//   overflows the stack or does not reach the marker address.                    //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_SmokeTest(HRM_Data *hrm)
+{
+  HC08_Cpu *cpu;
+  unsigned long cycles = hrm->smoke_cycles ? hrm->smoke_cycles : HRM_SMOKE_CYCLES;
+  unsigned int vector = hrm->reset_vector ? hrm->reset_vector : HRM_RESET_VECTOR;
+  unsigned int entry;
+  int stop,ok;
+  double t=HRM_GetTimeMs();
+
+  hrm->last_errorcode=0;
+
+  if((cpu=HC08_Create()) == NULL) {
+    hrm->last_errorcode=HRM_SMOKE_ERROR;
+    return(HRM_ERROR);
+  }
+  HC08_Map(cpu,0,HRM_SMOKE_IO_END,HC08_MEM_IO);
+  HC08_Map(cpu,HRM_SMOKE_RAM_START,HRM_SMOKE_RAM_END,HC08_MEM_RAM);
+  HC08_Map(cpu,MEM_OFFSET,MEM_OFFSET+MEM_SIZE-1,HC08_MEM_ROM);
+  HC08_Load(cpu,MEM_OFFSET,hrm->mem,MEM_SIZE);
+
+  entry=HC08_Vector(cpu,vector);
+  HRM_printf(hrm->verbose_mode,"Reset vector (0x%04X): 0x%04X\n",vector,entry);
+  if(entry < MEM_OFFSET || entry >= MEM_OFFSET+MEM_SIZE) {
+    HRM_printf(hrm->verbose_mode,"FAILED: reset vector is outside the image\n");
+    HC08_Free(cpu);
+    hrm->last_errorcode=HRM_SMOKE_ERROR;
+    return(HRM_ERROR);
+  }
+
+  HC08_Reset(cpu,vector);
+  stop=HC08_Run(cpu,cycles,hrm->smoke_marker);
+
+  if(hrm->smoke_marker >= 0) {
+    ok = stop == HC08_STOP_MARKER;
+  } else {
+    ok = stop == HC08_STOP_BUDGET || stop == HC08_STOP_HALT;
+  }
+
+  HRM_printf(hrm->verbose_mode,"%llu cycles, %llu instructions (%llu decoded) in %.2f ms\n",
+             cpu->cycles,cpu->instructions,cpu->decoded,HRM_GetTimeMs()-t);
+  HRM_printf(hrm->verbose_mode,"%s: %s at 0x%04X\n",ok ? "OK" : "FAILED",
+             HC08_StopName(stop),cpu->stop_pc);
+  HC08_Free(cpu);
+
+  if(!ok) {
+    hrm->last_errorcode=HRM_SMOKE_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+// Image diff /////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_RowChange                                                                  //
+// =============                                                                  //
+// - Compares one row of two images a word at a time: 0 = same, 1 = the old row   //
+//   is erased and new data can be programmed, 2 = needs an erase (a programmed   //
+//   row is never programmed over, see HRM_ICP_Plan())                            //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_RowChange(const unsigned char *old, const unsigned char *new)
+{
+  unsigned long long o,n;
+  int i,change=0,erased=1;
+
+  for(i=0;i<MEM_PROG_BLOCK_SIZE;i+=sizeof(o)) {
+    memcpy(&o,old+i,sizeof(o));
+    memcpy(&n,new+i,sizeof(n));
+    change |= o != n;
+    erased &= o == ~0ULL;
+  }
+  return change ? (erased ? 1 : 2) : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ImageDiff                                                                  //
+// =============                                                                  //
+// - Compares two image files: prints the changed address ranges, the erases and  //
+//   row programs a delta flash from the old image to the new one needs, and the  //
+//   time it takes with the (calibrated) timing of the default device profile.   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ImageDiff(HRM_Data *hrm, char *old_file, char *new_file)
+{
+  HRM_Data *old;
+  unsigned long long o,n;
+  unsigned int i,b,r,start,erased=0,rows=0,full_rows=0,bytes=0,ranges=0;
+  unsigned char *om,*nm;
+  char map[MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE+1];
+  int change,erase;
+  double delta_ms,full_ms;
+
+  if((old=malloc(sizeof(HRM_Data))) == NULL) {
+    hrm->last_errorcode=HRM_FILE_OPEN_ERROR;
+    return(HRM_ERROR);
+  }
+  memset(old,0,sizeof(HRM_Data));
+  old->threads=hrm->threads;
+  old->load=hrm->load;
+
+  // Both as they would be programmed (ICP Flag fixed)
+  old->filename=old_file;
+  hrm->filename=new_file;
+  if(HRM_ICP_ReadS19(old) == HRM_ERROR || HRM_ICP_ReadS19(hrm) == HRM_ERROR) {
+    hrm->last_errorcode = old->last_errorcode ? old->last_errorcode : hrm->last_errorcode;
+    free(old);
+    return(HRM_ERROR);
+  }
+  HRM_ICP_FixFlag(old);
+  HRM_ICP_FixFlag(hrm);
+  om=old->mem;
+  nm=hrm->mem;
+
+  printf("\nIMAGE DIFF:\n======================\n");
+  printf("Old: \"%s\" (%s)\nNew: \"%s\" (%s)\n\n",old_file,old->version,new_file,hrm->version);
+
+  // Changed ranges, a word at a time
+  for(i=0;i<MEM_SIZE;) {
+    if(i+sizeof(o) <= MEM_SIZE) {
+      memcpy(&o,om+i,sizeof(o));
+      memcpy(&n,nm+i,sizeof(n));
+      if(o == n) {
+        i+=sizeof(o);
+        continue;
+      }
+    }
+    if(om[i] == nm[i]) {
+      i++;
+      continue;
+    }
+    start=i;
+    while(i < MEM_SIZE && om[i] != nm[i]) {
+      i++;
+    }
+    printf("Changed: 0x%04X-0x%04X (%d bytes)\n",MEM_OFFSET+start,MEM_OFFSET+i-1,i-start);
+    bytes+=i-start;
+    ranges++;
+  }
+  if(ranges == 0) {
+    printf("Images are identical.\n");
+  }
+
+  // What a delta flash does per block: E = erase, P = program row, . = untouched
+  printf("\n");
+  for(b=0;b<MEM_BLOCKS;b++) {
+    for(r=0,erase=0;r<MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE;r++) {
+      i=b*MEM_BLOCK_SIZE+r*MEM_PROG_BLOCK_SIZE;
+      change=HRM_RowChange(om+i,nm+i);
+      erase |= change == 2;
+      map[r] = change ? 'P' : '.';
+      full_rows += !HRM_ICP_RowIsEmpty(hrm,MEM_OFFSET+i);
+    }
+    map[r]=0;
+    if(erase) {
+      // The whole block is programmed again after the erase
+      for(r=0;r<MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE;r++) {
+        map[r] = HRM_ICP_RowIsEmpty(hrm,MEM_OFFSET+b*MEM_BLOCK_SIZE+r*MEM_PROG_BLOCK_SIZE) ? '.' : 'P';
+      }
+    }
+    for(r=0;map[r];r++) {
+      rows += map[r] == 'P';
+    }
+    erased+=erase;
+    printf("0x%04X: %c %s\n",MEM_OFFSET+b*MEM_BLOCK_SIZE,erase ? 'E' : '-',map);
+  }
+
+  // Timing model of the default device (learned by --calibrate on this host)
+  hrm->profile=&HRM_Profiles[0];
+  HRM_LoadCalibration(hrm);
+  delta_ms=erased*hrm->erase_wait + rows*hrm->row_wait;
+  full_ms=MEM_BLOCKS*hrm->erase_wait + full_rows*hrm->row_wait;
+
+  printf("\n%d bytes changed in %d ranges\n",bytes,ranges);
+  printf("Delta flash: erase %2d of %d blocks, program %3d rows, ~%.2f s\n",
+         erased,MEM_BLOCKS,rows,delta_ms/1000);
+  printf("Full flash : erase %2d of %d blocks, program %3d rows, ~%.2f s\n",
+         MEM_BLOCKS,MEM_BLOCKS,full_rows,full_ms/1000);
+  printf("(%s: row %.1f ms, block erase %.1f ms, %s)\n",hrm->profile->name,
+         hrm->row_wait,hrm->erase_wait,hrm->calibrated ? "calibrated" : "default timing");
+
+  free(old);
+  return(HRM_OK);
+}
+
+// Flash wear tracking ////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_WearCommit                                                                 //
+// ==============                                                                 //
+// - Appends the erases of this session to the wear log and clears the counters.  //
+//   All records go out with a single append, so a crash leaves either all or     //
+//   none of them (a torn tail is ignored when the log is read)                   //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_WearCommit(HRM_Data *hrm)
+{
+  HRM_WearRecord rec[MEM_BLOCKS];
+  char path[MAX_FILENAME_SIZE+1];
+  int i,n=0,ok;
+#ifndef __MINGW32__
+  int fd;
+#else
+  FILE *fp;
+#endif
+
+  memset(rec,0,sizeof(rec));
+  for(i=0;i<MEM_BLOCKS;i++) {
+    if(hrm->erase_count[i]) {
+      memcpy(rec[n].device,hrm->device_id,HRM_DEVICE_ID_SIZE);
+      rec[n].device[HRM_DEVICE_ID_SIZE-1]=0;
+      rec[n].time=time(NULL);
+      rec[n].block=MEM_OFFSET+i*MEM_BLOCK_SIZE;
+      rec[n].erases=hrm->erase_count[i];
+      n++;
+    }
+  }
+  if(n == 0) {
+    return(HRM_OK);
+  }
+
+  HRM_UserFile(hrm->wear_db,HRM_WEAR_FILE,path,sizeof(path));
+#ifndef __MINGW32__
+  if((fd=open(path,O_WRONLY | O_APPEND | O_CREAT,0644)) < 0) {
+    return(HRM_ERROR);
+  }
+  ok = write(fd,rec,n*sizeof(HRM_WearRecord)) == (ssize_t)(n*sizeof(HRM_WearRecord));
+  ok = fsync(fd) == 0 && ok;
+  close(fd);
+#else
+  if((fp=fopen(path,"ab")) == NULL) {
+    return(HRM_ERROR);
+  }
+  ok = fwrite(rec,sizeof(HRM_WearRecord),n,fp) == (size_t)n;
+  ok = fclose(fp) == 0 && ok;
+#endif
+
+  if(!ok) {
+    return(HRM_ERROR);
+  }
+  memset(hrm->erase_count,0,sizeof(hrm->erase_count));
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_WearLoad                                                                   //
+// ============                                                                   //
+// - Sums the erases per block of one device from the wear log                    //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_WearLoad(HRM_Data *hrm, char *device, unsigned int *counts)
+{
+  char path[MAX_FILENAME_SIZE+1];
+  HRM_WearRecord *rec;
+  size_t len,i;
+
+  memset(counts,0,MEM_BLOCKS*sizeof(unsigned int));
+
+  HRM_UserFile(hrm->wear_db,HRM_WEAR_FILE,path,sizeof(path));
+  if((rec=HRM_MapFile(path,&len)) == NULL) {
+    return(HRM_ERROR);
+  }
+  for(i=0;i<len/sizeof(HRM_WearRecord);i++) {
+    if(strncmp(rec[i].device,device,HRM_DEVICE_ID_SIZE) == 0
+       && rec[i].block >= MEM_OFFSET && rec[i].block < MEM_OFFSET+MEM_SIZE) {
+      counts[(rec[i].block-MEM_OFFSET)/MEM_BLOCK_SIZE]+=rec[i].erases;
+    }
+  }
+  HRM_UnmapFile(rec,len);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_WearReport                                                                 //
+// ==============                                                                 //
+// - Prints the erase counts of every device in the wear log (hottest blocks      //
+//   first), or all blocks of one device                                          //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_WearReport(HRM_Data *hrm, char *device)
+{
+  typedef struct { char id[HRM_DEVICE_ID_SIZE]; unsigned int counts[MEM_BLOCKS]; unsigned int last; } HRM_WearDevice;
+  char path[MAX_FILENAME_SIZE+1],when[32];
+  unsigned int endurance = hrm->profile ? hrm->profile->endurance : HRM_Profiles[0].endurance;
+  HRM_WearRecord *rec;
+  HRM_WearDevice *dev=NULL;
+  size_t len,i,n=0;
+  unsigned int b,k,total,hot,done;
+  time_t last;
+
+  HRM_UserFile(hrm->wear_db,HRM_WEAR_FILE,path,sizeof(path));
+  printf("\nWEAR REPORT (%s):\n======================\n",path);
+  if((rec=HRM_MapFile(path,&len)) == NULL) {
+    printf("No wear log yet.\n");
+    return(HRM_OK);
+  }
+
+  // Group by device
+  for(i=0;i<len/sizeof(HRM_WearRecord);i++) {
+    if(*device && strncmp(rec[i].device,device,HRM_DEVICE_ID_SIZE) != 0) {
+      continue;
+    }
+    if(rec[i].block < MEM_OFFSET || rec[i].block >= MEM_OFFSET+MEM_SIZE) {
+      continue;
+    }
+    for(k=0;k<n;k++) {
+      if(strncmp(dev[k].id,rec[i].device,HRM_DEVICE_ID_SIZE) == 0) {
+        break;
+      }
+    }
+    if(k == n) {
+      if((n%16) == 0) {
+        dev=realloc(dev,(n+16)*sizeof(HRM_WearDevice));
+      }
+      memset(&dev[n],0,sizeof(HRM_WearDevice));
+      strncpy(dev[n].id,rec[i].device,HRM_DEVICE_ID_SIZE-1);
+      n++;
+    }
+    dev[k].counts[(rec[i].block-MEM_OFFSET)/MEM_BLOCK_SIZE]+=rec[i].erases;
+    if(rec[i].time > dev[k].last) {
+      dev[k].last=rec[i].time;
+    }
+  }
+  HRM_UnmapFile(rec,len);
+
+  for(k=0;k<n;k++) {
+    for(b=0,total=0;b<MEM_BLOCKS;b++) {
+      total+=dev[k].counts[b];
+    }
+    last=dev[k].last;
+    strftime(when,sizeof(when),"%Y-%m-%d %H:%M",localtime(&last));
+    printf("%-20s %6d erases, last %s\n",dev[k].id,total,when);
+
+    // Hottest blocks first (all of them for a single device)
+    for(i=0; i<(*device ? MEM_BLOCKS : HRM_WEAR_HOTTEST); i++) {
+      for(b=0,hot=0,done=1;b<MEM_BLOCKS;b++) {
+        if(dev[k].counts[b] != (unsigned int)-1 && (done || dev[k].counts[b] > dev[k].counts[hot])) {
+          hot=b;
+          done=0;
+        }
+      }
+      if(done) {
+        break;
+      }
+      printf("  0x%04X: %6d (%.1f%% of %d)\n",MEM_OFFSET+hot*MEM_BLOCK_SIZE,dev[k].counts[hot],
+             100.0*dev[k].counts[hot]/endurance,endurance);
+      dev[k].counts[hot]=(unsigned int)-1;
+    }
+  }
+  if(n == 0) {
+    printf("No entries.\n");
+  }
+  free(dev);
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_HoldsVariant                                                           //
+// ====================                                                           //
+// - Reads the ICP flag back and compares it to the one in the flag block of the  //
+//   variant. Returns 1 if they match (a cleared flag, or no readback: 0)         //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_HoldsVariant(HRM_Data *hrm, HRM_Manifest *m)
+{
+  unsigned int flag_block=(ICP_FLAG_ADDRESS-MEM_OFFSET)/MEM_BLOCK_SIZE;
+  unsigned int flag_row=ICP_FLAG_ADDRESS & ~(MEM_PROG_BLOCK_SIZE-1);
+  unsigned char row[MEM_PROG_BLOCK_SIZE],want[2]={ 0xff, 0xff };
+  HRM_StoreBlock key,*blk;
+
+  if(!(hrm->icp_caps & ICP_CAP_READ)) {
+    return(0);
+  }
+  if(m->block[flag_block]) {
+    key.hash=m->block[flag_block];
+    blk=bsearch(&key,hrm->store.blocks,hrm->store.nblocks,sizeof(HRM_StoreBlock),HRM_CompareBlock);
+    if(blk == NULL) {
+      return(0);
+    }
+    memcpy(want,blk->data+ICP_FLAG_ADDRESS-MEM_OFFSET-flag_block*MEM_BLOCK_SIZE,2);
+  }
+  if(HRM_ICP_ReadFlash(hrm,flag_row,row,MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+    return(0);
+  }
+  return(memcmp(row+ICP_FLAG_ADDRESS-flag_row,want,2) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_Plan                                                                   //
+// ============                                                                   //
+// - Decides per block whether it is erased, and per row whether it is            //
+//   programmed. Blocks near their endurance budget (or all, with --delta) are    //
+//   read back: identical rows are skipped, erased rows (all 0xFF) are programmed //
+//   without erase, and only a block with a row that holds other data gets        //
+//   erased. A row that isn't all 0xFF has been programmed since the last erase   //
+//   and may not be programmed over (cumulative high voltage time of the JB8      //
+//   flash).                                                                      //
+//   With --from-variant, blocks that hash the same as in the variant the device  //
+//   holds are skipped without any readback, once the ICP flag read back shows    //
+//   the variant is still there. The flag block itself is never skipped.          //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_Plan(HRM_Data *hrm)
+{
+  unsigned int counts[MEM_BLOCKS],b,r,i,addr,worn=0,erased=0,rows=0,same=0;
+  unsigned int flag_block=(ICP_FLAG_ADDRESS-MEM_OFFSET)/MEM_BLOCK_SIZE;
+  unsigned char row[MEM_PROG_BLOCK_SIZE],*want;
+  int near,erase,held;
+
+  HRM_WearLoad(hrm,hrm->device_id,counts);
+
+  held = hrm->from_variant && HRM_ICP_HoldsVariant(hrm,hrm->from_variant);
+  if(hrm->from_variant && !held) {
+    HRM_printf(hrm->verbose_mode,"\nNOTE: ICP flag isn't the one of \"%s\", no block skipped by hash\n",
+               hrm->from_variant->name);
+  }
+
+  for(b=0;b<MEM_BLOCKS;b++) {
+    addr=MEM_OFFSET+b*MEM_BLOCK_SIZE;
+
+    if(held && b != flag_block
+       && hrm->from_variant->block[b] == HRM_BlockHash(hrm->mem+b*MEM_BLOCK_SIZE)) {
+      hrm->erase_block[b]=0;
+      memset(hrm->program_row+b*(MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE),0,MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE);
+      same++;
+      continue;
+    }
+
+    near = hrm->profile && hrm->profile->endurance
+           && counts[b]*100 >= hrm->profile->endurance*HRM_WEAR_NEAR;
+    worn+=near;
+    erase=1;
+
+    if((hrm->delta || near) && (hrm->icp_caps & ICP_CAP_READ)) {
+      erase=0;
+      for(r=0; r<MEM_BLOCK_SIZE/MEM_PROG_BLOCK_SIZE && !erase; r++) {
+        i=addr+r*MEM_PROG_BLOCK_SIZE;
+        want=hrm->mem+i-MEM_OFFSET;
+        if(HRM_ICP_ReadFlash(hrm,i,row,MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+          erase=1;
+          break;
+        }
+        hrm->program_row[(i-MEM_OFFSET)/MEM_PROG_BLOCK_SIZE] = memcmp(row,want,MEM_PROG_BLOCK_SIZE) != 0;
+        if(hrm->program_row[(i-MEM_OFFSET)/MEM_PROG_BLOCK_SIZE]) {
+          for(i=0;i<MEM_PROG_BLOCK_SIZE && row[i] == 0xff;i++) ;
+          erase = i < MEM_PROG_BLOCK_SIZE;
+        }
+      }
+    }
+
+    hrm->erase_block[b]=erase;
+    if(erase) {
+      erased++;
+      for(i=addr;i<addr+MEM_BLOCK_SIZE;i+=MEM_PROG_BLOCK_SIZE) {
+        hrm->program_row[(i-MEM_OFFSET)/MEM_PROG_BLOCK_SIZE] = !HRM_ICP_RowIsEmpty(hrm,i);
+      }
+    }
+    for(i=addr;i<addr+MEM_BLOCK_SIZE;i+=MEM_PROG_BLOCK_SIZE) {
+      rows+=hrm->program_row[(i-MEM_OFFSET)/MEM_PROG_BLOCK_SIZE];
+    }
+  }
+  hrm->plan_valid=1;
+
+  if(worn) {
+    HRM_printf(hrm->verbose_mode,"\nNOTE: %d blocks of \"%s\" are near their endurance, avoiding erases\n",
+               worn,hrm->device_id);
+    if(!(hrm->icp_caps & ICP_CAP_READ)) {
+      HRM_printf(hrm->verbose_mode,"NOTE: ICP firmware can't read back, erasing anyway\n");
+    }
+  }
+  HRM_printf(hrm->verbose_mode,"\nPlan: erase %d of %d blocks, program %d rows\n",
+             erased,MEM_BLOCKS,rows);
+  if(hrm->from_variant) {
+    HRM_printf(hrm->verbose_mode,"      %d blocks same as in \"%s\"\n",same,hrm->from_variant->name);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ICP_RestoreFlag                                                            //
+// ===================                                                            //
+// - After HRM_ICP_MatchFlash() matched all but the ICP flag: programs the flag   //
+//   row again, if it reads back erased, else erases and programs its block       //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ICP_RestoreFlag(HRM_Data *hrm)
+{
+  memset(hrm->repair_block,0,sizeof(hrm->repair_block));
+  if(HRM_ICP_RepairRow(hrm,ICP_FLAG_ADDRESS & ~(MEM_PROG_BLOCK_SIZE-1)) == HRM_ERROR
+     || HRM_ICP_RepairBlocks(hrm) == HRM_ERROR) {
+    hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+    return(HRM_ERROR);
+  }
+  hrm->flag_stale=0;
+  return(HRM_OK);
+}
+
+// Status board viewer ////////////////////////////////////////////////////////////////////////
+
+// Duration for the status board: "850 ms", "12.3 s", "5:03"
+static char *HRM_StatusTime(double ms, char *buf, int len)
+{
+  if(ms < 1000) {
+    snprintf(buf,len,"%.0f ms",ms);
+  } else if(ms < 60000) {
+    snprintf(buf,len,"%.1f s",ms/1000);
+  } else {
+    snprintf(buf,len,"%d:%02d",(int)(ms/60000),(int)(ms/1000)%60);
+  }
+  return(buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_StatusView                                                                 //
+// ==============                                                                 //
+// - Shows the status board of all stations, refreshed until interrupted. The     //
+//   slots are read straight from the shared memory, the stations don't notice.   //
+//   Prints the board once, if stdout is not a terminal                           //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_StatusView(HRM_Data *hrm)
+{
+  HRM_StatusBoard *b;
+  HRM_StatusSlot s;
+  char pid[16],addr[8],rows[16],t1[16],t2[16],t3[16],t4[16],*result;
+  int i,n,torn,alive,finished,live=isatty(1);
+  double now,end;
+
+  hrm->last_errorcode=0;
+
+  if((b=HRM_StatusMap(*hrm->status_view ? hrm->status_view : NULL)) == NULL) {
+    hrm->last_errorcode=HRM_FILE_OPEN_ERROR;
+    return(HRM_ERROR);
+  }
+
+  for(;;) {
+    now=HRM_GetTimeMs();
+    if(live) {
+      printf("\033[H\033[J");
+    }
+    printf("%-16s %7s %-10s %4s %9s %5s %8s %8s %8s %8s  %s\n","STATION","PID","PHASE","ADDR",
+           "ROWS","RETRY","IN PHASE","TOTAL","ERASE","PROGRAM","IMAGE / RESULT");
+
+    for(i=0,n=0;i<HRM_STATUS_SLOTS;i++) {
+      if(b->slot[i].pid == 0) {
+        continue;
+      }
+      torn = HRM_StatusRead(&b->slot[i],&s) == HRM_ERROR;
+      if(s.phase >= HRM_PHASE_COUNT) {
+        continue;
+      }
+      n++;
+
+      // A run that is over stops its clocks; so does a station that went away
+      alive=HRM_StatusAlive(s.pid);
+      finished = s.phase == HRM_PHASE_DONE || s.phase == HRM_PHASE_FAILED;
+      end = finished ? s.changed : alive ? now : s.updated;
+      if(!finished) {
+        s.phase_ms[s.phase]+=end-s.changed;
+      }
+
+      if(alive) {
+        snprintf(pid,sizeof(pid),"%d",s.pid);
+      } else {
+        snprintf(pid,sizeof(pid),"-");
+      }
+      if(s.addr) {
+        snprintf(addr,sizeof(addr),"%04X",s.addr);
+      } else {
+        snprintf(addr,sizeof(addr),"-");
+      }
+      if(s.rows_total) {
+        snprintf(rows,sizeof(rows),"%d/%d",s.rows_done,s.rows_total);
+      } else {
+        snprintf(rows,sizeof(rows),"-");
+      }
+
+      if(torn) {
+        result="(torn update)";
+      } else if(s.phase == HRM_PHASE_DONE) {
+        result="OK";
+      } else if(s.phase == HRM_PHASE_FAILED) {
+        result=HRM_Errors[s.result < sizeof(HRM_Errors)/sizeof(HRM_Errors[0]) ? s.result : 0];
+      } else if(!alive) {
+        result="exited";
+      } else {
+        result="";
+      }
+
+      s.name[HRM_STATUS_NAME_SIZE-1]=0;
+      s.image[HRM_STATUS_NAME_SIZE-1]=0;
+      printf("%-16s %7s %-10s %4s %9s %5d %8s %8s %8s %8s  %s %.*s\n",s.name,pid,
+             HRM_PhaseNames[s.phase],addr,rows,s.retries,
+             HRM_StatusTime((finished || alive ? now : s.updated)-s.changed,t1,sizeof(t1)),
+             HRM_StatusTime(end-s.started,t2,sizeof(t2)),
+             HRM_StatusTime(s.phase_ms[HRM_PHASE_ERASE],t3,sizeof(t3)),
+             HRM_StatusTime(s.phase_ms[HRM_PHASE_PROGRAM],t4,sizeof(t4)),
+             s.image,(int)strcspn(result,"\n"),result);
+    }
+
+    if(!live) {
+      break;
+    }
+    printf("\n%d stations, refreshing every %d ms, Ctrl-C to quit\n",n,HRM_STATUS_REFRESH);
+    fflush(stdout);
+    Sleep(HRM_STATUS_REFRESH);
+  }
+  return(HRM_OK);
+}
+
+// Gang programming ///////////////////////////////////////////////////////////////////////////
+//
+// Every board of a fixture gets its own session, split into short tasks: open
+// and plan, erase one block, program one row, verify a few rows. A task ends
+// where the device makes the host wait; the board is then parked until its
+// status is due, and any worker continues it. Each worker runs the boards of
+// its own deque (newest first, so a board stays on the worker that has it
+// warm) and steals the oldest ones of the others when it has nothing to do.
+// Idle workers sleep; one of them keeps the time of the earliest parked
+// board. Arriving boards are picked up by the bus scan of the main thread.
+//
+// Every task is one or two control transfers. Transfers to boards behind one
+// hub share its transaction translator and wait for each other, and a worker
+// blocked in one of them can't serve any other board. So a task only starts,
+// if its host controller and every hub on the way have a free place
+// (--per-bus, --per-hub); else the board waits in the queue of the node, and
+// the worker goes on with boards on other hubs and controllers.
+
+#define HRM_GANG_OPEN       0
+#define HRM_GANG_MASS_ERASE 1
+#define HRM_GANG_ERASE      2
+#define HRM_GANG_PROGRAM    3
+#define HRM_GANG_VERIFY     4
+#define HRM_GANG_CLOSE      5
+#define HRM_GANG_APP_CHECK  6
+
+#ifndef __MINGW32__
+
+typedef struct HRM_GangBoard {
+  HRM_Data hrm;                      // Session of this board
+  char path[HRM_GANG_PATH_SIZE];     // "bus/device"
+  char port[HRM_GANG_PATH_SIZE];     // Port path ("" = unknown)
+  unsigned int node[HRM_GANG_MAX_DEPTH]; // Its host controller and hubs
+  unsigned int nnodes;
+  double queued;                     // When it had to wait for a node
+  unsigned char active;              // Being programmed
+  unsigned char finished;            // Done or failed, kept until it leaves the bus
+  int task;                          // HRM_GANG_xxx
+  unsigned int next;                 // Block or row the task is at
+  unsigned char waiting;             // Request sent, the status is due next
+  double sent;                       // When the request went out
+  double due;                        // Parked until
+  double started;
+} HRM_GangBoard;
+
+struct HRM_Gang;
+
+// Host controller or hub
+typedef struct HRM_GangNode {
+  char name[HRM_GANG_PATH_SIZE];     // "bus 001", or the port path of a hub
+  unsigned int limit;                // Tasks in flight (0 = any)
+  unsigned int inflight,inflight_max;
+  unsigned int tasks;                // Tasks run through it
+  unsigned int waits;                // ...of them after a wait in the queue
+  double wait_total,wait_max;        // Queue wait (ms)
+  HRM_GangBoard *queue[HRM_GANG_MAX_BOARDS];
+  unsigned int nqueue;
+} HRM_GangNode;
+
+// Boards ready to run. Only one task of a board exists at a time, so a ring
+// of HRM_GANG_MAX_BOARDS never fills up.
+typedef struct HRM_GangDeque {
+  pthread_mutex_t lock;
+  HRM_GangBoard *board[HRM_GANG_MAX_BOARDS];
+  unsigned int top,bottom;           // Thieves take at the top, the owner at the bottom
+  struct HRM_Gang *gang;
+  unsigned int id;
+} HRM_GangDeque;
+
+typedef struct HRM_Gang {
+  HRM_Data *image;                   // Loaded and checked image, the template of the sessions
+  char *image_name;
+  unsigned int nworkers;
+  HRM_GangDeque deque[HRM_GANG_MAX_WORKERS];
+  pthread_t thread[HRM_GANG_MAX_WORKERS];
+
+  pthread_mutex_t lock;              // All of the rest
+  pthread_cond_t wake;               // Idle workers: work, or an earlier due time
+  pthread_cond_t done;               // Main thread: a board finished
+  HRM_GangBoard *parked[HRM_GANG_MAX_BOARDS];
+  unsigned int nparked;
+  double timer_due;                  // The worker keeping the time wakes up then (0 = none does)
+  unsigned int idle;                 // Workers waiting for wake
+  unsigned char stop;
+
+  unsigned int started,active,ok,failed;
+  unsigned char first_error;
+  double late_total,late_max;        // How much later than due the parked boards ran (ms)
+  unsigned int late_count;
+
+  HRM_GangNode node[HRM_GANG_MAX_NODES];
+  unsigned int nnodes;
+
+  HRM_GangBoard board[HRM_GANG_MAX_BOARDS];
+} HRM_Gang;
+
+static void HRM_GangPush(HRM_GangDeque *d, HRM_GangBoard *b)
+{
+  pthread_mutex_lock(&d->lock);
+  d->board[d->bottom++ % HRM_GANG_MAX_BOARDS]=b;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static HRM_GangBoard *HRM_GangPop(HRM_GangDeque *d)
+{
+  HRM_GangBoard *b=NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if(d->bottom != d->top) {
+    b=d->board[--d->bottom % HRM_GANG_MAX_BOARDS];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return(b);
+}
+
+static HRM_GangBoard *HRM_GangSteal(HRM_GangDeque *d)
+{
+  HRM_GangBoard *b=NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if(d->bottom != d->top) {
+    b=d->board[d->top++ % HRM_GANG_MAX_BOARDS];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return(b);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangAdmit                                                                  //
+// =============                                                                  //
+// - Takes a place on the controller and the hubs of the board for its next task //
+//   and returns 1. If one of them is full, the board waits in its queue: 0       //
+////////////////////////////////////////////////////////////////////////////////////
+static int HRM_GangAdmit(HRM_Gang *gang, HRM_GangBoard *b)
+{
+  HRM_GangNode *n;
+  unsigned int i;
+
+  if(b->nnodes == 0) {
+    return(1);
+  }
+
+  pthread_mutex_lock(&gang->lock);
+  for(i=0;i<b->nnodes;i++) {
+    n=&gang->node[b->node[i]];
+    if(n->limit && n->inflight >= n->limit) {
+      b->queued=HRM_GetTimeMs();
+      n->queue[n->nqueue++]=b;
+      pthread_mutex_unlock(&gang->lock);
+      return(0);
+    }
+  }
+  for(i=0;i<b->nnodes;i++) {
+    n=&gang->node[b->node[i]];
+    n->tasks++;
+    if(++n->inflight > n->inflight_max) {
+      n->inflight_max=n->inflight;
+    }
+  }
+  pthread_mutex_unlock(&gang->lock);
+  return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangRelease                                                                //
+// ===============                                                                //
+// - Gives back the places of a finished task. The boards waiting for one of the  //
+//   nodes go to the worker's deque in order of arrival, to try again             //
+////////////////////////////////////////////////////////////////////////////////////
+static void HRM_GangRelease(HRM_Gang *gang, HRM_GangBoard *b, HRM_GangDeque *own)
+{
+  HRM_GangNode *n;
+  unsigned int i,j,woken=0;
+  double now,wait;
+
+  if(b->nnodes == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&gang->lock);
+  now=HRM_GetTimeMs();
+  for(i=0;i<b->nnodes;i++) {
+    n=&gang->node[b->node[i]];
+    n->inflight--;
+    for(j=0;j<n->nqueue;j++) {
+      wait=now-n->queue[j]->queued;
+      n->waits++;
+      n->wait_total+=wait;
+      if(wait > n->wait_max) {
+        n->wait_max=wait;
+      }
+      HRM_GangPush(own,n->queue[j]);
+      woken++;
+    }
+    n->nqueue=0;
+  }
+  if(woken && gang->idle) {
+    pthread_cond_signal(&gang->wake);
+  }
+  pthread_mutex_unlock(&gang->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangTopology                                                               //
+// ================                                                               //
+// - Finds or adds the nodes of a board: its host controller, and each hub of     //
+//   its port path ("1-1.3.2": the hubs 1-1 and 1-1.3). Called with the lock held //
+////////////////////////////////////////////////////////////////////////////////////
+static void HRM_GangTopology(HRM_Gang *gang, HRM_GangBoard *b, char *bus, char *port)
+{
+  char name[HRM_GANG_PATH_SIZE];
+  unsigned int i,limit;
+  char *dot;
+
+  b->nnodes=0;
+  snprintf(name,sizeof(name),"bus %.15s",bus);
+  dot=port;
+  for(;;) {
+    limit = b->nnodes ? gang->image->per_hub : gang->image->per_bus;
+    for(i=0; i<gang->nnodes && strcmp(gang->node[i].name,name) != 0; i++);
+    if(i == gang->nnodes && i < HRM_GANG_MAX_NODES) {
+      strcpy(gang->node[i].name,name);
+      gang->node[i].limit=limit;
+      gang->nnodes++;
+    }
+    if(i < gang->nnodes && b->nnodes < HRM_GANG_MAX_DEPTH) {
+      b->node[b->nnodes++]=i;
+    }
+
+    // Next hub on the way: up to the next dot
+    if(dot == NULL || (dot=strchr(dot,'.')) == NULL) {
+      break;
+    }
+    snprintf(name,sizeof(name),"%.*s",(int)(dot-port),port);
+    dot++;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangFinish                                                                 //
+// ==============                                                                 //
+// - Ends the session of a board: wear log, USB, status board and a result line   //
+////////////////////////////////////////////////////////////////////////////////////
+static double HRM_GangFinish(HRM_GangBoard *b)
+{
+  HRM_Data *hrm=&b->hrm;
+
+  HRM_WearCommit(hrm);
+  if(hrm->usb_dev) {
+    HRM_ICP_CloseUSB(hrm);
+    hrm->usb_dev=NULL;
+  }
+  if(hrm->last_errorcode) {
+    HRM_StatusPhase(hrm,HRM_PHASE_FAILED);
+    printf("%s: FAILED, %s",b->path,HRM_Errors[hrm->last_errorcode]);
+  } else {
+    HRM_StatusPhase(hrm,HRM_PHASE_DONE);
+    printf("%s: OK in %.2f s\n",b->path,(HRM_GetTimeMs()-b->started)/1000);
+  }
+  fflush(stdout);
+
+  // The slot keeps the result on the board, until the next board on this path
+  if(hrm->status_board) {
+#ifndef __MINGW32__
+    munmap(hrm->status_board,sizeof(HRM_StatusBoard));
+#endif
+    hrm->status_board=NULL;
+    hrm->status=NULL;
+  }
+  return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangStep                                                                   //
+// ============                                                                   //
+// - Runs one task of a board. Returns 0, if the next one can run right away,     //
+//   the time to continue at, if the device is busy, or -1, if the board is done  //
+////////////////////////////////////////////////////////////////////////////////////
+double HRM_GangStep(HRM_Gang *gang, HRM_GangBoard *b)
+{
+  HRM_Data *hrm=&b->hrm;
+  char name[HRM_STATUS_NAME_SIZE+HRM_GANG_PATH_SIZE],version[HRM_VERSION_SIZE];
+  usb_dev_handle *dev;
+  unsigned int i,addr,n,erase=0;
+  int status,result;
+  double now=HRM_GetTimeMs();
+
+  switch(b->task) {
+
+  case HRM_GANG_OPEN:
+    hrm->usb_path=b->path;
+    if(HRM_ICP_InitUSB(hrm) == HRM_ERROR) {
+      hrm->usb_dev=NULL;
+      return(HRM_GangFinish(b));
+    }
+    if(hrm->status_file) {
+      snprintf(name,sizeof(name),"%s %s",hrm->status_name ? hrm->status_name : "usb",b->path);
+      HRM_StatusOpen(hrm,name,gang->image_name);
+    }
+    HRM_StatusPhase(hrm,HRM_PHASE_ERASE);
+    HRM_ICP_Plan(hrm);
+    for(i=0;i<MEM_BLOCKS;i++) {
+      erase+=hrm->erase_block[i];
+    }
+    for(i=0;i<MEM_ROWS;i++) {
+      hrm->progress_total+=hrm->program_row[i];
+    }
+    printf("%s: \"%s\", erase %d blocks, program %d rows\n",b->path,hrm->device_id,
+           erase,hrm->progress_total);
+    fflush(stdout);
+    b->task = erase == MEM_BLOCKS && (hrm->icp_caps & ICP_CAP_MASS_ERASE)
+              ? HRM_GANG_MASS_ERASE : HRM_GANG_ERASE;
+    return(0);
+
+  case HRM_GANG_MASS_ERASE:
+    if(!b->waiting) {
+      HRM_StatusUpdate(hrm,MEM_OFFSET,0);
+      if(HRM_ICP_EraseRequest(hrm,MEM_OFFSET,MEM_OFFSET+MEM_SIZE-1) >= 0) {
+        for(i=0;i<MEM_BLOCKS;i++) {
+          hrm->erase_count[i]++;
+        }
+        b->waiting=1;
+        b->sent=now;
+        return(now+hrm->mass_erase_wait);
+      }
+      status=HRM_ERROR;
+    } else {
+      status=HRM_ICP_GetStatus(hrm);
+      if(status == ICP_STATUS_BUSY && now-b->sent <= TIMEOUT_MASS_ERASE) {
+        return(now+WAIT_STATUS);
+      }
+      b->waiting=0;
+    }
+    // Block by block, as HRM_ICP_EraseFlash does
+    if(status != ICP_STATUS_OK) {
+      HRM_StatusUpdate(hrm,0,1);
+      b->task=HRM_GANG_ERASE;
+      return(0);
+    }
+    b->task=HRM_GANG_PROGRAM;
+    HRM_StatusPhase(hrm,HRM_PHASE_PROGRAM);
+    return(0);
+
+  case HRM_GANG_ERASE:
+    if(!b->waiting) {
+      while(b->next < MEM_BLOCKS && !hrm->erase_block[b->next]) {
+        b->next++;
+      }
+      if(b->next == MEM_BLOCKS) {
+        b->task=HRM_GANG_PROGRAM;
+        b->next=0;
+        HRM_StatusPhase(hrm,HRM_PHASE_PROGRAM);
+        return(0);
+      }
+      addr=MEM_OFFSET+b->next*MEM_BLOCK_SIZE;
+      HRM_StatusUpdate(hrm,addr,0);
+      if(HRM_ICP_EraseRequest(hrm,addr,addr+MEM_BLOCK_SIZE-1) < 0) {
+        hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+        return(HRM_GangFinish(b));
+      }
+      hrm->erase_count[b->next]++;
+      b->waiting=1;
+      b->sent=now;
+      return(now+hrm->erase_wait);
+    }
+    status=HRM_ICP_GetStatus(hrm);
+    if(status == ICP_STATUS_BUSY && now-b->sent <= TIMEOUT_ERASE) {
+      return(now+WAIT_STATUS);
+    }
+    if(status != ICP_STATUS_OK) {
+      hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
+      return(HRM_GangFinish(b));
+    }
+    b->waiting=0;
+    b->next++;
+    return(now+WAIT_ERASE);
+
+  case HRM_GANG_PROGRAM:
+    if(!b->waiting) {
+      while(b->next < MEM_ROWS && !hrm->program_row[b->next]) {
+        b->next++;
+      }
+      if(b->next == MEM_ROWS) {
+        b->next=0;
+        if(hrm->verify_distance && (hrm->icp_caps & ICP_CAP_READ)) {
+          b->task=HRM_GANG_VERIFY;
+          HRM_StatusPhase(hrm,HRM_PHASE_VERIFY);
+        } else {
+          b->task=HRM_GANG_CLOSE;
+        }
+        return(0);
+      }
+      if(HRM_ICP_ProgramRow(hrm,MEM_OFFSET+b->next*MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+        hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+        return(HRM_GangFinish(b));
+      }
+      b->waiting=1;
+      b->sent=now;
+      return(now+hrm->row_wait);
+    }
+    status=HRM_ICP_GetStatus(hrm);
+    if(status == ICP_STATUS_BUSY && now-b->sent <= TIMEOUT_PROGRAMMING) {
+      return(now+WAIT_STATUS);
+    }
+    b->waiting=0;
+    if(status != ICP_STATUS_OK
+       && HRM_ICP_RepairRow(hrm,MEM_OFFSET+b->next*MEM_PROG_BLOCK_SIZE) == HRM_ERROR) {
+      hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
+      return(HRM_GangFinish(b));
+    }
+    b->next++;
+    HRM_ICP_Progress(hrm,1);
+    return(now+WAIT_STATUS);
+
+  case HRM_GANG_VERIFY:
+    for(n=0; b->next < MEM_ROWS && n < HRM_GANG_VERIFY_ROWS; b->next++) {
+      if(!hrm->program_row[b->next]) {
+        continue;
+      }
+      n++;
+      addr=MEM_OFFSET+b->next*MEM_PROG_BLOCK_SIZE;
+      if(HRM_ICP_VerifyRow(hrm,addr) == HRM_ERROR && HRM_ICP_RepairRow(hrm,addr) == HRM_ERROR) {
+        hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+        return(HRM_GangFinish(b));
+      }
+    }
+    if(b->next == MEM_ROWS) {
+      b->task=HRM_GANG_CLOSE;
+    }
+    return(0);
+
+  case HRM_GANG_APP_CHECK:
+    // The application on the port the board had in ICP mode
+    if((dev=HRM_OpenUSBPort(HID_VID,HID_PID,b->port))) {
+      result=HRM_AppAsk(dev,version,sizeof(version));
+      HRM_CloseUSB(dev);
+      if(result >= 0) {
+        HRM_AppVersion(hrm,result,version);
+        return(HRM_GangFinish(b));
+      }
+    }
+    if(now-b->sent < hrm->app_check*1000.0) {
+      return(now+HRM_GANG_APP_POLL);
+    }
+    hrm->last_errorcode=HRM_APP_ERROR;
+    return(HRM_GangFinish(b));
+  }
+
+  // All rows programmed: the blocks that need an erase to be repaired
+  if(b->task == HRM_GANG_CLOSE && HRM_ICP_RepairBlocks(hrm) == HRM_ERROR) {
+    hrm->last_errorcode=HRM_FLASH_VERIFY_ERROR;
+  }
+
+  // Start the application: bus reset, then wait for it in HID mode on the same
+  // port (a power cycle would hold the hub for the whole off time)
+  if(b->task == HRM_GANG_CLOSE && hrm->app_check && hrm->last_errorcode == 0) {
+    if(b->port[0] == 0) {
+      hrm->last_errorcode=HRM_APP_ERROR;
+      return(HRM_GangFinish(b));
+    }
+    HRM_StatusPhase(hrm,HRM_PHASE_APP);
+    usb_reset(hrm->usb_dev);
+    HRM_ICP_CloseUSB(hrm);
+    hrm->usb_dev=NULL;
+    b->task=HRM_GANG_APP_CHECK;
+    b->sent=now;
+    return(now+HRM_GANG_APP_POLL);
+  }
+  return(HRM_GangFinish(b));
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangWorker                                                                 //
+// ==============                                                                 //
+// - Worker thread: runs boards from its own deque, steals from the others,       //
+//   takes the parked boards that are due, or sleeps                              //
+////////////////////////////////////////////////////////////////////////////////////
+static void *HRM_GangWorker(void *arg)
+{
+  HRM_GangDeque *own=arg;
+  HRM_Gang *gang=own->gang;
+  HRM_GangBoard *b,*p;
+  struct timespec ts;
+  unsigned int i,more;
+  int timeout;
+  double now,due,earliest,late,target;
+
+  for(;;) {
+    b=HRM_GangPop(own);
+    for(i=1; b == NULL && i<gang->nworkers; i++) {
+      b=HRM_GangSteal(&gang->deque[(own->id+i)%gang->nworkers]);
+    }
+
+    if(b == NULL) {
+      pthread_mutex_lock(&gang->lock);
+
+      // Boards whose wait is over: the first runs here, the rest are left to steal
+      now=HRM_GetTimeMs();
+      earliest=0;
+      more=0;
+      for(i=0;i<gang->nparked;) {
+        p=gang->parked[i];
+        if(p->due > now) {
+          if(earliest == 0 || p->due < earliest) {
+            earliest=p->due;
+          }
+          i++;
+          continue;
+        }
+        late=now-p->due;
+        gang->late_total+=late;
+        gang->late_count++;
+        if(late > gang->late_max) {
+          gang->late_max=late;
+        }
+        gang->parked[i]=gang->parked[--gang->nparked];
+        if(b == NULL) {
+          b=p;
+        } else {
+          HRM_GangPush(own,p);
+          more=1;
+        }
+      }
+      if(more) {
+        pthread_cond_broadcast(&gang->wake);
+      }
+
+      if(b == NULL) {
+        if(gang->stop) {
+          pthread_mutex_unlock(&gang->lock);
+          break;
+        }
+        // One idle worker keeps the time, the others wait for work. It wakes up
+        // early by the learned overshoot and spins the rest, like HRM_WaitUntil()
+        gang->idle++;
+        if(earliest && gang->timer_due == 0) {
+          gang->timer_due=earliest;
+          target=HRM_TimerTarget(earliest);
+          HRM_MsToTimespec(target,&ts);
+          timeout = pthread_cond_timedwait(&gang->wake,&gang->lock,&ts) == ETIMEDOUT;
+          gang->idle--;
+          // Off to work: another idle worker keeps the time
+          timeout = timeout && gang->timer_due == earliest;
+          gang->timer_due=0;
+          if(gang->nparked && gang->idle) {
+            pthread_cond_signal(&gang->wake);
+          }
+          pthread_mutex_unlock(&gang->lock);
+          if(timeout) {
+            HRM_TimerLearn(target);
+            HRM_WaitUntil(earliest);
+          }
+          continue;
+        } else {
+          pthread_cond_wait(&gang->wake,&gang->lock);
+          gang->idle--;
+        }
+        pthread_mutex_unlock(&gang->lock);
+        continue;
+      }
+      pthread_mutex_unlock(&gang->lock);
+    }
+
+    if(!HRM_GangAdmit(gang,b)) {
+      continue;
+    }
+    due=HRM_GangStep(gang,b);
+    HRM_GangRelease(gang,b,own);
+
+    if(due == 0) {
+      HRM_GangPush(own,b);
+    } else if(due > 0) {
+      pthread_mutex_lock(&gang->lock);
+      b->due=due;
+      gang->parked[gang->nparked++]=b;
+      // Earlier than the time kept: whoever wakes up first keeps it instead
+      if(gang->timer_due == 0 || due < gang->timer_due) {
+        gang->timer_due=0;
+        pthread_cond_broadcast(&gang->wake);
+      }
+      pthread_mutex_unlock(&gang->lock);
+    } else {
+      pthread_mutex_lock(&gang->lock);
+      b->active=0;
+      b->finished=1;
+      gang->active--;
+      if(b->hrm.last_errorcode) {
+        gang->failed++;
+        if(gang->first_error == 0) {
+          gang->first_error=b->hrm.last_errorcode;
+        }
+      } else {
+        gang->ok++;
+      }
+      pthread_cond_signal(&gang->done);
+      pthread_mutex_unlock(&gang->lock);
+    }
+  }
+  return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangScan                                                                   //
+// ============                                                                   //
+// - Looks for ICP boards on the bus: a new one gets a session and its first      //
+//   task, a finished one that is gone frees its place                            //
+////////////////////////////////////////////////////////////////////////////////////
+// ICP boards found by a scan
+typedef struct HRM_GangFound {
+  HRM_Gang *gang;
+  unsigned int n;
+  char path[HRM_GANG_MAX_BOARDS][HRM_GANG_PATH_SIZE];
+  char port[HRM_GANG_MAX_BOARDS][HRM_GANG_PATH_SIZE];
+  char busname[HRM_GANG_MAX_BOARDS][HRM_GANG_PATH_SIZE];
+} HRM_GangFound;
+
+static int HRM_GangMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_GangFound *f=arg;
+
+  if(dev->descriptor.idVendor == ICP_VID && dev->descriptor.idProduct == ICP_PID) {
+    snprintf(f->path[f->n],sizeof(f->path[0]),"%.15s/%.15s",bus->dirname,dev->filename);
+    snprintf(f->busname[f->n],sizeof(f->busname[0]),"%.15s",bus->dirname);
+    if(HRM_PortPath(bus,dev,f->port[f->n],sizeof(f->port[0])) == HRM_ERROR) {
+      f->port[f->n][0]=0;
+    }
+    // Only the boards of the fixture's slots
+    if(HRM_SlotMatch(f->gang->image->slots,f->port[f->n])) {
+      f->n++;
+    }
+  }
+  return(f->n >= HRM_GANG_MAX_BOARDS);
+}
+
+static void HRM_GangScan(HRM_Gang *gang)
+{
+  HRM_GangFound found;
+  unsigned int npath,i,j,present;
+  HRM_GangBoard *b;
+  char (*path)[HRM_GANG_PATH_SIZE]=found.path;
+  char (*port)[HRM_GANG_PATH_SIZE]=found.port;
+  char (*busname)[HRM_GANG_PATH_SIZE]=found.busname;
+
+  found.gang=gang;
+  found.n=0;
+  HRM_USBEach(HRM_GangMatch,&found);
+  npath=found.n;
+
+  pthread_mutex_lock(&gang->lock);
+
+  for(i=0;i<HRM_GANG_MAX_BOARDS;i++) {
+    b=&gang->board[i];
+    if(!b->finished) {
+      continue;
+    }
+    for(j=0,present=0; j<npath && !present; j++) {
+      present = strcmp(b->path,path[j]) == 0;
+    }
+    if(!present) {
+      b->finished=0;
+      b->path[0]=0;
+    }
+  }
+
+  for(j=0;j<npath;j++) {
+    if(gang->image->gang_limit && gang->started >= gang->image->gang_limit) {
+      break;
+    }
+    for(i=0,present=0; i<HRM_GANG_MAX_BOARDS && !present; i++) {
+      present = strcmp(gang->board[i].path,path[j]) == 0;
+    }
+    for(i=0; !present && i<HRM_GANG_MAX_BOARDS && gang->board[i].path[0]; i++);
+    if(present || i == HRM_GANG_MAX_BOARDS) {
+      continue;
+    }
+
+    // A session of its own, from the loaded image
+    b=&gang->board[i];
+    memcpy(&b->hrm,gang->image,sizeof(HRM_Data));
+    b->hrm.usb_dev=NULL;
+    b->hrm.status=NULL;
+    b->hrm.status_board=NULL;
+    b->hrm.progress=NULL;
+    b->hrm.progress_done=b->hrm.progress_total=0;
+    b->hrm.device_id[0]=0;
+    b->hrm.plan_valid=0;
+    b->hrm.verbose_mode=0;
+    b->hrm.last_errorcode=0;
+    memset(b->hrm.erase_count,0,sizeof(b->hrm.erase_count));
+    memset(b->hrm.repair_block,0,sizeof(b->hrm.repair_block));
+    strcpy(b->path,path[j]);
+    strcpy(b->port,port[j]);
+    HRM_GangTopology(gang,b,busname[j],port[j][0] ? port[j] : NULL);
+    b->active=1;
+    b->finished=0;
+    b->task=HRM_GANG_OPEN;
+    b->next=0;
+    b->waiting=0;
+    b->started=HRM_GetTimeMs();
+
+    gang->active++;
+    HRM_GangPush(&gang->deque[gang->started++ % gang->nworkers],b);
+    pthread_cond_signal(&gang->wake);
+  }
+
+  pthread_mutex_unlock(&gang->lock);
+}
+
+// Parallel ICP flag clear: one thread per board, released together
+typedef struct HRM_ClearSlot {
+  HRM_Data *hrm;
+  usb_dev_handle *dev;
+  char port[HRM_GANG_PATH_SIZE];
+  unsigned int key1,key2;
+  pthread_barrier_t *start;
+  int result;                        // Of the SetFeature request
+  int powered;                       // Hub port power cycled
+  double icp;                        // When it was back in ICP mode (0 = not yet)
+} HRM_ClearSlot;
+
+// Boards of a parallel flag clear, as enumerated
+typedef struct HRM_ClearFound {
+  HRM_Data *hrm;
+  HRM_ClearSlot *slot;
+  unsigned int n;
+  unsigned int present;              // ICP boards on the slots
+} HRM_ClearFound;
+
+// The boards in HID mode on the slots, opened
+static int HRM_ClearHIDMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_ClearFound *f=arg;
+  HRM_ClearSlot *slot=&f->slot[f->n];
+
+  if(dev->descriptor.idVendor != HID_VID || dev->descriptor.idProduct != HID_PID) {
+    return(0);
+  }
+  if(HRM_PortPath(bus,dev,slot->port,sizeof(slot->port)) == HRM_ERROR) {
+    snprintf(slot->port,sizeof(slot->port),"%.15s/%.15s",bus->dirname,dev->filename);
+    if(f->hrm->slots) {
+      return(0);
+    }
+  }
+  if(HRM_SlotMatch(f->hrm->slots,slot->port) && (slot->dev=usb_open(dev))) {
+    f->n++;
+  }
+  return(f->n >= HRM_GANG_MAX_BOARDS);
+}
+
+// The boards back in ICP mode: when they were first seen
+static int HRM_ClearICPMatch(struct usb_bus *bus, struct usb_device *dev, void *arg)
+{
+  HRM_ClearFound *f=arg;
+  char port[HRM_GANG_PATH_SIZE];
+  unsigned int i;
+
+  if(dev->descriptor.idVendor != ICP_VID || dev->descriptor.idProduct != ICP_PID
+     || HRM_PortPath(bus,dev,port,sizeof(port)) == HRM_ERROR) {
+    return(0);
+  }
+  f->present += HRM_SlotMatch(f->hrm->slots,port);
+  for(i=0;i<f->n;i++) {
+    if(f->slot[i].icp == 0 && strcmp(f->slot[i].port,port) == 0) {
+      f->slot[i].icp=HRM_GetTimeMs();
+    }
+  }
+  return(0);
+}
+
+static void *HRM_ClearWorker(void *arg)
+{
+  HRM_ClearSlot *c=arg;
+  unsigned char tmp[8];
+
+  pthread_barrier_wait(c->start);
+  c->result=-1;
+  if(usb_set_configuration(c->dev,1) >= 0) {
+    usb_clear_halt(c->dev,0);
+    usb_resetep(c->dev,0);
+    c->result=usb_control_msg(c->dev,0x21,0x09,c->key1,c->key2,(char *)tmp,8,10000);
+  }
+  HRM_CloseUSB(c->dev);
+  if(c->result >= 0 && c->hrm->power_cycle && c->port[0]) {
+    HRM_USBDetach(HID_VID,HID_PID,c->port,c->hrm->power_settle);
+    c->powered = HRM_PowerCycle(c->hrm,c->port) == HRM_OK;
+  }
+  return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_ClearICPFlagAll                                                            //
+// ===================                                                            //
+// - Clears the ICP flag of every board in HID mode (on the slots), all at the    //
+//   same time, and waits until they are back in ICP mode together. ready is the  //
+//   number of boards in ICP mode on the slots afterwards                         //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_ClearICPFlagAll(HRM_Data *hrm, unsigned int key1, unsigned int key2, unsigned int *ready)
+{
+  HRM_ClearFound found;
+  HRM_ClearSlot *slot;
+  pthread_t *thread;
+  pthread_barrier_t start;
+  unsigned int n,i,sent=0,back,present,replug;
+  double t,deadline;
+  int watch;
+
+  hrm->last_errorcode=0;
+  *ready=0;
+  slot=calloc(HRM_GANG_MAX_BOARDS,sizeof(HRM_ClearSlot));
+  thread=calloc(HRM_GANG_MAX_BOARDS,sizeof(pthread_t));
+  if(slot == NULL || thread == NULL) {
+    free(slot);
+    free(thread);
+    hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+    return(HRM_ERROR);
+  }
+
+  found.hrm=hrm;
+  found.slot=slot;
+  found.n=0;
+  HRM_USBEach(HRM_ClearHIDMatch,&found);
+  n=found.n;
+
+  // All keys at the same time
+  watch=HRM_USBWatch();
+  t=HRM_GetTimeMs();
+  if(n) {
+    pthread_barrier_init(&start,NULL,n);
+    for(i=0;i<n;i++) {
+      slot[i].hrm=hrm;
+      slot[i].key1=key1;
+      slot[i].key2=key2;
+      slot[i].start=&start;
+      if(pthread_create(&thread[i],NULL,HRM_ClearWorker,&slot[i]) != 0) {
+        // Can't start them together: the rest goes one after the other
+        pthread_barrier_destroy(&start);
+        pthread_barrier_init(&start,NULL,1);
+        for(;i<n;i++) {
+          slot[i].hrm=hrm;
+          slot[i].key1=key1;
+          slot[i].key2=key2;
+          slot[i].start=&start;
+          HRM_ClearWorker(&slot[i]);
+          thread[i]=0;
+        }
+        break;
+      }
+    }
+    for(i=0;i<n;i++) {
+      if(thread[i]) {
+        pthread_join(thread[i],NULL);
+      }
+    }
+    pthread_barrier_destroy(&start);
+  }
+  for(i=0;i<n;i++) {
+    if(slot[i].result >= 0) {
+      sent++;
+    }
+  }
+  HRM_printf(hrm->verbose_mode,"%d boards in HID mode, keys sent to %d\n",n,sent);
+
+  // Wait for all of them at once
+  deadline=t+HRM_CONNECT_TIMEOUT*1000;
+  for(;;) {
+    back=0;
+    found.present=0;
+    HRM_USBEach(HRM_ClearICPMatch,&found);
+    present=found.present;
+    for(i=0,replug=0;i<n;i++) {
+      back += slot[i].icp != 0;
+      replug += slot[i].result >= 0 && !slot[i].powered && slot[i].icp == 0;
+    }
+    if(back >= sent || HRM_GetTimeMs() >= deadline) {
+      break;
+    }
+    if(replug) {
+      HRM_printf(hrm->verbose_mode,"\r>>> Unplug and Replug %d devices in %d seconds... <<<",
+                 replug,(int)((deadline-HRM_GetTimeMs())/1000)+1);
+    }
+    HRM_USBWait(watch,HRM_MIN(1000,deadline-HRM_GetTimeMs()));
+  }
+  if(watch >= 0) {
+    close(watch);
+  }
+  HRM_printf(hrm->verbose_mode,"\r                                                             \r");
+
+  for(i=0;i<n;i++) {
+    if(slot[i].result < 0) {
+      HRM_printf(hrm->verbose_mode,"%-16s FAILED, keys not sent\n",slot[i].port);
+    } else if(slot[i].icp == 0) {
+      HRM_printf(hrm->verbose_mode,"%-16s FAILED, not back in ICP mode%s\n",slot[i].port,
+                 slot[i].powered ? " after the power cycle" : "");
+    } else {
+      HRM_printf(hrm->verbose_mode,"%-16s OK, in ICP mode after %.0f ms%s\n",slot[i].port,
+                 slot[i].icp-t,slot[i].powered ? " (power cycled)" : "");
+    }
+  }
+  HRM_printf(hrm->verbose_mode,"%d of %d boards in ICP mode in %.0f ms\n",back,n,HRM_GetTimeMs()-t);
+
+  *ready=present;
+  free(slot);
+  free(thread);
+  if(back < n) {
+    hrm->last_errorcode=HRM_USB_OPEN_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_GangProgram                                                                //
+// ===============                                                                //
+// - Programs the image to every ICP board that shows up, until gang_limit        //
+//   boards are done (or forever). The first error of a board is returned         //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_GangProgram(HRM_Data *hrm, char *image_name)
+{
+  HRM_Gang *gang;
+  HRM_GangNode *n;
+  char limit[16];
+  pthread_condattr_t attr;
+  struct rusage ru;
+  struct timespec ts;
+  unsigned int i,cores;
+  double start=HRM_GetTimeMs(),cpu;
+
+  hrm->last_errorcode=0;
+
+  if((gang=calloc(1,sizeof(HRM_Gang))) == NULL) {
+    hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+    return(HRM_ERROR);
+  }
+  gang->image=hrm;
+  gang->image_name=image_name;
+
+  cores=sysconf(_SC_NPROCESSORS_ONLN);
+  gang->nworkers = hrm->workers ? hrm->workers : HRM_MIN(HRM_GANG_WORKERS,cores);
+  gang->nworkers = HRM_MAX(1,HRM_MIN(gang->nworkers,HRM_GANG_MAX_WORKERS));
+
+  pthread_mutex_init(&gang->lock,NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+  pthread_cond_init(&gang->wake,&attr);
+  pthread_cond_init(&gang->done,&attr);
+  pthread_condattr_destroy(&attr);
+
+  // All deques first, a worker steals from the others as soon as it runs
+  for(i=0;i<gang->nworkers;i++) {
+    pthread_mutex_init(&gang->deque[i].lock,NULL);
+    gang->deque[i].gang=gang;
+    gang->deque[i].id=i;
+  }
+  for(i=0;i<gang->nworkers;i++) {
+    pthread_create(&gang->thread[i],NULL,HRM_GangWorker,&gang->deque[i]);
+  }
+
+  HRM_printf(hrm->verbose_mode,"Worker threads: %d, waiting for boards%s\n\n",gang->nworkers,
+             hrm->gang_limit ? "" : " (Ctrl-C to quit)");
+
+  for(;;) {
+    HRM_GangScan(gang);
+    pthread_mutex_lock(&gang->lock);
+    if(hrm->gang_limit && gang->started >= hrm->gang_limit && gang->active == 0) {
+      pthread_mutex_unlock(&gang->lock);
+      break;
+    }
+    HRM_MsToTimespec(HRM_GetTimeMs()+HRM_GANG_SCAN_MS,&ts);
+    pthread_cond_timedwait(&gang->done,&gang->lock,&ts);
+    pthread_mutex_unlock(&gang->lock);
+  }
+
+  pthread_mutex_lock(&gang->lock);
+  gang->stop=1;
+  pthread_cond_broadcast(&gang->wake);
+  pthread_mutex_unlock(&gang->lock);
+  for(i=0;i<gang->nworkers;i++) {
+    pthread_join(gang->thread[i],NULL);
+  }
+
+  getrusage(RUSAGE_SELF,&ru);
+  cpu=ru.ru_utime.tv_sec*1000.0+ru.ru_utime.tv_usec/1000.0
+      +ru.ru_stime.tv_sec*1000.0+ru.ru_stime.tv_usec/1000.0;
+  HRM_printf(hrm->verbose_mode,"\n%d boards OK, %d failed in %.2f s\n",gang->ok,gang->failed,
+             (HRM_GetTimeMs()-start)/1000);
+  HRM_printf(hrm->verbose_mode,"Wake-up latency: mean %.3f ms, max %.3f ms over %d waits; CPU %.0f ms\n",
+             gang->late_count ? gang->late_total/gang->late_count : 0,gang->late_max,
+             gang->late_count,cpu);
 
-  // Check error
-  if( (status != 1) || (result != 1)) {
-    hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
-    return(HRM_ERROR);
+  if(gang->nnodes) {
+    HRM_printf(hrm->verbose_mode,"\n%-16s %5s %8s %7s %7s %9s %9s\n","TOPOLOGY","LIMIT","MAX BUSY",
+               "TASKS","WAITED","MEAN WAIT","MAX WAIT");
   }
-  return(HRM_OK);
+  for(i=0;i<gang->nnodes;i++) {
+    n=&gang->node[i];
+    HRM_printf(hrm->verbose_mode,"%-16s %5s %8d %7d %7d %6.2f ms %6.2f ms\n",n->name,
+               n->limit ? (snprintf(limit,sizeof(limit),"%d",n->limit),limit) : "-",
+               n->inflight_max,n->tasks,n->waits,n->waits ? n->wait_total/n->waits : 0,n->wait_max);
+  }
+
+  hrm->last_errorcode=gang->first_error;
+  free(gang);
+  return(hrm->last_errorcode ? HRM_ERROR : HRM_OK);
 }
 
-////////////////////////////////////////////////////////////////////////////////////
-// HRM_ICP_EraseFlash                                                             //
-// ==================                                                             //
-// - Erase whole user area of the Flash memory (0xDC00-0xF7FF)                    //
-////////////////////////////////////////////////////////////////////////////////////
-int HRM_ICP_EraseFlash(HRM_Data *hrm)
+#else
+
+int HRM_ClearICPFlagAll(HRM_Data *hrm, unsigned int key1, unsigned int key2, unsigned int *ready)
 {
-  int i;
+  // Needs threads to send the keys together
+  *ready=0;
+  hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+  return(HRM_ERROR);
+}
 
-  // Reset Errors
-  hrm->last_errorcode=0;
+int HRM_GangProgram(HRM_Data *hrm, char *image_name)
+{
+  // Needs the pthread worker pool
+  hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+  return(HRM_ERROR);
+}
 
-  // ERASE ALL BLOCKS
-  HRM_printf(hrm->verbose_mode,"\nERASING FLASH:\n======================\n");
+#endif
 
-  for(i=MEM_OFFSET; i<MEM_OFFSET+MEM_SIZE; i=i+MEM_BLOCK_SIZE) {
+// Real-time station mode /////////////////////////////////////////////////////////////////////
 
-    HRM_printf(hrm->verbose_mode,"\n0x%04X: ",i);
+// Below the threaded USB interrupt handlers (50) of a PREEMPT_RT kernel,
+// otherwise the transfer completions would wait for us
+#define HRM_RT_PRIORITY 49
+#define HRM_RT_STACK_PREFAULT (64*1024)
 
-    if (HRM_ICP_EraseFlashBlock(hrm, i) == HRM_ERROR) {
-      hrm->last_errorcode=HRM_FLASH_ERASE_ERROR;
-      return(HRM_ERROR);
+#ifndef __MINGW32__
+
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_RT_Enable                                                                  //
+// =============                                                                  //
+// - Pins the process to the listed CPUs ("0,2-3", NULL = keep), switches to      //
+//   SCHED_FIFO and locks all memory. Missing privileges only give warnings.      //
+////////////////////////////////////////////////////////////////////////////////////
+int HRM_RT_Enable(char *cpus)
+{
+  cpu_set_t set;
+  struct sched_param param;
+  unsigned char stack[HRM_RT_STACK_PREFAULT];
+  volatile unsigned char *touch=stack;
+  char *p;
+  long a,b,page;
+
+  if(cpus && *cpus) {
+    CPU_ZERO(&set);
+    for(p=cpus; *p; ) {
+      a=b=strtol(p,&p,10);
+      if(*p == '-') {
+        b=strtol(p+1,&p,10);
+      }
+      if(a < 0 || b < a || b >= CPU_SETSIZE || (*p && *p != ',')) {
+        return(HRM_ERROR);
+      }
+      for(; a<=b; a++) {
+        CPU_SET(a,&set);
+      }
+      if(*p == ',') {
+        p++;
+      }
+    }
+    if(sched_setaffinity(0,sizeof(set),&set) < 0) {
+      printf("WARNING: Can't pin to CPUs %s: %s\n",cpus,strerror(errno));
     }
+  }
 
-    HRM_printf(hrm->verbose_mode,"EEEEEEEE");
+  param.sched_priority=HRM_RT_PRIORITY;
+  if(sched_setscheduler(0,SCHED_FIFO,&param) < 0) {
+    printf("WARNING: Can't set SCHED_FIFO: %s\n",strerror(errno));
   }
 
-  HRM_printf(hrm->verbose_mode,"\n");
+  // The image and all buffers are parsed into memory that can't be paged out
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    printf("WARNING: Can't lock memory: %s\n",strerror(errno));
+  }
+
+  // Fault in the stack now instead of in the middle of programming. Through a
+  // volatile pointer: a memset of a buffer never read again is optimized away
+  page=sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+  for(a=0; a<(long)sizeof(stack); a+=page) {
+    touch[a]=0;
+  }
+  touch[sizeof(stack)-1]=0;
+
   return(HRM_OK);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
-// HRM_ICP_ProgramFlash                                                           //
-// =====================                                                          //
-// - Program whole user area of the Flash memory (0xDC00-0xF7FF)                  //
+// HRM_PrintTimerStats                                                            //
+// ===================                                                            //
+// - Prints how much later than asked the deadline timer has returned             //
 ////////////////////////////////////////////////////////////////////////////////////
-int HRM_ICP_ProgramFlash(HRM_Data *hrm)
+void HRM_PrintTimerStats(void)
 {
-  unsigned char status,result,valid;
-  int i,j,l=0;
-  
-  // Reset Errors
-  hrm->last_errorcode=0;
+  HRM_SleepStats stats,*st=&stats;
+  unsigned int i,n=0,p50=0,p99=0;
 
-  HRM_printf(hrm->verbose_mode,"\nPROGRAMMING FLASH:\n======================\n");
-
-  // PROGRAM ALL BLOCKS
-  for(i=MEM_OFFSET;i<MEM_OFFSET+MEM_SIZE;i=i+MEM_PROG_BLOCK_SIZE) {
+  pthread_mutex_lock(&hrm_sleep_lock);
+  stats=hrm_sleep_stats;
+  pthread_mutex_unlock(&hrm_sleep_lock);
 
-    // Print some progress info
-    if((l%8) == 0) {
-      HRM_printf(hrm->verbose_mode,"\n0x%04X: ",i);
+  if(st->count == 0) {
+    return;
+  }
+  for(i=0;i<HRM_OVERSHOOT_BUCKETS;i++) {
+    n+=st->hist[i];
+    if(!p50 && n*2 >= st->count) {
+      p50=(i+1)*10;
     }
-
-    // Check, if block has something else than "0xff"..
-    valid=0;
-    for(j=0;j<MEM_PROG_BLOCK_SIZE;j++) {
-      if(hrm->mem[i-MEM_OFFSET+j] != 0xff) {
-	valid=1;
-	break;
-      }
+    if(!p99 && n*100 >= st->count*99) {
+      p99=(i+1)*10;
     }
-    
-    if(valid) {
-      // PROGRAM BLOCK
-      result = usb_control_msg(
-			       hrm->usb_dev,       // USB-Device
-			       0x40,
-			       0x81,
-			       i,
-			       i+MEM_PROG_BLOCK_SIZE-1,
-			       hrm->mem + i-MEM_OFFSET,
-			       MEM_PROG_BLOCK_SIZE,
-			       10000);
-
-      // Check error..
-      if( (result != MEM_PROG_BLOCK_SIZE)) {
-	hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
-	return(HRM_ERROR);
-      }      
+  }
+  printf("\nTimer overshoot: %d waits, avg %.0f us, p50 <%d us, p99 <%d us, max %.0f us"
+         " (compensation %.0f us)\n",
+         st->count,st->total_us/st->count,p50,p99,st->max_us,st->compensation_us);
+}
 
-      Sleep(WAIT_PROGRAMMING);
-      
-      // GET RESULT
-      result = usb_control_msg(
-			       hrm->usb_dev,       // USB-Device
-			       0xC0,
-			       0x8F,
-			       0x0000,
-			       0x0000,
-			       &status,
-			       0x01,
-			       10000);
-
-      // Check error..
-      if( (result != 1) || (result != 1)) {
-	hrm->last_errorcode=HRM_FLASH_PROGRAM_ERROR;
-	return(HRM_ERROR);
-      }      
+#else
 
-      Sleep(WAIT_STATUS);    
+int HRM_RT_Enable(char *cpus)
+{
+  printf("WARNING: Real-time mode is not supported on Windows\n");
+  return(HRM_OK);
+}
 
-      HRM_printf(hrm->verbose_mode,"P");
+void HRM_PrintTimerStats(void)
+{
+}
 
-    } else {
-      
-      HRM_printf(hrm->verbose_mode,".");
+#endif
 
-    }
-    l++;
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_OptionValue                                                                //
+// ===============                                                                //
+// - Matches "--name" or "--name=value". Returns the value ("" if none), or       //
+//   NULL if the argument is some other option                                    //
+////////////////////////////////////////////////////////////////////////////////////
+char *HRM_OptionValue(char *arg, char *name)
+{
+  int len=strlen(name);
+
+  if(strncmp(arg,name,len) != 0) {
+    return(NULL);
   }
-  
-  HRM_printf(hrm->verbose_mode,"\n");
-  
-  return(HRM_OK);
+  if(arg[len] == '=') {
+    return(arg+len+1);
+  }
+  return(arg[len] == 0 ? arg+len : NULL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
-// HRM_ClearICPFlag                                                               //
-// =====================                                                          //
-// - Clear ICP Flag when in HID mode.                                             //
+// HRM_ParseOption                                                                //
+// ===============                                                                //
+// - Parses one "--name[=value]" command line option to HRM_Data                  //
 ////////////////////////////////////////////////////////////////////////////////////
-int HRM_ClearICPFlag(unsigned int vid, unsigned int pid,unsigned int key1, unsigned int key2) 
+int HRM_ParseOption(HRM_Data *hrm, char *arg)
 {
-  usb_dev_handle *dev = NULL; /* the device handle */
-  unsigned char result;
-  unsigned char tmp[8];
+  char *value,*end;
 
-  // Open USB
-  if( (dev=HRM_OpenUSB(vid,pid)) == NULL) {
-    return(HRM_ERROR);
-  }
+  // Reset Errors
+  hrm->last_errorcode=0;
 
-  // Set configuration
-  if(usb_set_configuration(dev, 1) < 0)
-    {
-      usb_close(dev);
+  if((value=HRM_OptionValue(arg,"--force"))) {
+    hrm->force=1;
+  } else if((value=HRM_OptionValue(arg,"--no-burst"))) {
+    hrm->no_burst=1;
+  } else if((value=HRM_OptionValue(arg,"--no-smoke"))) {
+    hrm->no_smoke=1;
+  } else if((value=HRM_OptionValue(arg,"--smoke-cycles")) && *value) {
+    hrm->smoke_cycles=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--smoke-marker")) && *value) {
+    hrm->smoke_marker=strtoul(value,NULL,16) & 0xffff;
+  } else if((value=HRM_OptionValue(arg,"--reset-vector")) && *value) {
+    hrm->reset_vector=strtoul(value,NULL,16) & 0xffff;
+  } else if((value=HRM_OptionValue(arg,"--rt"))) {
+    hrm->rt_mode=1;
+    hrm->timer_stats=1;
+    hrm->rt_cpus=value;
+  } else if((value=HRM_OptionValue(arg,"--calibrate"))) {
+    hrm->calibrate = *value ? strtoul(value,NULL,0) : HRM_CALIBRATION_ROUNDS;
+    if(hrm->calibrate == 0) {
+      hrm->last_errorcode=HRM_ARGUMENT_ERROR;
       return(HRM_ERROR);
     }
+  } else if((value=HRM_OptionValue(arg,"--calibration-file"))) {
+    hrm->calibration_file=value;
+  } else if((value=HRM_OptionValue(arg,"--delta"))) {
+    hrm->delta=1;
+  } else if((value=HRM_OptionValue(arg,"--device-id"))) {
+    strncpy(hrm->device_id,value,HRM_DEVICE_ID_SIZE-1);
+  } else if((value=HRM_OptionValue(arg,"--wear-db"))) {
+    hrm->wear_db=value;
+  } else if((value=HRM_OptionValue(arg,"--wear-report"))) {
+    hrm->wear_report=value;
+  } else if((value=HRM_OptionValue(arg,"--store"))) {
+    hrm->store_dir=value;
+  } else if((value=HRM_OptionValue(arg,"--store-add")) && HRM_StoreName(value)) {
+    hrm->store_add=value;
+  } else if((value=HRM_OptionValue(arg,"--store-list"))) {
+    hrm->store_list=1;
+  } else if((value=HRM_OptionValue(arg,"--variant")) && *value) {
+    hrm->variant=value;
+  } else if((value=HRM_OptionValue(arg,"--from-variant")) && *value) {
+    hrm->from_variant_name=value;
+  } else if((value=HRM_OptionValue(arg,"--diff"))) {
+    hrm->diff=1;
+  } else if((value=HRM_OptionValue(arg,"--offset")) && *value) {
+    hrm->load.offset=strtol(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--fill")) && *value) {
+    hrm->load.fill=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--window")) && *value) {
+    // start-end[,start-end...] in hex
+    while(*value) {
+      if(hrm->load.nwindows == HRM_MAX_WINDOWS) {
+        hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+        return(HRM_ERROR);
+      }
+      hrm->load.window[hrm->load.nwindows][0]=strtoul(value,&end,16);
+      if(*end != '-') {
+        hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+        return(HRM_ERROR);
+      }
+      hrm->load.window[hrm->load.nwindows][1]=strtoul(end+1,&end,16);
+      if((*end && *end != ',') || hrm->load.window[hrm->load.nwindows][1] < hrm->load.window[hrm->load.nwindows][0]) {
+        hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+        return(HRM_ERROR);
+      }
+      hrm->load.nwindows++;
+      value = *end ? end+1 : end;
+    }
+  } else if((value=HRM_OptionValue(arg,"--strict-window"))) {
+    hrm->load.strict=1;
+  } else if((value=HRM_OptionValue(arg,"--usb")) && *value) {
+    hrm->usb_path=value;
+  } else if((value=HRM_OptionValue(arg,"--status-board"))) {
+    hrm->status_file = *value ? value : HRM_STATUS_FILE;
+  } else if((value=HRM_OptionValue(arg,"--status-name")) && *value) {
+    hrm->status_name=value;
+  } else if((value=HRM_OptionValue(arg,"--status-view"))) {
+    hrm->status_view=value;
+  } else if((value=HRM_OptionValue(arg,"--gang"))) {
+    hrm->gang=1;
+    hrm->gang_limit=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--slots")) && *value) {
+    hrm->slots=value;
+  } else if((value=HRM_OptionValue(arg,"--workers")) && *value) {
+    hrm->workers=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--app-check"))) {
+    hrm->app_check = *value ? strtoul(value,NULL,0) : HRM_APP_TIMEOUT;
+  } else if((value=HRM_OptionValue(arg,"--power-cycle"))) {
+    hrm->power_cycle = *value ? strtoul(value,NULL,0) : HRM_POWER_OFF_MS;
+  } else if((value=HRM_OptionValue(arg,"--power-settle")) && *value) {
+    hrm->power_settle=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--per-hub")) && *value) {
+    hrm->per_hub=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--per-bus")) && *value) {
+    hrm->per_bus=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--threads"))) {
+    hrm->threads=strtoul(value,NULL,0);
+  } else if((value=HRM_OptionValue(arg,"--timer-stats"))) {
+    hrm->timer_stats=1;
+  } else if((value=HRM_OptionValue(arg,"--verify"))) {
+    hrm->verify_distance = *value ? strtoul(value,NULL,0) : 1;
+    if(hrm->verify_distance == 0) {
+      hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+      return(HRM_ERROR);
+    }
+  } else if((value=HRM_OptionValue(arg,"--status-interval"))) {
+    hrm->status_interval=strtoul(value,NULL,0);
+    if(hrm->status_interval == 0) {
+      hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+      return(HRM_ERROR);
+    }
+  } else {
+    hrm->last_errorcode=HRM_ARGUMENT_ERROR;
+    return(HRM_ERROR);
+  }
+  return(HRM_OK);
+}
 
-  usb_clear_halt(dev,0);
-  usb_resetep(dev,0);
-
-  // Send Set Feature command with keys
-  result = usb_control_msg(
-			   dev,       // USB-Device
-			   0x21,
-			   0x09,
-			   key1,
-			   key2,
-			   tmp,
-			   8,
-			   10000);
-  HRM_CloseUSB(dev);
-  return 0;  
+////////////////////////////////////////////////////////////////////////////////////
+// HRM_Usage                                                                      //
+// =========                                                                      //
+// - Prints the command line help                                                 //
+////////////////////////////////////////////////////////////////////////////////////
+void HRM_Usage(char *name)
+{
+  printf("Usage: %s [options] file.s19 [key1 key2]\n",name);
+  printf("       %s [options] --variant=name [key1 key2]\n",name);
+  printf("       %s --store-add=name file.s19 [--store=dir]\n",name);
+  printf("       %s --store-list [--store=dir]\n",name);
+  printf("       %s --diff old.s19 new.s19\n",name);
+  printf("       %s --wear-report[=id] [--wear-db=f]\n",name);
+  printf("       %s --status-view[=f]\n",name);
+  printf("file.s19 may be compressed, \"-\" (stdin) or /dev/fd/N\n\n");
+  printf("Options:\n");
+  printf("  --force               Reflash even if the device already holds the image\n");
+  printf("  --no-smoke            Don't run the image on the HC08 simulator before flashing\n");
+  printf("  --smoke-cycles=n      Cycles the image runs in the smoke test (default: %d)\n",HRM_SMOKE_CYCLES);
+  printf("  --smoke-marker=addr   Smoke test must reach this address (hex)\n");
+  printf("  --reset-vector=addr   User reset vector (hex, default: %04X)\n",HRM_RESET_VECTOR);
+  printf("  --rt[=cpus]           Real-time mode: pin to cpus (e.g. 0,2-3), SCHED_FIFO, mlockall\n");
+  printf("  --timer-stats         Report the timer overshoot at the end\n");
+  printf("  --calibrate[=n]       Measure erase/program times over n cycles and save them\n");
+  printf("  --calibration-file=f  Calibration file (default: $HOME/%s)\n",HRM_CALIBRATION_FILE);
+  printf("  --delta               Erase/program only what differs on the device\n");
+  printf("  --device-id=id        Device identity for the wear log (default: USB serial)\n");
+  printf("  --wear-db=f           Wear log (default: $HOME/%s)\n",HRM_WEAR_FILE);
+  printf("  --wear-report[=id]    Print the erase counts per device and block\n");
+  printf("  --store=dir           Image store (default: $HOME/%s)\n",HRM_STORE_DIR);
+  printf("  --store-add=name      Add the image to the store as variant 'name'\n");
+  printf("  --store-list          List the variants of the store\n");
+  printf("  --variant=name        Program variant 'name' of the store instead of a file\n");
+  printf("  --from-variant=name   Device holds variant 'name': skip the blocks it shares\n");
+  printf("  --offset=n            Add n to the record addresses (e.g. -0x2000)\n");
+  printf("  --window=s-e[,s-e]    Load only these address ranges (hex)\n");
+  printf("  --strict-window       Reject images with data outside the windows\n");
+  printf("  --fill=byte           Unused bytes of the image (default: 0xFF)\n");
+  printf("  --usb=bus/dev         Board to program, if there are several (as in lsusb)\n");
+  printf("  --status-board[=f]    Publish the progress on the station's status board (default: %s)\n",HRM_STATUS_FILE);
+  printf("  --status-name=name    Name on the status board (default: --usb path or process id)\n");
+  printf("  --status-view[=f]     Show the status board of all stations\n");
+  printf("  --gang[=n]            Program every ICP board that shows up (stop after n boards).\n");
+  printf("                        With keys, first clear the ICP flag of all boards in HID mode\n");
+  printf("  --slots=p1,p2,...     Only the boards on these ports for --gang (as in /sys/bus/usb/devices)\n");
+  printf("  --workers=n           Worker threads for --gang (default: %d)\n",HRM_GANG_WORKERS);
+  printf("  --app-check[=s]       Reset the device after flashing and wait until the application\n");
+  printf("                        answers in HID mode (default: %d s). With --gang by bus reset,\n",HRM_APP_TIMEOUT);
+  printf("                        never a power cycle\n");
+  printf("  --power-cycle[=ms]    Switch the board's hub port off and on after the ICP flag clear,\n");
+  printf("                        instead of asking for a replug (default off time: %d ms)\n",HRM_POWER_OFF_MS);
+  printf("  --power-settle=ms     Before the power cycle, wait up to ms for the board to detach\n");
+  printf("                        (the flag clear writes the flash, default: %d ms)\n",HRM_POWER_SETTLE_MS);
+  printf("  --per-hub=n           Tasks in flight per USB hub for --gang, 0 = any (default: %d)\n",HRM_GANG_PER_HUB);
+  printf("  --per-bus=n           Tasks in flight per host controller for --gang, 0 = any (default: %d)\n",HRM_GANG_PER_BUS);
+  printf("  --threads=n           Parser threads for large files (default: all cores)\n");
+  printf("  --no-burst            Program row by row even if the ICP firmware can do bursts\n");
+  printf("  --status-interval=n   Check program status every n rows (deferred mode)\n");
+  printf("  --verify[=k]          Verify row N-k while row N is programmed (default k=1)\n");
 }
 
 
@@ -527,62 +5858,154 @@ int HRM_ClearICPFlag(unsigned int vid, unsigned int pid,unsigned int key1, unsig
 /////////////////////////////////
 ////////////////////////////////
 
+// Built as a library (e.g. hrm_python.c), the including file has its own entry points
+#ifndef HRM_LIBRARY
 int main(int argc, char **argv)
 {
   HRM_Data hrm;
   unsigned int i,key1,key2;
+  char *args[3],version[HRM_VERSION_SIZE];
+  int nargs=0,first;
+  char name[HRM_STATUS_NAME_SIZE],*image;
+  char port[HRM_GANG_PATH_SIZE];
+  double t,deadline,powered=0;
+  int watch,error;
+  unsigned int ready;
 
   printf("\n");
   printf("======================\n");
   printf("HRM Flashing Tool v1.0\n");
   printf("======================\n");
 
-  // Check, if Keys are entered as an argumet
-  if(argc >= 4) {
-    key1=strtoul(argv[2],NULL,16);
-    key2=strtoul(argv[3],NULL,16);
-    
-    printf("\nCLEARING ICP-FLAG:\n");
-    printf("======================\n");
-    
-    printf("Using keys: 0x%04X, 0x%04X \n",key1,key2);
-    fflush(stdout);    
-    
-    if ( HRM_ClearICPFlag(HID_VID, HID_PID, key1, key2) == HRM_ERROR) {
-      printf("ERROR: Can't Clear ICP Flag!\n");
-      exit(HRM_ERROR);
+  memset(&hrm,0,sizeof(hrm));
+  hrm.smoke_marker=-1;
+  hrm.per_hub=HRM_GANG_PER_HUB;
+  hrm.per_bus=HRM_GANG_PER_BUS;
+  hrm.power_settle=HRM_POWER_SETTLE_MS;
+  hrm.load.fill=0xff;
+  HRM_TimerCalibrate();
+
+  // Options (--name=value) may be anywhere, the rest are positional
+  for(i=1; i<(unsigned int)argc; i++) {
+    if(strncmp(argv[i],"--",2) == 0) {
+      if(HRM_ParseOption(&hrm,argv[i]) == HRM_ERROR) {
+        fprintf(stderr,"%s: ",argv[i]);
+        HRM_CheckError(&hrm);
+      }
+    } else if(nargs < 3) {
+      args[nargs++]=argv[i];
     }
-    
-    printf("\nICP_Flag cleared!\n\n");
-    fflush(stdout);
-    //getc(stdin);
   }
 
-  // Initialize USB.. and wait 30 seconds (1 retry/s) for power cycle... 
-  for(i=30; i>0; i--) {
-    if(HRM_ICP_InitUSB(&hrm) == HRM_OK) {
-    	break;
+  if(hrm.wear_report) {
+    HRM_WearReport(&hrm,hrm.wear_report);
+    exit(0);
+  }
+
+  if(hrm.status_view) {
+    HRM_StatusView(&hrm);
+    HRM_CheckError(&hrm);
+    exit(0);
+  }
+
+  // Preload the image store
+  if(hrm.variant || hrm.from_variant_name || hrm.store_list) {
+    if(HRM_StoreLoad(&hrm) == HRM_ERROR) {
+      HRM_CheckError(&hrm);
+    }
+    if(hrm.store_list) {
+      HRM_StoreList(&hrm);
+      exit(0);
+    }
+    if(hrm.from_variant_name && (hrm.from_variant=HRM_StoreFind(&hrm,hrm.from_variant_name)) == NULL) {
+      hrm.last_errorcode=HRM_STORE_ERROR;
+      fprintf(stderr,"--from-variant=%s: ",hrm.from_variant_name);
+      HRM_CheckError(&hrm);
     }
-    printf("\r>>> Unplug and Replug the device in %d seconds... <<<",i);
-    fflush(stdout);
-    Sleep(1000);
   }
-  HRM_CheckError(&hrm);
-  printf("\r                                                             ");
+
+  if(hrm.diff) {
+    if(nargs != 2) {
+      HRM_Usage(argv[0]);
+      exit(HRM_ARGUMENT_ERROR);
+    }
+    HRM_ImageDiff(&hrm,args[0],args[1]);
+    HRM_CheckError(&hrm);
+    exit(0);
+  }
+
+  // The image comes from the store or from a file, then optional keys
+  first = hrm.variant ? 0 : 1;
+  if((nargs != first && nargs != first+2) || (hrm.variant && hrm.store_add)
+     || (hrm.gang && hrm.calibrate)) {
+    HRM_Usage(argv[0]);
+    exit(HRM_ARGUMENT_ERROR);
+  }
+
+  // Real-time mode before anything is loaded, so it all ends up in locked memory
+  if(hrm.rt_mode && HRM_RT_Enable(hrm.rt_cpus) == HRM_ERROR) {
+    hrm.last_errorcode=HRM_ARGUMENT_ERROR;
+    fprintf(stderr,"--rt=%s: ",hrm.rt_cpus);
+    HRM_CheckError(&hrm);
+  }
 
   // Set verbose mode to 1, ie. have some nice output from functions to screen..
   hrm.verbose_mode = 1;
 
-  // Setup Filename for S19-file
-  hrm.filename = argv[1];
+  if(hrm.variant) {
+    image=hrm.variant;
+  } else {
+    image = strrchr(args[0],'/') ? strrchr(args[0],'/')+1 : args[0];
+  }
 
-  // Read & parse data from S19-file
-  printf("\nCHECKING FILE:\n");
-  printf("======================\n");
-  printf("\"%s\"...",hrm.filename);
-  HRM_ICP_ReadS19(&hrm);
-  HRM_CheckError(&hrm);
-  printf("OK!\n");
+  // Publish the progress for the station's status viewer (a gang: per board)
+  if(hrm.status_file && !hrm.store_add && !hrm.gang) {
+    if(hrm.status_name) {
+      snprintf(name,sizeof(name),"%s",hrm.status_name);
+    } else if(hrm.usb_path) {
+      snprintf(name,sizeof(name),"usb %s",hrm.usb_path);
+    } else {
+      snprintf(name,sizeof(name),"pid %d",(int)getpid());
+    }
+    if(HRM_StatusOpen(&hrm,name,image) == HRM_ERROR) {
+      printf("NOTE: Can't use the status board %s, not publishing\n",hrm.status_file);
+    }
+  }
+  HRM_StatusPhase(&hrm,HRM_PHASE_LOAD);
+
+  if(hrm.variant) {
+    // Variant of the preloaded store
+    printf("\nIMAGE STORE:\n");
+    printf("======================\n");
+    printf("\"%s\"...",hrm.variant);
+    t=HRM_GetTimeMs();
+    HRM_StoreSelect(&hrm,hrm.variant);
+    HRM_CheckError(&hrm);
+    printf("OK! (%.2f ms)\n",HRM_GetTimeMs()-t);
+  } else {
+    // Setup Filename for S19-file
+    hrm.filename = args[0];
+
+    // Read & parse data from S19-file
+    printf("\nCHECKING FILE:\n");
+    printf("======================\n");
+    printf("\"%s\"...",hrm.filename);
+    t=HRM_GetTimeMs();
+    HRM_ICP_ReadS19(&hrm);
+    if(hrm.last_errorcode == HRM_WINDOW_ERROR) {
+      printf("\n%d bytes outside the window, first at 0x%04X\n",hrm.outside,hrm.outside_addr);
+    }
+    HRM_CheckError(&hrm);
+    printf("OK! (%s, %.2f ms)\n",HRM_FormatNames[hrm.format],HRM_GetTimeMs()-t);
+    if(hrm.outside) {
+      printf("NOTE: %d bytes outside the window dropped (first at 0x%04X), use --strict-window to reject\n",
+             hrm.outside,hrm.outside_addr);
+    }
+    if(hrm.conflicts) {
+      printf("NOTE: %d bytes set twice with different data (first at 0x%04X), later records win\n",
+             hrm.conflicts,hrm.conflict_addr);
+    }
+  }
 
   printf("\n");
   printf("ICP FLAGS:\n");
@@ -596,8 +6019,7 @@ int main(int argc, char **argv)
 	   hrm.mem[ICP_FLAG_ADDRESS-MEM_OFFSET],
 	   hrm.mem[ICP_FLAG_ADDRESS-MEM_OFFSET+1]);
 
-    hrm.mem[ICP_FLAG_ADDRESS-MEM_OFFSET]= hrm.icp_flag_calculated >> 8;
-    hrm.mem[ICP_FLAG_ADDRESS-MEM_OFFSET+1]= hrm.icp_flag_calculated & 0xff;
+    HRM_ICP_FixFlag(&hrm);
 
     printf("NEW: %02X%02X\n", 
 	   hrm.mem[ICP_FLAG_ADDRESS-MEM_OFFSET],
@@ -605,17 +6027,204 @@ int main(int argc, char **argv)
 
   }
   fflush(stdout);
+
+  // Store the image (with the fixed ICP Flag) instead of programming it
+  if(hrm.store_add) {
+    printf("\nADDING TO IMAGE STORE:\n");
+    printf("======================\n");
+    HRM_StoreAdd(&hrm,hrm.store_add);
+    HRM_CheckError(&hrm);
+    exit(0);
+  }
+
+  // Run the image in software, before anything is erased
+  if(!hrm.no_smoke) {
+    HRM_StatusPhase(&hrm,HRM_PHASE_SMOKE);
+    printf("\nSMOKE TEST:\n");
+    printf("======================\n");
+    HRM_SmokeTest(&hrm);
+    HRM_CheckError(&hrm);
+  }
+
+  // Program every board of the fixture, as they come. With keys, all of them
+  // enter ICP mode together first
+  if(hrm.gang) {
+    error=0;
+    if(nargs == first+2) {
+      key1=strtoul(args[first],NULL,16);
+      key2=strtoul(args[first+1],NULL,16);
+      printf("\nCLEARING ICP-FLAGS:\n");
+      printf("======================\n");
+      printf("Using keys: 0x%04X, 0x%04X \n",key1,key2);
+      if(HRM_ClearICPFlagAll(&hrm,key1,key2,&ready) == HRM_ERROR && ready == 0) {
+        HRM_CheckError(&hrm);
+      }
+      error=hrm.last_errorcode;
+      if(hrm.gang_limit == 0) {
+        hrm.gang_limit=ready;
+      }
+    }
+
+    printf("\nGANG PROGRAMMING:\n");
+    printf("======================\n");
+    HRM_GangProgram(&hrm,image);
+    if(hrm.last_errorcode == 0) {
+      hrm.last_errorcode=error;
+    }
+    HRM_CheckError(&hrm);
+    if(hrm.timer_stats) {
+      HRM_PrintTimerStats();
+    }
+    exit(0);
+  }
+
+  // Check, if Keys are entered as an argumet
+  if(nargs == first+2) {
+    key1=strtoul(args[first],NULL,16);
+    key2=strtoul(args[first+1],NULL,16);
+    HRM_StatusPhase(&hrm,HRM_PHASE_FLAG);
+    
+    printf("\nCLEARING ICP-FLAG:\n");
+    printf("======================\n");
+    
+    printf("Using keys: 0x%04X, 0x%04X \n",key1,key2);
+    fflush(stdout);    
+
+    // Skip the whole cycle, if the user code already runs this image
+    if(!hrm.force && hrm.version[0]
+       && HRM_HID_GetVersion(HID_VID, HID_PID, version, sizeof(version)) == HRM_OK) {
+      printf("Running version: \"%s\"\n",version);
+      printf("Image version  : \"%s\"\n",hrm.version);
+      if(strcmp(version,hrm.version) == 0) {
+        printf("\nFirmware is up to date, use --force to reflash.\n");
+        HRM_StatusPhase(&hrm,HRM_PHASE_DONE);
+        exit(0);
+      }
+    }
+    
+    // Where the board is, to power cycle it when it is gone
+    port[0]=0;
+    if(hrm.power_cycle && HRM_USBPort(HID_VID,HID_PID,NULL,port,sizeof(port)) == HRM_ERROR) {
+      printf("NOTE: Port of the device unknown, can't power cycle it\n");
+      port[0]=0;
+    }
+
+    if ( HRM_ClearICPFlag(HID_VID, HID_PID, key1, key2) == HRM_ERROR) {
+      printf("ERROR: Can't Clear ICP Flag!\n");
+      HRM_StatusPhase(&hrm,HRM_PHASE_FAILED);
+      exit(HRM_ERROR);
+    }
+    
+    printf("\nICP_Flag cleared!\n\n");
+    fflush(stdout);
+    //getc(stdin);
+  }
+
+  // Initialize USB.. and wait 30 seconds for power cycle, retried whenever a device
+  // shows up. The hub does the power cycle, if it can
+  HRM_StatusPhase(&hrm,HRM_PHASE_CONNECT);
+  watch=HRM_USBWatch();
+  if(nargs == first+2 && port[0]) {
+    if(HRM_USBDetach(HID_VID,HID_PID,port,hrm.power_settle) == HRM_ERROR) {
+      printf("NOTE: Device still in HID mode after %d ms, power cycling anyway\n",hrm.power_settle);
+    }
+    if(HRM_PowerCycle(&hrm,port) == HRM_OK) {
+      powered=HRM_GetTimeMs();
+    }
+  }
+  deadline=HRM_GetTimeMs()+HRM_CONNECT_TIMEOUT*1000;
+  while(HRM_ICP_InitUSB(&hrm) == HRM_ERROR && (t=deadline-HRM_GetTimeMs()) > 0) {
+    if(powered) {
+      printf("\r>>> Waiting for the device in ICP mode, %d seconds... <<<",(int)(t/1000)+1);
+    } else {
+      printf("\r>>> Unplug and Replug the device in %d seconds... <<<",(int)(t/1000)+1);
+    }
+    fflush(stdout);
+    HRM_USBWait(watch,t-(int)((t-1)/1000)*1000);
+  }
+  if(watch >= 0) {
+    close(watch);
+  }
+  HRM_CheckError(&hrm);
+  printf("\r                                                             ");
+  if(powered) {
+    printf("\rIn ICP mode %.0f ms after power on\n",HRM_GetTimeMs()-powered);
+  }
+
+  // Learn the timings of this device and host, leaves the image programmed
+  if(hrm.calibrate) {
+    HRM_ICP_Calibrate(&hrm,hrm.calibrate);
+    HRM_WearCommit(&hrm);
+    HRM_CheckError(&hrm);
+    HRM_ICP_CloseUSB(&hrm);
+    HRM_StatusPhase(&hrm,HRM_PHASE_DONE);
+    exit(0);
+  }
+
+  if(hrm.calibrated) {
+    printf("\nCalibrated waits: row %.1f ms, block erase %.1f ms, mass erase %.1f ms\n",
+           hrm.row_wait,hrm.erase_wait,hrm.mass_erase_wait);
+  }
+
+  // Nothing to do, if the device already holds this image
+  printf("\nFingerprint: %016llX\n",HRM_Hash(hrm.mem,MEM_SIZE,HRM_HASH_INIT));
+  if(!hrm.force) {
+    HRM_StatusPhase(&hrm,HRM_PHASE_MATCH);
+    t=HRM_GetTimeMs();
+    if(HRM_ICP_MatchFlash(&hrm) == HRM_OK) {
+      printf("Device already holds this image (checked in %.0f ms), use --force to reflash.\n",
+             HRM_GetTimeMs()-t);
+      if(hrm.flag_stale) {
+        printf("Restoring the ICP flag\n");
+        HRM_ICP_RestoreFlag(&hrm);
+        HRM_WearCommit(&hrm);
+        HRM_CheckError(&hrm);
+      }
+      if(hrm.app_check) {
+        HRM_StatusPhase(&hrm,HRM_PHASE_APP);
+        printf("\nAPPLICATION CHECK:\n");
+        printf("======================\n");
+        HRM_AppCheck(&hrm);
+        HRM_CheckError(&hrm);
+      } else {
+        HRM_ICP_CloseUSB(&hrm);
+      }
+      HRM_StatusPhase(&hrm,HRM_PHASE_DONE);
+      exit(0);
+    }
+  }
+  
+  // Which blocks to erase and rows to program
+  HRM_StatusPhase(&hrm,HRM_PHASE_ERASE);
+  HRM_ICP_Plan(&hrm);
   
   // ERASE ALL BLOCKS  
   HRM_ICP_EraseFlash(&hrm);
+  HRM_WearCommit(&hrm);
   HRM_CheckError(&hrm);
 
   // PROGRAM FLASH
+  HRM_StatusPhase(&hrm,HRM_PHASE_PROGRAM);
   HRM_ICP_ProgramFlash(&hrm);
+  HRM_WearCommit(&hrm);
   HRM_CheckError(&hrm);
 
-  // CLOSE
-  HRM_ICP_CloseUSB(&hrm);
+  // START THE APPLICATION, or CLOSE
+  if(hrm.app_check) {
+    HRM_StatusPhase(&hrm,HRM_PHASE_APP);
+    printf("\nAPPLICATION CHECK:\n");
+    printf("======================\n");
+    HRM_AppCheck(&hrm);
+    HRM_CheckError(&hrm);
+  } else {
+    HRM_ICP_CloseUSB(&hrm);
+  }
+  HRM_StatusPhase(&hrm,HRM_PHASE_DONE);
+
+  if(hrm.timer_stats) {
+    HRM_PrintTimerStats();
+  }
   
   exit(0);
 }
+#endif
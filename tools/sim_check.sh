@@ -0,0 +1,292 @@
+#!/bin/sh
+#################################################################
+# HC908JB8 USB ICP Manager - simulator scenarios
+# =============================================================
+#
+# Builds manage.c against the simulator (hrm_sim.c) and runs the
+# deferred status and fault injection paths, the image inputs, the
+# image store, the smoke test, the application check, gang
+# programming and the Python module. Every scenario checks the exit
+# code and, where the run must succeed, that the simulated flash
+# holds the image afterwards.
+#
+# Usage: sh tools/sim_check.sh   (needs gcc; zlib and python3-config
+#                                 for the gzip and Python scenarios)
+#
+#################################################################
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+MANAGE=$DIR/manage_sim
+FAILED=0
+
+# With gzip input, if zlib is there
+ZLIB=1
+gcc -DHRM_SIM -DHRM_ZLIB "$TOOLS/manage.c" "$TOOLS/hc08_cpu.c" "$TOOLS/hrm_sim.c" \
+    -o "$MANAGE" -lpthread -lz -O2 2>/dev/null || {
+  ZLIB=0
+  gcc -DHRM_SIM "$TOOLS/manage.c" "$TOOLS/hc08_cpu.c" "$TOOLS/hrm_sim.c" \
+      -o "$MANAGE" -lpthread -O2 || exit 1
+}
+
+# Test image: a loop at 0xDC00 (passes the smoke test), 40 rows of data
+# from 0xE000 and the reset vector. bump is added to the byte at 0xE000
+image()
+{
+  awk -v bump="$1" 'BEGIN {
+    print "S00600004844521B"
+    print "S116DC009C450100944F4CB780CDDC2041100220F520FE76"
+    print "S106DC20BE80813E"
+    for(r=0;r<40;r++) {
+      for(h=0;h<64;h+=16) {
+        a=57344+r*64+h
+        line=sprintf("S113%04X",a)
+        sum=19+int(a/256)+a%256
+        for(i=0;i<16;i++) {
+          v=(r*7+h+i*13+(a+i == 57344 ? bump : 0))%256
+          line=line sprintf("%02X",v)
+          sum+=v
+        }
+        print line sprintf("%02X",255-sum%256)
+      }
+    }
+    print "S105F7FCDC002B"
+    print "S9030000FC"
+  }'
+}
+image 0 > "$DIR/image.s19"
+image 1 > "$DIR/image2.s19"
+
+# The S1 records moved by an offset, with new checksums
+relocate()
+{
+  awk -v offset="$1" 'function hex(s,  i,v) {
+    v=0
+    for(i=1;i<=length(s);i++) {
+      v=v*16+index("0123456789ABCDEF",substr(s,i,1))-1
+    }
+    return v
+  }
+  /^S1/ {
+    line=sprintf("S1%s%04X%s",substr($0,3,2),(hex(substr($0,5,4))+offset+65536)%65536,
+                 substr($0,9,length($0)-10))
+    sum=0
+    for(i=3;i<length(line);i+=2) {
+      sum+=hex(substr(line,i,2))
+    }
+    print line sprintf("%02X",255-sum%256)
+    next
+  }
+  { print }'
+}
+relocate -8192 < "$DIR/image.s19" > "$DIR/low.s19"
+
+# Smoke test failures: an illegal opcode (0xAC) at the entry, a reset vector into
+# erased flash. And data outside the flash
+sed 's/^S116DC009C\(.*\)76$/S116DC00AC\166/' "$DIR/image.s19" > "$DIR/illegal.s19"
+sed 's/^S105F7FCDC002B$/S105F7FCF00017/' "$DIR/image.s19" > "$DIR/erased.s19"
+sed 's/^S9030000FC$/S1050100AABB94/' "$DIR/image.s19" > "$DIR/outside.s19"
+echo "S9030000FC" >> "$DIR/outside.s19"
+
+# Over HRM_PARALLEL_MIN: the data records many times over, so it is parsed in
+# parallel with --threads. A wrong checksum halfway
+awk 'NR == 1 { print; next } /^S1/ { rec[n++]=$0 }
+     END { for(r=0;r<200;r++) for(i=0;i<n;i++) print rec[i]; print "S9030000FC" }' \
+    "$DIR/image.s19" > "$DIR/big.s19"
+awk 'NR == 14000 { sub(/..$/,"00") } { print }' "$DIR/big.s19" > "$DIR/bigbad.s19"
+
+fail()
+{
+  sed 's/^/      /' "$DIR/out" | tail -20
+  FAILED=$((FAILED+1))
+}
+
+# The simulated flash holds the image (and the options to load it)
+holds()
+{
+  name=$1
+  shift
+  if ! env HRM_SIM_FLASH="$DIR/flash" "$MANAGE" --wear-db="$DIR/wear" "$@" 2>&1 \
+       | grep -q "already holds"; then
+    echo "FAIL: $name: flash doesn't hold the image"
+    FAILED=$((FAILED+1))
+  fi
+}
+
+# check name expected-exit-code expected-output "VAR=value ..." options...
+# Runs the tool with just these options, on the flash of the scenarios before
+check()
+{
+  name=$1 code=$2 expect=$3 vars=$4
+  shift 4
+  env HRM_SIM_FLASH="$DIR/flash" $vars "$MANAGE" --wear-db="$DIR/wear" "$@" > "$DIR/out" 2>&1
+  result=$?
+  if [ $result -ne "$code" ]; then
+    echo "FAIL: $name: exit code $result, expected $code"
+  elif [ -n "$expect" ] && ! grep -q "$expect" "$DIR/out"; then
+    echo "FAIL: $name: no \"$expect\" in the output"
+  else
+    echo "ok:   $name"
+    return 0
+  fi
+  fail
+  return 1
+}
+
+# scenario name expected-exit-code expected-output "VAR=value ..." options...
+# Programs the test image on an erased flash. An expected exit code of 0 also
+# needs the image on the simulated flash
+scenario()
+{
+  name=$1 code=$2 expect=$3 vars=$4
+  shift 4
+  rm -f "$DIR"/flash*
+  if check "$name" "$code" "$expect" "$vars" --force --no-burst "$@" "$DIR/image.s19" \
+     && [ "$code" -eq 0 ]; then
+    holds "$name" "$DIR/image.s19"
+  fi
+}
+
+scenario "row by row"                  0 "PROGRAMMING"    ""
+scenario "deferred status"             0 "Deferred status" "" --status-interval=8
+scenario "deferred, bit errors"        0 "repaired"       "HRM_SIM_FAULTS=program:biterr=0.05" \
+         --status-interval=8 --verify
+scenario "deferred, stock firmware"    0 "can't do deferred" "HRM_SIM_STOCK=1" --status-interval=8
+scenario "deferred, busy status"       0 "Deferred status" "HRM_SIM_FAULTS=status:busy=0.2" \
+         --status-interval=8
+scenario "deferred, erase timeout"     0 "Deferred status" "HRM_SIM_FAULT_SCRIPT=erase#1:timeout" \
+         --status-interval=8
+scenario "deferred, disconnect"        5 ""               "HRM_SIM_FAULT_SCRIPT=program#5:disconnect" \
+         --status-interval=8
+scenario "deferred, program stalls"    5 ""               "HRM_SIM_FAULTS=program:stall=1" \
+         --status-interval=8
+scenario "row by row, stalls"          0 ""               "HRM_SIM_FAULTS=any:stall=0.01" --verify
+
+# Match: a board that holds the image is skipped, another image is programmed
+check    "match, skip"                 0 "already holds"  "" "$DIR/image.s19"
+check    "match, other image"          0 "PROGRAMMING"    "" --no-burst "$DIR/image2.s19" \
+  && holds "match, other image" "$DIR/image2.s19"
+
+# Image store: add variants, program one, then skip the blocks the next one shares
+check    "store add"                   0 "7 new"          "" --store="$DIR/store" --store-add=v1 \
+         "$DIR/image.s19"
+check    "store add, shared blocks"    0 "6 shared"       "" --store="$DIR/store" --store-add=v2 \
+         "$DIR/image2.s19"
+check    "store add, bad name"         6 ""               "" --store="$DIR/store" --store-add=../v3 \
+         "$DIR/image.s19"
+rm -f "$DIR/flash"
+check    "store variant"               0 "PROGRAMMING"    "" --store="$DIR/store" --variant=v1 \
+         --force --no-burst \
+  && holds "store variant" "$DIR/image.s19"
+check    "store from-variant"          0 "12 blocks same" "" --store="$DIR/store" --variant=v2 \
+         --from-variant=v1 --force --no-burst \
+  && holds "store from-variant" "$DIR/image2.s19"
+
+# Image input: compressed, stdin, relocated, windowed, filled
+if [ $ZLIB -eq 1 ]; then
+  gzip -c "$DIR/image.s19" > "$DIR/image.s19.gz"
+  rm -f "$DIR/flash"
+  check  "gzip input"                  0 "gzip"           "" --force --no-burst "$DIR/image.s19.gz" \
+    && holds "gzip input" "$DIR/image.s19"
+else
+  echo "skip: gzip input (no zlib)"
+fi
+rm -f "$DIR/flash"
+check    "stdin input"                 0 "PROGRAMMING"    "" --force --no-burst - < "$DIR/image.s19" \
+  && holds "stdin input" "$DIR/image.s19"
+rm -f "$DIR/flash"
+check    "relocated"                   0 "PROGRAMMING"    "" --offset=0x2000 --force --no-burst \
+         "$DIR/low.s19" \
+  && holds "relocated" "$DIR/image.s19"
+rm -f "$DIR/flash"
+check    "window, data outside"        0 "dropped"        "" --window=DC00-F7FF --force --no-burst \
+         "$DIR/outside.s19" \
+  && holds "window, data outside" "$DIR/image.s19"
+check    "strict window"               11 ""              "" --window=DC00-F7FF --strict-window \
+         --force "$DIR/outside.s19"
+rm -f "$DIR/flash"
+check    "fill"                        0 "PROGRAMMING"    "" --fill=0 --force --no-burst "$DIR/image.s19" \
+  && holds "fill" --fill=0 "$DIR/image.s19"
+
+# Parsers: sequential and parallel build the same image, both reject a bad record
+if check "parse sequential"            0 ""               "" --threads=1 --store="$DIR/store" \
+         --store-add=seq "$DIR/big.s19" \
+   && check "parse parallel"           0 ""               "" --threads=4 --store="$DIR/store" \
+         --store-add=par "$DIR/big.s19"; then
+  if cmp -s "$DIR/store/variants/seq.manifest" "$DIR/store/variants/par.manifest"; then
+    echo "ok:   parsers agree"
+  else
+    echo "FAIL: parsers agree: the manifests differ"
+    FAILED=$((FAILED+1))
+  fi
+fi
+check    "parse sequential, bad record" 9 ""              "" --threads=1 --store="$DIR/store" \
+         --store-add=bad "$DIR/bigbad.s19"
+check    "parse parallel, bad record"  9 ""               "" --threads=4 --store="$DIR/store" \
+         --store-add=bad "$DIR/bigbad.s19"
+
+# Image diff
+check    "diff"                        0 "1 bytes changed" "" --diff "$DIR/image.s19" "$DIR/image2.s19"
+
+# Smoke test
+check    "smoke, illegal opcode"       10 "illegal opcode" "" --force "$DIR/illegal.s19"
+check    "smoke, erased flash"         10 "erased flash"  "" --force "$DIR/erased.s19"
+
+# Leaving ICP mode: the application check, the ICP flag clear with a power cycle
+scenario "app check"                   0 "Application version" "HRM_SIM_APP_VERSION=HDR" \
+         --app-check=5
+scenario "app check, other version"    12 "but the image" "HRM_SIM_APP_VERSION=OLD" --app-check=5
+rm -f "$DIR/flash"
+check    "power cycle"                 0 "Power cycled"   "HRM_SIM_MODE=hid HRM_SIM_HUB_POWER=1
+         HRM_SIM_TOPOLOGY=1-1.1" --force --no-burst --power-cycle "$DIR/image.s19" 0x1111 0x2222 \
+  && holds "power cycle" "$DIR/image.s19"
+
+# Gang: boards behind two hubs, with the application check, and all of them
+# cleared in parallel first
+TOPOLOGY=HRM_SIM_TOPOLOGY=1-1.1,1-1.2,1-2.1,1-2.2
+scenario "gang, hubs"                  0 "4 boards OK"    "HRM_SIM_BOARDS=4 $TOPOLOGY" --gang=4 \
+         --verify
+scenario "gang, app check"             0 "4 boards OK"    "HRM_SIM_BOARDS=4 $TOPOLOGY
+         HRM_SIM_APP_VERSION=HDR" --gang=4 --app-check=5
+rm -f "$DIR"/flash*
+check    "gang, parallel clear"        0 "keys sent to 4" "HRM_SIM_MODE=hid HRM_SIM_BOARDS=4
+         $TOPOLOGY HRM_SIM_HUB_POWER=1" --force --no-burst --power-cycle --gang "$DIR/image.s19" \
+         0x1111 0x2222 \
+  && if ! grep -q "4 boards OK" "$DIR/out"; then
+       echo "FAIL: gang, parallel clear: not all boards programmed"
+       fail
+     fi
+
+# Python module: import, load, program (its wear log goes to $HOME)
+if command -v python3-config > /dev/null 2>&1 \
+   && gcc -shared -fPIC -DHRM_SIM $(python3-config --includes) "$TOOLS/hrm_python.c" \
+          "$TOOLS/hc08_cpu.c" "$TOOLS/hrm_sim.c" -I"$TOOLS" \
+          -o "$DIR/hrm$(python3-config --extension-suffix)" -lpthread -O2 2>/dev/null; then
+  rm -f "$DIR/flash"
+  HOME="$DIR" HRM_SIM_FLASH="$DIR/flash" PYTHONPATH="$DIR" python3 -c '
+import sys, hrm
+s = hrm.Session(device_id="sim")
+s.load(sys.argv[1])
+s.smoke_test()
+s.open()
+s.erase()
+s.program()
+print("verify", s.verify())
+s.close()' "$DIR/image.s19" > "$DIR/out" 2>&1
+  if grep -q "verify True" "$DIR/out"; then
+    echo "ok:   python"
+    holds "python" "$DIR/image.s19"
+  else
+    echo "FAIL: python: the board doesn't verify"
+    fail
+  fi
+else
+  echo "skip: python (no python3-config)"
+fi
+
+if [ $FAILED -ne 0 ]; then
+  echo "$FAILED scenarios failed"
+  exit 1
+fi
+echo "All scenarios passed"